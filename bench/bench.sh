@@ -0,0 +1,224 @@
+#!/bin/bash
+# Loopback benchmark: runs server and client over a fixed matrix, writes one
+# CSV line per cell and compares the run against a stored baseline.
+#
+#   bench.sh <directory with client, server and udpstat>
+#
+# The matrix and the thresholds come from the environment:
+#   BENCH_PAYLOADS  (="46 512 1400")      payload sizes (bytes)
+#   BENCH_RATES     (="10000 50000")      offered rates (pps)
+#   BENCH_MODES     (="reply send-only")  server echoes or client sends only
+#   BENCH_LOGGING   (="off on")           binary per-packet logs (-f) on both
+#   BENCH_PINNING   (="off on")           server and client pinned to CPUs
+#   BENCH_DURATION  (=3)                  seconds per cell
+#   BENCH_PORT      (=9700)
+#   BENCH_NETNS     (=0)                  1: server and client in two network
+#                                         namespaces joined by a veth pair
+#   BENCH_RESULTS   (=<directory>/results.csv)
+#   BENCH_BASELINE  (=<directory>/baseline.csv)
+#   BENCH_TOLERANCE (=10)                 % worse than the baseline which is
+#                                         still no regression
+#   BENCH_SAVE_BASELINE (=0)              1: store this run as the baseline
+#
+# Exits 1 if a cell regressed against the baseline.
+
+set -u
+
+BIN=${1:-bench}
+PAYLOADS=${BENCH_PAYLOADS:-"46 512 1400"}
+RATES=${BENCH_RATES:-"10000 50000"}
+MODES=${BENCH_MODES:-"reply send-only"}
+LOGGING=${BENCH_LOGGING:-"off on"}
+PINNING=${BENCH_PINNING:-"off on"}
+DURATION=${BENCH_DURATION:-3}
+PORT=${BENCH_PORT:-9700}
+NETNS=${BENCH_NETNS:-0}
+RESULTS=${BENCH_RESULTS:-$BIN/results.csv}
+BASELINE=${BENCH_BASELINE:-$BIN/baseline.csv}
+TOLERANCE=${BENCH_TOLERANCE:-10}
+
+SHM=udpbench.$$
+TMP=$(mktemp -d /tmp/udpbench.XXXXXX)
+CLK_TCK=$(getconf CLK_TCK)
+CPUS=$(nproc)
+SERVER_CPU=0
+CLIENT_CPU=$(( CPUS > 1 ? 1 : 0 ))
+ADDR=127.0.0.1
+SERVER_NS=""
+CLIENT_NS=""
+
+cleanup() {
+    [ -n "${SERVER_PID:-}" ] && kill -INT "$SERVER_PID" 2> /dev/null
+    if [ "$NETNS" = 1 ]; then
+        ip netns del udpbench_s 2> /dev/null
+        ip netns del udpbench_c 2> /dev/null
+    fi
+    rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+# two namespaces, 10.77.0.1 (client) and 10.77.0.2 (server)
+if [ "$NETNS" = 1 ]; then
+    ip netns add udpbench_s && ip netns add udpbench_c &&
+    ip link add udpbench0 type veth peer name udpbench1 &&
+    ip link set udpbench0 netns udpbench_c &&
+    ip link set udpbench1 netns udpbench_s &&
+    ip -n udpbench_c addr add 10.77.0.1/24 dev udpbench0 &&
+    ip -n udpbench_s addr add 10.77.0.2/24 dev udpbench1 &&
+    ip -n udpbench_c link set udpbench0 up &&
+    ip -n udpbench_s link set udpbench1 up &&
+    ip -n udpbench_c link set lo up &&
+    ip -n udpbench_s link set lo up || {
+        echo "Cannot set up the network namespaces (root needed)." >&2
+        exit 2
+    }
+    ADDR=10.77.0.2
+    SERVER_NS="ip netns exec udpbench_s"
+    CLIENT_NS="ip netns exec udpbench_c"
+fi
+
+# utime + stime of a process in ns, from the clock ticks in /proc
+cpu_ns() {
+    awk -v tck="$CLK_TCK" '{ printf "%.0f", ($14 + $15) * 1E9 / tck }' \
+        "/proc/$1/stat" 2> /dev/null || echo 0
+}
+
+# field after a label on the summary line which starts with prefix
+field() {
+    grep -a -o "$1.*" "$3" | head -n 1 |
+        awk -v key="$2" '{ for (i = 1; i < NF; ++i) if ($i == key) { print $(i + 1); exit } }'
+}
+
+run_cell() {
+    local payload=$1 rate=$2 mode=$3 logging=$4 pinning=$5
+    local cell="p${payload}_r${rate}_${mode}_log${logging}_pin${pinning}"
+    local count=$(( rate * DURATION ))
+    local interval=$(( 1000000000 / rate ))
+
+    local server_args="-p $PORT -M $SHM"
+    local client_args="-s $ADDR -p $PORT -n $count -i $interval -P $payload -A 1024 -w 500"
+    [ "$mode" = reply ] && server_args="$server_args -x"
+    [ "$mode" = send-only ] && client_args="$client_args -S"
+    if [ "$logging" = on ]; then
+        server_args="$server_args -r -f $TMP/server.log"
+        client_args="$client_args -f $TMP/client.log"
+    fi
+    local server_pin="" client_pin=""
+    if [ "$pinning" = on ]; then
+        server_pin="taskset -c $SERVER_CPU"
+        client_pin="taskset -c $CLIENT_CPU"
+    fi
+
+    rm -f "$TMP"/*
+    $SERVER_NS $server_pin "$BIN/server" $server_args > /dev/null 2>&1 &
+    SERVER_PID=$!
+    local tries=0
+    until [ -e "/dev/shm/$SHM" ] || [ $tries -ge 100 ]; do
+        sleep 0.02
+        tries=$(( tries + 1 ))
+    done
+    local server_cpu_start
+    server_cpu_start=$(cpu_ns "$SERVER_PID")
+
+    local TIMEFORMAT='%3U %3S'
+    { time $CLIENT_NS $client_pin "$BIN/client" $client_args \
+          > "$TMP/client.out" 2>&1 ; } 2> "$TMP/client.time"
+    sleep 0.2
+
+    "$BIN/udpstat" "$SHM" 0 > "$TMP/server.stat" 2> /dev/null
+    local server_cpu_end
+    server_cpu_end=$(cpu_ns "$SERVER_PID")
+    kill -INT "$SERVER_PID" 2> /dev/null
+    wait "$SERVER_PID" 2> /dev/null
+    SERVER_PID=""
+
+    # the client summary goes to its log file when there is one
+    local summary="$TMP/client.out"
+    [ "$logging" = on ] && summary="$TMP/client.log"
+
+    local server_rx client_rx tx_pps p50 p99 p999 client_cpu
+    server_rx=$(field "Totals:" rx_packets "$TMP/server.stat")
+    client_rx=$(field "Sequence:" received "$summary")
+    tx_pps=$(field "Pacing" achieved "$summary")
+    p50=$(field "Latency (us):" p50 "$summary")
+    p99=$(field "Latency (us):" p99 "$summary")
+    p999=$(field "Latency (us):" p99.9 "$summary")
+    client_cpu=$(awk '{ printf "%.0f", ($1 + $2) * 1E9 }' "$TMP/client.time")
+
+    awk -v cell="$cell" -v payload="$payload" -v rate="$rate" -v mode="$mode" \
+        -v logging="$logging" -v pinning="$pinning" -v sent="$count" \
+        -v server_rx="${server_rx:-0}" -v client_rx="${client_rx:-0}" \
+        -v tx_pps="${tx_pps:-0}" -v client_cpu="$client_cpu" \
+        -v server_cpu="$(( server_cpu_end - server_cpu_start ))" \
+        -v p50="${p50:-0}" -v p99="${p99:-0}" -v p999="${p999:-0}" 'BEGIN {
+            received = mode == "reply" ? client_rx : server_rx
+            loss = sent && received < sent ? 100.0 * (sent - received) / sent : 0
+            printf "%s,%s,%s,%s,%s,%s,%s,%s,%s,%.3f,%.1f,%.0f,%.0f,%s,%s,%s\n",
+                   cell, payload, rate, mode, logging, pinning, sent, server_rx,
+                   client_rx, loss, tx_pps, client_cpu / sent,
+                   server_rx ? server_cpu / server_rx : 0, p50, p99, p999
+        }' >> "$RESULTS"
+    tail -n 1 "$RESULTS"
+}
+
+HEADER="cell,payload,rate,mode,logging,pinned,sent,server_rx,client_rx,loss_pct,"
+HEADER="${HEADER}tx_pps,client_cpu_ns_per_pkt,server_cpu_ns_per_pkt,p50_us,p99_us,p999_us"
+echo "$HEADER" > "$RESULTS"
+echo "$HEADER"
+for payload in $PAYLOADS; do
+    for rate in $RATES; do
+        for mode in $MODES; do
+            for logging in $LOGGING; do
+                for pinning in $PINNING; do
+                    run_cell "$payload" "$rate" "$mode" "$logging" "$pinning"
+                done
+            done
+        done
+    done
+done
+echo "Results in $RESULTS."
+
+if [ "${BENCH_SAVE_BASELINE:-0}" = 1 ]; then
+    cp "$RESULTS" "$BASELINE"
+    echo "Stored as the baseline $BASELINE."
+    exit 0
+fi
+if [ ! -f "$BASELINE" ]; then
+    echo "No baseline $BASELINE, store one with make bench BENCH_SAVE_BASELINE=1."
+    exit 0
+fi
+
+# a cell regresses if it sends less, loses more, or costs more CPU or
+# latency than the tolerance allows; latency below 5 us and CPU below
+# 100 ns per packet are noise
+awk -F, -v tolerance="$TOLERANCE" '
+    function worse(now, base, floor) {
+        return now > floor && now > base * (1 + tolerance / 100)
+    }
+    FNR == 1 { next }
+    NR == FNR { base[$1] = $0; next }
+    ! ($1 in base) { next }
+    {
+        split(base[$1], b, ",")
+        why = ""
+        if ($11 < b[11] * (1 - tolerance / 100))
+            why = why sprintf(" tx_pps %s -> %s", b[11], $11)
+        if ($10 > b[10] + 0.1)
+            why = why sprintf(" loss %s%% -> %s%%", b[10], $10)
+        if (worse($12, b[12], 100))
+            why = why sprintf(" client_cpu %s -> %s ns/pkt", b[12], $12)
+        if (worse($13, b[13], 100))
+            why = why sprintf(" server_cpu %s -> %s ns/pkt", b[13], $13)
+        if (worse($15, b[15], 5))
+            why = why sprintf(" p99 %s -> %s us", b[15], $15)
+        if (why != "") {
+            print "Regression " $1 ":" why
+            ++regressions
+        }
+        ++compared
+    }
+    END {
+        printf "Compared %d cells against the baseline, %d regressed.\n",
+               compared, regressions
+        exit regressions > 0
+    }' "$BASELINE" "$RESULTS"
@@ -1,15 +1,38 @@
+#define _GNU_SOURCE // pthread_t, nanosleep(), strtok_r()
+
 #include <stdlib.h> // EXIT_SUCCESS, EXIT_FAILURE, exit()
 #include <stdio.h>  // FILE, fprintf(), fflush(), fclose(), stderr
 #include <unistd.h> // getopt(), optarg, optopt
 #include <signal.h> // signal(), SIGINT
 #include <time.h>   // timespec, clock_gettime(), CLOCK_MONOTONIC,
                     // time_t, tm, time(), localtime(), asctime()
+#include <pthread.h> // pthread_t
 
 #include <netinet/in.h> // sockaddr, sockaddr_in, PF_INET, IPPROTO_UDP
 #include <sys/socket.h> // SOCK_DGRAM, socket(), sendto(), recvfrom(), close()
+#include <sys/epoll.h>    // epoll_create1(), epoll_ctl(), epoll_wait()
+#include <sys/timerfd.h>  // timerfd_create(), timerfd_settime()
+#include <sys/resource.h> // getrlimit(), setrlimit(), RLIMIT_NOFILE
 
 #include "dbg.h" // DEBUG_PRINT(), LOG()
 #include "udp_common.h"
+#include "udp_log.h" // log_ring_open(), log_ring_push(), log_ring_close()
+#include "udp_hist.h" // hist_record(), hist_print_summary(), hist_dump()
+#include "udp_tstamp.h" // tstamp_enable_on_socket(), tstamp_recvfrom()
+#include "udp_pacing.h" // pacer_init(), pacer_wait(), pacer_print_summary()
+#include "udp_traffic.h" // profile_parse(), profile_next()
+#include "udp_transport.h" // transport_open(), transport_send(), transport_recv()
+#include "udp_flows.h" // flow_open(), flow_record(), flows_print_summary()
+#include "udp_gso.h" // gso_sendto(), GSO_MAX_SEGMENTS
+#include "udp_owd.h" // owd_record(), owd_print_summary()
+#include "udp_seq.h" // seq_record(), seq_finish(), seq_print_summary()
+#include "udp_stats.h" // stats_create(), stats_count_tx(), stats_reporter_start()
+#include "udp_search.h" // search_parse(), search_record_trial(), search_print_table()
+#include "udp_lowlat.h" // lowlat_parse(), lowlat_setup_socket(), lowlat_recvfrom()
+#include "udp_payload.h" // payload_parse(), payload_next(), payload_check_packet()
+#include "udp_trace.h" // trace_write(), trace_load(), trace_next()
+#include "udp_wheel.h" // wheel_init(), wheel_insert(), wheel_advance()
+#include "udp_fanout.h" // fanout_parse_groups(), fanout_record_reply()
 
 #define USAGE(exec_name) \
   "Usage: " exec_name " [options]\n" \
@@ -17,16 +40,56 @@
   "  -s <server address>           -- server address\n" \
   "  -p <port number>              -- port number\n" \
   "  [-i <interval>] (=1E7)        -- time interval between packets (ns)\n" \
+  "  [-k <pacing>] (=hybrid)       -- pacing: sleep, hybrid or spin (TSC)\n" \
+  "  [-R <profile>]                -- traffic profile instead of -i:\n" \
+  "                                     const:<pps>, poisson:<pps>,\n" \
+  "                                     burst:<pps>:<packets>:<off ms>,\n" \
+  "                                     ramp:<from pps>:<to pps>:<s>,\n" \
+  "                                     step:<from>:<to>:<step pps>:<step s>,\n" \
+  "                                     file:<schedule> (lines of <s> <pps>\n" \
+  "                                     [<payload> [<ToS> [const|poisson]]])\n" \
   "  [-n <number of packets>] (=0) -- number of packets to send (default: inf)\n" \
-  "  [-w <timeout>] (=0)           -- socket timeout (ms)\n" \
+  "  [-w <timeout>] (=1000)        -- reply timeout (ms), 0: wait forever\n" \
   "  [-t <ToS code>] (=0)          -- ToS code (decimal)\n" \
-  "  [-P <payload size>]           -- payload size\n" \
+  "  [-P <payload>] (=46)          -- payload bytes, at most 65467: <size>,\n" \
+  "                                     <min>-<max> (uniform), imix or\n" \
+  "                                     imix:<IP bytes>x<weight>/...\n" \
+  "  [-V]                          -- check size and payload of every reply\n" \
+  "  [-W <file name>]              -- record the departures as a trace\n" \
+  "  [-Y <trace>]                  -- replay a trace, or the IPv4 UDP packets\n" \
+  "                                     of a pcap file (<file>:<port> filters)\n" \
   "  [-f <file name>]              -- log file name\n" \
+  "  [-O <file name>]              -- columnar results file (see udpanalyze)\n" \
   "  [-m]                          -- enable multicast\n" \
+  "  [-g <group>[/<count>]]        -- multicast fan-out instead of -s: send\n" \
+  "                                     round-robin to <count> consecutive\n" \
+  "                                     groups, stats per group and responder\n" \
   "  [-b]                          -- enable broadcast\n" \
   "  [-l]                          -- enable loopback\n" \
   "  [-r]                          -- record system clock (default: time difference)\n" \
-  "  [-S]                          -- send only\n"
+  "  [-S]                          -- send only\n" \
+  "  [-A <window>]                 -- pipelined mode, max packets in flight\n" \
+  "  [-H <file name>]              -- dump latency histogram buckets (csv)\n" \
+  "  [-T]                          -- kernel (SO_TIMESTAMPING) timestamps\n" \
+  "  [-I <interface>]              -- enable hardware timestamps on interface\n" \
+  "  [-u <transport>] (=syscall)   -- syscall or uring (io_uring, Linux 6.0+)\n" \
+  "  [-Q]                          -- io_uring: kernel submission polling (SQPOLL)\n" \
+  "  [-F <flows>]                  -- multi-flow mode, one socket per flow,\n" \
+  "                                     each flow sends every <interval> ns\n" \
+  "  [-D <destinations>]           -- flow destinations instead of -s/-p:\n" \
+  "                                     <addr>:<port>[-<last port>],...\n" \
+  "  [-j <threads>] (=1)           -- multi-flow mode: epoll threads\n" \
+  "  [-G <segments>]               -- pipelined mode: send trains of segments\n" \
+  "                                     with one UDP_SEGMENT (GSO) send each\n" \
+  "  [-M <name>]                   -- live counters in shared memory (see udpstat)\n" \
+  "  [-o <seconds>]                -- print an interval report every N s\n" \
+  "  [-X <search>]                 -- RFC 2544 rate search, comma separated:\n" \
+  "                                     max=<pps>,min=<pps>,loss=<%%>,p99=<us>,\n" \
+  "                                     trial=<s>,settle=<s>,precision=<%%>,\n" \
+  "                                     sizes=<payload>/<payload>/...\n" \
+  "  [-L <profile>]                -- low latency: busy-poll receive on a pinned\n" \
+  "                                     CPU, memory locked; on or comma separated\n" \
+  "                                     cpu=<first CPU>,fifo=<priority>,poll=<us>\n"
 
 /* initialize variables */
 int        udp_socket  = -1;
@@ -40,29 +103,258 @@ bool       record_sys_clock = FALSE;
 bool       send_only        = FALSE;
 
 int        socket_tos       = 0;
-u_ll       timeout          = 0;
+u_ll       timeout          = 1000;
 u_ll       interval         = DEFAULT_INTERVAL;
+enum pacing_mode pacing_mode = PACE_HYBRID;
+struct pacer pacer;
+
+/* traffic profile and its per-phase statistics */
+struct phase_stats {
+    u_ll                sent;
+    u_ll                received;
+    struct latency_hist latency;
+};
+
+char       profile_spec[256];
+struct traffic_profile profile;
+struct phase_stats * phase_stats = NULL;
+int        current_tos      = 0;
 u_int      payload_size     = DSRD_PKG_SIZE - sizeof(struct message);
-char       buffer[BUFFER_SIZE];
+char       buffer[DATAGRAM_BUFFER_SIZE];
+
+/* every send starts from the template, only its header changes */
+struct payload_mix payload_mix;
+char *     packet_template  = NULL;
+bool       verify_payload   = FALSE;
+struct payload_check payload_check;
 
 u_ll       total_responses  = 0;
 u_ll       max_responses    = 0;
 u_ll       missing_packages = 0;
 FILE *     log_file         = NULL;
+struct log_ring log_ring;
+char       results_file_name[256];
+struct results_file results_file;
+char       hist_file_name[256];
+struct latency_hist latency_hist;
+struct owd_stats owd;
+struct seq_tracker seq_tracker;
+
+/* trace capture and replay; the replay takes the place of the profile */
+struct trace_writer trace_writer;
+char       replay_spec[256];
+struct trace replay;
+u_ll       last_departure_ns = 0;
+
+/* kernel/hardware timestamping */
+bool       enable_tstamp    = FALSE;
+char       tstamp_interface[IFNAMSIZ];
+struct latency_hist kernel_hist;
+struct latency_hist hw_hist;
+
+/* low-latency profile; the wakeup latency is from the kernel RX stamp
+   to the receive call returning */
+struct lowlat lowlat;
+struct latency_hist wakeup_hist;
+
+/* socket I/O; the pipelined receiver has a transport of its own */
+enum transport_kind transport_kind = TRANSPORT_SYSCALL;
+bool       enable_sqpoll    = FALSE;
+struct transport transport;
+struct transport rx_transport;
+
+/* pipelined mode: outstanding send timestamps indexed by seq_num */
+struct in_flight {
+    u_ll tag;     // seq_num + 1 while waiting for the reply, 0 otherwise
+    u_ll sent_ns;
+    u_ll kern_sent_ns;
+    u_ll hw_sent_ns;
+    u_int phase;
+    u_int length;
+};
+
+u_ll               window_size   = 0;
+struct in_flight * in_flight     = NULL;
+u_ll               total_sent    = 0;
+u_ll               late_replies  = 0;
+
+/* fan-out mode: the receiver thread collects the replies of every
+   responder until told to stop */
+struct fanout      fanout;
+char               fanout_spec[32];
+
+/* ^C: the loops of every mode end, main() finishes once the receiver
+   and flow threads are joined; the receivers also stop once the sender
+   is done */
+volatile sig_atomic_t client_stop   = 0;
+volatile sig_atomic_t receiver_stop = 0;
+int                   stop_code     = EXIT_SUCCESS;
+
+/* pipelined mode: a request still unanswered after the timeout is lost,
+   the sender keeps a timer per window slot */
+struct timer_wheel reply_wheel;
+u_ll               timed_out     = 0;
+u_ll               evicted       = 0; // slot reused before the timeout
+
+/* GSO: every departure of the pipelined mode is a train of segments */
+u_int              gso_segments  = 0;
+char               gso_buffer[GSO_BUFFER_SIZE];
+u_int              gso_segment_size = 0; // the train gso_buffer is laid out for
+
+/* multi-flow mode: flows are split into contiguous runs, one per thread */
+#define FLOW_POLL_MS       (100) // flow threads check for ^C
+
+struct flow_thread {
+    pthread_t           thread;
+    u_int               first;
+    u_int               count;
+    struct latency_hist latency;
+    struct stats_counters * stats;
+};
+
+u_int                flow_count         = 0;
+u_int                flow_thread_count  = 1;
+char                 destinations_spec[1024];
+struct flow *        flows              = NULL;
+struct flow_thread * flow_threads       = NULL;
+
+/* live counters, a slot per flow thread, else a single one */
+char                   stats_name[STATS_NAME_SIZE];
+u_int                  report_interval = 0;
+struct stats_segment * stats_segment   = NULL;
+struct stats_counters * stats          = NULL;
+struct stats_reporter  stats_reporter;
 
+/* rate search: seq_num runs on across the trials, so that to the server
+   the search is one stream; the receiver only counts replies from the
+   first seq_num of the current trial on */
+#define SEARCH_POLL_US     (100000) // receiver checks for a new trial
+
+struct search_trial {
+    u_ll                first_seq;
+    u_ll                received;
+    struct latency_hist latency;
+};
+
+char                 search_spec[256];
+struct rate_search   search;
+struct search_trial  search_trial;
+u_int                search_trial_id    = 0; // 0: between trials
+u_int                search_receiver_id = 0; // the trial the receiver is on
+
+void print_timing(FILE * out) {
+    if (search_spec[0]) {
+        search_print_table(& search, out);
+        return;
+    }
+    if (fanout.groups.count) {
+        pacer_print_summary(& pacer, out);
+        if (replay.records)
+            trace_print_summary(& replay, out);
+        fanout_print_summary(& fanout, total_sent, out);
+        owd_print_summary(& owd, out);
+        return;
+    }
+    if (flow_count) {
+        u_int i;
+        for (i = 0; flow_threads && i < flow_thread_count; ++i)
+            hist_merge(& latency_hist, & flow_threads[i].latency);
+        flows_print_summary(flows, flow_count, flow_thread_count, & latency_hist,
+                            out == log_file, out);
+        return;
+    }
+    pacer_print_summary(& pacer, out);
+    if (replay.records)
+        trace_print_summary(& replay, out);
+    if (send_only == TRUE)
+        return;
+    seq_print_summary(& seq_tracker.stats, "Sequence", out);
+    if (verify_payload)
+        payload_print_summary(& payload_check, out);
+    hist_print_summary(& latency_hist, "Latency", out);
+    owd_print_summary(& owd, out);
+    if (enable_tstamp) {
+        hist_print_summary(& kernel_hist, "Kernel latency", out);
+        if (hw_hist.total)
+            hist_print_summary(& hw_hist, "Hardware latency", out);
+    }
+    if (wakeup_hist.total)
+        hist_print_summary(& wakeup_hist, "Wakeup latency", out);
+    if (reply_wheel.timers) {
+        fprintf(out, "Timeouts: %llu replies overdue after %llu ms, "
+                     "%llu evicted by the window\n", timed_out, timeout, evicted);
+        wheel_print_summary(& reply_wheel, out);
+    }
+
+    /* break the stats out per phase of the traffic profile */
+    u_int i;
+    for (i = 0; profile_spec[0] && i < profile.phase_count; ++i) {
+        const struct traffic_phase * phase = & profile.phases[i];
+        const struct phase_stats *   stats = & phase_stats[i];
+        if (stats -> sent == 0)
+            continue;
+        fprintf(out, "Phase %u: %.1f-%.1f pps, payload %u, ToS %i\t",
+                i, phase -> rate_from, phase -> rate_to,
+                phase -> payload_size, phase -> tos);
+        fprintf(out, "Sent: %llu\tReceived: %llu\tPacket loss: %.3f%%\n",
+                stats -> sent, stats -> received,
+                stats -> received > stats -> sent ? 0.0 :
+                100.0 * (stats -> sent - stats -> received) / stats -> sent);
+        hist_print_summary(& stats -> latency, "  Latency", out);
+    }
+}
+
+/* blocked receives return 0 once the socket is shut down, the sender
+   leaves its loop after the current departure */
+void stopHandler(int signal_number) {
+    stop_code     = signal_number;
+    client_stop   = 1;
+    receiver_stop = 1;
+    if (udp_socket > 0)
+        shutdown(udp_socket, SHUT_RD);
+}
+
+/* stop the receiver of the main socket and wait for it */
+void receiver_join(pthread_t receiver) {
+    receiver_stop = 1;
+    shutdown(udp_socket, SHUT_RD);
+    pthread_join(receiver, NULL);
+}
+
+/* the threads are done: close everything and print the summary */
 void intHandler(int return_code) {
     if(enable_multicast)
         mcast_drop_membership_on_socket(udp_socket, server_addr_name);
     if(udp_socket)
         close(udp_socket);
+    trace_writer_close(& trace_writer);
+
+    /* whatever the window still misses is lost by now */
+    seq_finish(& seq_tracker, total_sent);
+    missing_packages = seq_tracker.stats.lost;
+    if (fanout.groups.count)
+        fanout_finish(& fanout, total_sent);
+    /* flush the binary records ahead of the text summary */
+    log_ring_close(& log_ring);
+    results_close(& results_file, total_sent);
     if(log_file) {
+
         /* print packet statistics */
-        if (send_only != TRUE) {
-            long double packet_loss = (long double) missing_packages / total_responses;
+        if (send_only != TRUE && ! flow_count && ! search_spec[0] &&
+            ! fanout.groups.count) {
+            fprintf(log_file, "Sent:        %llu\t", total_sent);
+            if (window_size) {
+                fprintf(log_file, "Late:        %llu\t",
+                        __atomic_load_n(& late_replies, __ATOMIC_RELAXED));
+                fprintf(log_file, "Timed out:   %llu\t", timed_out);
+            }
+            long double packet_loss = total_sent ?
+                100.0L * missing_packages / total_sent : 0;
             fprintf(log_file, "Received:    %llu\t",    total_responses);
             fprintf(log_file, "Missed:      %llu\t",    missing_packages);
             fprintf(log_file, "Packet loss: %.3Lf%%\n", packet_loss);
         }
+        print_timing(log_file);
 
         /* print current date and time */
         time_t raw_time;
@@ -77,17 +369,827 @@ void intHandler(int return_code) {
 
         LOG("Communication end.\n");
     }
+    else
+        print_timing(stdout);
+
+    /* dump the latency distribution */
+    if (hist_file_name[0]) {
+        FILE * hist_file = fopen(hist_file_name, "w");
+        if (hist_file) {
+            hist_dump(& latency_hist, hist_file);
+            fclose(hist_file);
+        }
+        else
+            fprintf(stderr, "Cannot open %s.\n", hist_file_name);
+    }
+    if (stats_name[0])
+        stats_remove(stats_name);
     exit(return_code);
 }
 
+u_ll timespec_to_ns(const struct timespec * ts) {
+    return (u_ll) ts -> tv_sec * (u_ll) 1E9 + ts -> tv_nsec;
+}
+
+/* T1 goes on the wire as late as possible */
+void fill_message(struct message * msg,
+                  const u_ll       seq) {
+    message_init(msg, seq, realtime_ns());
+}
+
+/* one-way delays from the four timestamps of a stamped reply, against
+   the clock filter of the server which stamped it; the kernel receive
+   stamp is the better T4 */
+void record_owd(const struct message *    response,
+                const struct pkt_tstamp * rx_tstamp,
+                struct owd_filter *       clock) {
+    if (! (response -> flags & htons(MSG_FLAG_STAMPED)))
+        return;
+    const u_ll t4 = enable_tstamp && rx_tstamp -> sw_ns ? rx_tstamp -> sw_ns
+                                                        : realtime_ns();
+    owd_record(& owd, clock, be64toh(response -> client_tx_ns),
+               be64toh(response -> server_rx_ns),
+               be64toh(response -> server_tx_ns), t4);
+}
+
+/* switch payload size and ToS when a new phase starts */
+void apply_phase(const u_int phase_index) {
+    const struct traffic_phase * phase = & profile.phases[phase_index];
+    payload_size = phase -> payload_size;
+    if (phase -> tos != current_tos) {
+        tos_set_on_socket(udp_socket, phase -> tos);
+        current_tos = phase -> tos;
+    }
+}
+
+/* wait until the traffic profile or the replayed trace wants the next
+   packet out; FALSE once it is over */
+bool wait_departure(u_int * phase_index) {
+    u_ll gap_ns;
+    if (client_stop)
+        return FALSE;
+    if (replay.records) {
+        int tos;
+        if (! trace_next(& replay, & gap_ns, & payload_size, & tos))
+            return FALSE;
+        if (tos != current_tos) {
+            tos_set_on_socket(udp_socket, tos);
+            current_tos = tos;
+        }
+        * phase_index = 0;
+    }
+    else {
+        if (! profile_next(& profile, & gap_ns, phase_index))
+            return FALSE;
+        apply_phase(* phase_index);
+    }
+    pacer_set_interval(& pacer, gap_ns);
+    last_departure_ns = pacer_wait(& pacer);
+    if (replay.records)
+        trace_record_departure(& replay, last_departure_ns, pacer.last_deadline);
+    ++phase_stats[* phase_index].sent;
+    return TRUE;
+}
+
+/* next reply into buffer, plus the kernel RX stamps in timestamping and
+   low-latency mode, which also measure how long the wakeup took */
+int receive_reply(struct transport *   t,
+                  struct sockaddr_in * rcv_addr,
+                  socklen_t *          rcv_addr_size,
+                  struct pkt_tstamp *  rx_tstamp) {
+    if (enable_tstamp || lowlat.enabled) {
+        const int read_size = lowlat.enabled ?
+            lowlat_recvfrom(udp_socket, buffer, DATAGRAM_BUFFER_SIZE, rcv_addr,
+                            rcv_addr_size, rx_tstamp, timeout * (u_ll) 1E6) :
+            tstamp_recvfrom(udp_socket, buffer, DATAGRAM_BUFFER_SIZE,
+                            rcv_addr, rcv_addr_size, rx_tstamp);
+        if (read_size >= 0 && rx_tstamp -> sw_ns)
+            hist_record(& wakeup_hist, realtime_ns() - rx_tstamp -> sw_ns);
+        return read_size;
+    }
+    struct transport_packet packet;
+    if (transport_recv(t, & packet, 1, timeout * (u_ll) 1E6) < 1)
+        return -1;
+    if (packet.data != buffer)
+        memcpy(buffer, packet.data, packet.length);
+    * rcv_addr = packet.addr;
+    transport_release(t, & packet);
+    return packet.length;
+}
+
+/* kernel and hardware RTT from the stamps, recorded in their histograms;
+   returns the log flag which says they are valid */
+u_int record_kernel_rtt(const struct pkt_tstamp * tx,
+                        const struct pkt_tstamp * rx,
+                        u_ll *                    kern_rtt,
+                        u_ll *                    hw_rtt) {
+    * kern_rtt = * hw_rtt = 0;
+    if (! enable_tstamp)
+        return 0;
+    if (tx -> sw_ns && rx -> sw_ns > tx -> sw_ns) {
+        * kern_rtt = rx -> sw_ns - tx -> sw_ns;
+        hist_record(& kernel_hist, * kern_rtt);
+    }
+    if (tx -> hw_ns && rx -> hw_ns > tx -> hw_ns) {
+        * hw_rtt = rx -> hw_ns - tx -> hw_ns;
+        hist_record(& hw_hist, * hw_rtt);
+    }
+    return LOG_FLAG_KERNEL_TS;
+}
+
+/* receiver path of the pipelined mode: match every reply to its send */
+void * pipelined_receiver(void * arg) {
+    (void) arg;
+    const u_ll mask = window_size - 1;
+    struct sockaddr_in rcv_addr;
+    socklen_t rcv_addr_size = sizeof(struct sockaddr_in);
+    if (lowlat.enabled)
+        lowlat_setup_thread(& lowlat, 1);
+
+    while (! receiver_stop) {
+        struct pkt_tstamp rx_tstamp;
+        rcv_addr_size = sizeof(struct sockaddr_in);
+        const int read_size = receive_reply(& rx_transport, & rcv_addr,
+                                            & rcv_addr_size, & rx_tstamp);
+        if (read_size < (int) sizeof(struct message))
+            continue;
+        struct timespec present_time;
+        clock_gettime(AVAILABLE_MONOTONIC_CLOCK, & present_time);
+
+        const struct message * response = (struct message *) buffer;
+        if (! message_valid(response, read_size))
+            continue;
+        const u_ll response_seq_num = message_seq_num(response);
+        const u_ll lost = seq_tracker.stats.lost;
+        const enum seq_class seq_class = seq_record(& seq_tracker,
+                                                    response_seq_num);
+        stats_count_rx(stats, read_size);
+        stats_count_seq(stats, seq_class, seq_tracker.stats.lost - lost);
+        if (seq_class == SEQ_DUPLICATE)
+            continue;
+
+        /* the slot is only ours if the sender has not recycled it */
+        struct in_flight * slot = & in_flight[response_seq_num & mask];
+        u_ll expected = response_seq_num + 1;
+        if (__atomic_load_n(& slot -> tag, __ATOMIC_ACQUIRE) != expected) {
+            __atomic_fetch_add(& late_replies, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        const u_ll  sent_ns = slot -> sent_ns;
+        const u_int phase   = slot -> phase;
+        const u_int length  = slot -> length;
+        const struct pkt_tstamp tx_tstamp = {
+            __atomic_load_n(& slot -> kern_sent_ns, __ATOMIC_RELAXED),
+            __atomic_load_n(& slot -> hw_sent_ns,   __ATOMIC_RELAXED)
+        };
+        if (! __atomic_compare_exchange_n(& slot -> tag, & expected, 0, FALSE,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            __atomic_fetch_add(& late_replies, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        __atomic_fetch_add(& total_responses, 1, __ATOMIC_RELAXED);
+        LOG("Received packet nr %llu from %s.\n", response_seq_num, server_addr_name);
+        record_owd(response, & rx_tstamp, & owd.clock);
+        if (verify_payload)
+            payload_check_packet(& payload_check, packet_template, buffer,
+                                 read_size, length);
+        const u_ll current_time = timespec_to_ns(& present_time);
+        hist_record(& latency_hist, current_time - sent_ns);
+        stats_record_latency(stats, current_time - sent_ns);
+        ++phase_stats[phase].received;
+        hist_record(& phase_stats[phase].latency, current_time - sent_ns);
+        u_ll kern_rtt, hw_rtt;
+        const u_int tstamp_flag = record_kernel_rtt(& tx_tstamp, & rx_tstamp,
+                                                    & kern_rtt, & hw_rtt);
+
+        /* write results */
+        if (log_ring.records) {
+            log_ring_push(& log_ring, response_seq_num, sent_ns, current_time,
+                          current_time - sent_ns, kern_rtt, hw_rtt,
+                          (record_sys_clock ? LOG_FLAG_SYS_CLOCK : 0) | tstamp_flag);
+        }
+    }
+    return NULL;
+}
+
+/* the reply to id is overdue: the request is lost unless the reply took
+   the slot first, a reply arriving later counts as late */
+void expire_request(u_ll   id,
+                    void * arg) {
+    (void) arg;
+    struct in_flight * slot = & in_flight[id & (window_size - 1)];
+    u_ll expected = id + 1;
+    if (__atomic_compare_exchange_n(& slot -> tag, & expected, 0, FALSE,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        ++timed_out;
+}
+
+/* sender path of the pipelined mode: never waits for a reply */
+void run_pipelined(const struct sockaddr_in * server_addr) {
+    const u_ll mask = window_size - 1;
+    in_flight = calloc(window_size, sizeof(struct in_flight));
+    if (! in_flight) {
+        fprintf(stderr, "Error allocating window of %llu packets.\n", window_size);
+        exit(EXIT_FAILURE);
+    }
+
+    /* only the sender handles ^C */
+    pthread_t receiver;
+    if (send_only != TRUE)
+        start_thread(& receiver, pipelined_receiver, NULL);
+    const u_ll timeout_ns = timeout * (u_ll) 1E6;
+    if (timeout && send_only != TRUE) {
+        struct timespec now;
+        clock_gettime(AVAILABLE_MONOTONIC_CLOCK, & now);
+        wheel_init(& reply_wheel, window_size, WHEEL_TICK_NS, timespec_to_ns(& now));
+    }
+
+    pacer_init(& pacer, pacing_mode, 0);
+    u_ll seq_num = 0;
+    u_int phase;
+    while (max_responses == 0 || seq_num < max_responses) {
+
+        /* wait for the departure time, then stamp the packet */
+        if (! wait_departure(& phase))
+            break;
+        struct timespec present_time;
+        clock_gettime(AVAILABLE_MONOTONIC_CLOCK, & present_time);
+
+        /* a GSO train carries a seq_num and a slot per segment, all of
+           them of one size */
+        u_int segments = gso_segments ? gso_segments : 1;
+        if (max_responses && seq_num + segments > max_responses)
+            segments = max_responses - seq_num;
+        phase_stats[phase].sent += segments - 1;
+        const u_int segment_size = sizeof(struct message) +
+                                   payload_next(& payload_mix, payload_size);
+
+        /* recycle the slots; an unanswered previous occupant is lost */
+        u_int k;
+        for (k = 0; send_only != TRUE && k < segments; ++k) {
+            struct in_flight * slot = & in_flight[(seq_num + k) & mask];
+            if (__atomic_exchange_n(& slot -> tag, 0, __ATOMIC_ACQ_REL) != 0) {
+                fprintf(stderr, "Packet no %llu has gone missing.\n",
+                        seq_num + k - window_size);
+                ++evicted;
+            }
+            slot -> sent_ns = timespec_to_ns(& present_time);
+            slot -> kern_sent_ns = slot -> hw_sent_ns = 0;
+            slot -> phase = phase;
+            slot -> length = segment_size;
+            __atomic_store_n(& slot -> tag, seq_num + k + 1, __ATOMIC_RELEASE);
+            if (reply_wheel.timers)
+                wheel_insert(& reply_wheel, (seq_num + k) & mask, seq_num + k,
+                             slot -> sent_ns + timeout_ns);
+        }
+
+        if (gso_segments) {
+            /* copy the template into the train only when the size changes */
+            if (segment_size != gso_segment_size) {
+                for (k = 0; k < gso_segments; ++k)
+                    memcpy(gso_buffer + k * segment_size, packet_template,
+                           segment_size);
+                gso_segment_size = segment_size;
+            }
+            for (k = 0; k < segments; ++k) {
+                fill_message((struct message *) (gso_buffer + k * segment_size),
+                             seq_num + k);
+                if (trace_writer.file)
+                    trace_write(& trace_writer, last_departure_ns,
+                                segment_size - sizeof(struct message), current_tos);
+            }
+            if (gso_sendto(udp_socket, gso_buffer, segments * segment_size,
+                           segment_size, server_addr) == -1)
+                fprintf(stderr, "Error on sending UDP packet.\n");
+            else
+                stats_count_tx(stats, segments, segments * segment_size);
+        }
+        else {
+            fill_message((struct message *) packet_template, seq_num);
+            if (trace_writer.file)
+                trace_write(& trace_writer, last_departure_ns,
+                            segment_size - sizeof(struct message), current_tos);
+            transport_send(& transport, packet_template, segment_size, server_addr);
+            transport_flush(& transport);
+            stats_count_tx(stats, 1, segment_size);
+        }
+
+        /* hand the TX stamps of the packets still in flight to the receiver */
+        if (enable_tstamp) {
+            u_int id;
+            struct pkt_tstamp tx_tstamp;
+            while (tstamp_read_tx(udp_socket, & id, & tx_tstamp)) {
+                struct in_flight * sent = & in_flight[id & mask];
+                if ((u_int) (__atomic_load_n(& sent -> tag, __ATOMIC_ACQUIRE) - 1)
+                    != id)
+                    continue;
+                __atomic_store_n(& sent -> kern_sent_ns, tx_tstamp.sw_ns,
+                                 __ATOMIC_RELAXED);
+                __atomic_store_n(& sent -> hw_sent_ns, tx_tstamp.hw_ns,
+                                 __ATOMIC_RELAXED);
+            }
+        }
+        LOG("Sent packet number %llu to %s.\n", seq_num, server_addr_name);
+        seq_num += segments;
+        total_sent = seq_num;
+        if (reply_wheel.timers)
+            wheel_advance(& reply_wheel, timespec_to_ns(& present_time),
+                          expire_request, NULL);
+    }
+
+    /* give the last replies a chance to arrive, or time out */
+    if (send_only != TRUE) {
+        const u_ll drain_ns = (timeout ? timeout : 1000) * (u_ll) 1E6 +
+                              2 * WHEEL_TICK_NS;
+        struct timespec start_time, present_time;
+        clock_gettime(AVAILABLE_MONOTONIC_CLOCK, & start_time);
+        do {
+            if (client_stop ||
+                __atomic_load_n(& total_responses, __ATOMIC_RELAXED) +
+                timed_out + evicted >= total_sent)
+                break;
+            const struct timespec nap = { 0, 1000000 };
+            nanosleep(& nap, NULL);
+            clock_gettime(AVAILABLE_MONOTONIC_CLOCK, & present_time);
+            if (reply_wheel.timers)
+                wheel_advance(& reply_wheel, timespec_to_ns(& present_time),
+                              expire_request, NULL);
+        } while (timespec_to_ns(& present_time) - timespec_to_ns(& start_time)
+                 < drain_ns);
+        receiver_join(receiver);
+    }
+}
+
+/* receiver path of the fan-out mode: any number of replies per request */
+void * fanout_receiver(void * arg) {
+    (void) arg;
+    struct sockaddr_in rcv_addr;
+    socklen_t rcv_addr_size;
+    const struct pkt_tstamp no_tstamp = { 0, 0 };
+    while (! receiver_stop) {
+        rcv_addr_size = sizeof(struct sockaddr_in);
+        const int read_size = recvfrom(udp_socket, buffer, DATAGRAM_BUFFER_SIZE, 0,
+                                       (struct sockaddr *) & rcv_addr,
+                                       & rcv_addr_size);
+        if (read_size < (int) sizeof(struct message))
+            continue;
+        struct timespec present_time;
+        clock_gettime(AVAILABLE_MONOTONIC_CLOCK, & present_time);
+
+        const struct message * response = (struct message *) buffer;
+        if (! message_valid(response, read_size))
+            continue;
+        stats_count_rx(stats, read_size);
+        __atomic_fetch_add(& total_responses, 1, __ATOMIC_RELAXED);
+        struct fanout_responder * responder =
+            fanout_record_reply(& fanout, & rcv_addr, message_seq_num(response),
+                                timespec_to_ns(& present_time));
+        if (responder)
+            record_owd(response, & no_tstamp, & responder -> clock);
+        LOG("Received packet nr %llu from %s.\n", message_seq_num(response),
+            inet_ntoa(rcv_addr.sin_addr));
+    }
+    return NULL;
+}
+
+/* sender path of the fan-out mode: request n goes to group n % count */
+void run_fanout(void) {
+    struct sockaddr_in group_addr;
+    init_socket(& group_addr, server_addr_name, port_number);
+    const int ttl = FANOUT_TTL;
+    if (setsockopt(udp_socket, IPPROTO_IP, IP_MULTICAST_TTL, & ttl, sizeof(ttl)) < 0)
+        fprintf(stderr, "Failed to set the multicast TTL to %i.\n", ttl);
+
+    /* the receiver wakes up every FANOUT_POLL_MS to check for the end */
+    timeout_set_on_socket(udp_socket, 0, FANOUT_POLL_MS * 1000);
+    pthread_t receiver;
+    start_thread(& receiver, fanout_receiver, NULL);
+
+    pacer_init(& pacer, pacing_mode, 0);
+    u_ll seq_num = 0;
+    u_int phase;
+    while (max_responses == 0 || seq_num < max_responses) {
+        if (! wait_departure(& phase))
+            break;
+        struct timespec present_time;
+        clock_gettime(AVAILABLE_MONOTONIC_CLOCK, & present_time);
+
+        const u_int length = sizeof(struct message) +
+                             payload_next(& payload_mix, payload_size);
+        group_addr.sin_addr.s_addr = fanout_group_addr(& fanout.groups,
+                                                       seq_num % fanout.groups.count);
+        fill_message((struct message *) packet_template, seq_num);
+        fanout_record_send(& fanout, seq_num, timespec_to_ns(& present_time));
+        if (trace_writer.file)
+            trace_write(& trace_writer, last_departure_ns,
+                        length - sizeof(struct message), current_tos);
+        if (sendto(udp_socket, packet_template, length, 0,
+                   (struct sockaddr *) & group_addr, sizeof(group_addr)) == -1)
+            fprintf(stderr, "Error on sending UDP packet.\n");
+        else
+            stats_count_tx(stats, 1, length);
+        LOG("Sent packet number %llu to %s.\n", seq_num,
+            inet_ntoa(group_addr.sin_addr));
+        total_sent = ++seq_num;
+    }
+
+    /* the replies of the last requests, then stop the receiver */
+    const u_ll drain_ms = timeout ? timeout : 1000;
+    const struct timespec drain = { drain_ms / 1000, (drain_ms % 1000) * 1000000 };
+    if (! client_stop)
+        nanosleep(& drain, NULL);
+    receiver_join(receiver);
+}
+
+/* stop-and-wait: one packet, one reply */
+void run_ping_pong(const struct sockaddr_in * server_addr) {
+    struct sockaddr_in rcv_addr;
+    socklen_t rcv_addr_size = sizeof(struct sockaddr_in);
+
+    int  read_size = 0;
+    u_ll seq_num   = 0;
+    pacer_init(& pacer, pacing_mode, 0);
+    u_int phase;
+    while (TRUE) {
+
+        /* wait for the departure time, ^C ends the loop there */
+        if (! wait_departure(& phase))
+            break;
+        struct timespec present_time;
+        clock_gettime(AVAILABLE_MONOTONIC_CLOCK, & present_time);
+
+        /* construct the message */
+        const u_ll sent_ns = timespec_to_ns(& present_time);
+        const u_int length = sizeof(struct message) +
+                             payload_next(& payload_mix, payload_size);
+        fill_message((struct message *) packet_template, seq_num);
+        if (trace_writer.file)
+            trace_write(& trace_writer, last_departure_ns,
+                        length - sizeof(struct message), current_tos);
+        ++seq_num;
+        total_sent = seq_num;
+
+        /* send the packet */
+        transport_send(& transport, packet_template, length, server_addr);
+        transport_flush(& transport);
+        stats_count_tx(stats, 1, length);
+
+        /* get current time */
+        clock_gettime(AVAILABLE_MONOTONIC_CLOCK, & present_time);
+
+        LOG("Sent packet number %llu to %s.\n", seq_num - 1, server_addr_name);
+
+        const struct message * response = NULL;
+        struct pkt_tstamp rx_tstamp, tx_tstamp = { 0, 0 };
+        if (send_only != 1) {
+            /* get response from the server/multicast address; replies to
+               earlier packets are classified on the way and dropped, a
+               timeout leaves ours to the sequence tracker */
+            while (response == NULL) {
+                read_size = receive_reply(& transport, & rcv_addr,
+                                          & rcv_addr_size, & rx_tstamp);
+                if (read_size < 1)
+                    break;
+                const struct message * reply = (struct message *) buffer;
+                if (! message_valid(reply, read_size))
+                    continue;
+                const u_ll reply_seq_num = message_seq_num(reply);
+                const u_ll lost = seq_tracker.stats.lost;
+                const enum seq_class seq_class = seq_record(& seq_tracker,
+                                                            reply_seq_num);
+                stats_count_rx(stats, read_size);
+                stats_count_seq(stats, seq_class, seq_tracker.stats.lost - lost);
+                if (seq_class != SEQ_DUPLICATE && reply_seq_num == seq_num - 1)
+                    response = reply;
+            }
+            if (response == NULL)
+                fprintf(stderr, "No reply to packet no %llu.\n", seq_num - 1);
+            else {
+                clock_gettime(AVAILABLE_MONOTONIC_CLOCK, & present_time);
+                LOG("Received packet nr %llu from %s.\n", seq_num - 1,
+                    server_addr_name);
+                record_owd(response, & rx_tstamp, & owd.clock);
+                if (verify_payload)
+                    payload_check_packet(& payload_check, packet_template,
+                                         buffer, read_size, length);
+                ++total_responses;
+            }
+
+            /* the TX stamp of our packet is queued by now */
+            if (response && enable_tstamp) {
+                const u_ll response_seq_num = seq_num - 1;
+                u_int id;
+                struct pkt_tstamp tstamp;
+                while (tstamp_read_tx(udp_socket, & id, & tstamp))
+                    if (id == (u_int) response_seq_num)
+                        tx_tstamp = tstamp;
+            }
+        }
+
+        /* write results */
+        const u_ll current_time = timespec_to_ns(& present_time);
+        if (response) {
+            const u_ll response_time = sent_ns;
+            hist_record(& latency_hist, current_time - response_time);
+            stats_record_latency(stats, current_time - response_time);
+            ++phase_stats[phase].received;
+            hist_record(& phase_stats[phase].latency, current_time - response_time);
+            u_ll kern_rtt, hw_rtt;
+            const u_int tstamp_flag = record_kernel_rtt(& tx_tstamp, & rx_tstamp,
+                                                        & kern_rtt, & hw_rtt);
+            if (log_ring.records)
+                log_ring_push(& log_ring, seq_num - 1, response_time,
+                              current_time, current_time - response_time,
+                              kern_rtt, hw_rtt,
+                              (record_sys_clock ? LOG_FLAG_SYS_CLOCK : 0) |
+                              tstamp_flag);
+        }
+        else if (log_ring.records && send_only == TRUE) {
+            log_ring_push(& log_ring, seq_num - 1, current_time,
+                          current_time, 0, 0, 0,
+                          LOG_FLAG_SYS_CLOCK | LOG_FLAG_SEND_ONLY);
+        }
+
+        /* terminate if enough sent */
+        if (max_responses && seq_num >= max_responses)
+            break;
+    }
+}
+
+/* receiver of the rate search; it acknowledges the trial it is on and
+   only touches the trial counters while that is not 0, so that they can
+   be reset and read in between */
+void * search_receiver(void * arg) {
+    (void) arg;
+    while (! receiver_stop) {
+        const ssize_t read_size = recv(udp_socket, buffer, DATAGRAM_BUFFER_SIZE, 0);
+        const u_int id = __atomic_load_n(& search_trial_id, __ATOMIC_ACQUIRE);
+        __atomic_store_n(& search_receiver_id, id, __ATOMIC_RELEASE);
+        if (id == 0 || read_size < 0)
+            continue;
+        const u_ll now = realtime_ns();
+        const struct message * response = (struct message *) buffer;
+        if (! message_valid(response, read_size) ||
+            message_seq_num(response) < search_trial.first_seq)
+            continue;
+        const u_ll rtt = now - be64toh(response -> client_tx_ns);
+        ++search_trial.received;
+        hist_record(& search_trial.latency, rtt);
+        stats_count_rx(stats, read_size);
+        stats_record_latency(stats, rtt);
+    }
+    return NULL;
+}
+
+/* block until the receiver has acknowledged the trial */
+void search_wait_receiver(const u_int id) {
+    while (! receiver_stop &&
+           __atomic_load_n(& search_receiver_id, __ATOMIC_ACQUIRE) != id) {
+        const struct timespec nap = { 0, 1000000 };
+        nanosleep(& nap, NULL);
+    }
+}
+
+/* trials at constant rates until the search has its answer for every
+   payload size */
+void run_search(const struct sockaddr_in * server_addr) {
+    const struct search_spec * spec = & search.spec;
+    char * packet = payload_template_alloc();
+    timeout_set_on_socket(udp_socket, 0, SEARCH_POLL_US);
+    pthread_t receiver;
+    start_thread(& receiver, search_receiver, NULL);
+
+    u_int  id = 0;
+    u_ll   seq_num = 0;
+    double rate;
+    u_int  trial_payload;
+    while (! client_stop && search_next_trial(& search, & rate, & trial_payload)) {
+        /* the receiver is idle, start the trial with clean counters */
+        search_trial.first_seq = seq_num;
+        search_trial.received  = 0;
+        hist_init(& search_trial.latency);
+        __atomic_store_n(& search_trial_id, ++id, __ATOMIC_RELEASE);
+        search_wait_receiver(id);
+
+        const u_int size = sizeof(struct message) + trial_payload;
+        pacer_init(& pacer, pacing_mode, (u_ll) (1E9 / rate));
+        const u_ll end = pacer_clock_ns() + spec -> trial_s * (u_ll) 1E9;
+        u_ll sent = 0, send_errors = 0;
+        while (! client_stop && pacer_wait(& pacer) < end) {
+            /* a refused send still uses up its seq_num, as in flow_send() */
+            fill_message((struct message *) packet, seq_num++);
+            total_sent = seq_num;
+            if (sendto(udp_socket, packet, size, 0, (struct sockaddr *) server_addr,
+                       sizeof(struct sockaddr_in)) == -1) {
+                ++send_errors;
+                continue;
+            }
+            ++sent;
+            stats_count_tx(stats, 1, size);
+        }
+
+        /* settle, then wait for the receiver to let go of the trial */
+        const struct timespec settle = { spec -> settle_s, 0 };
+        if (! client_stop)
+            nanosleep(& settle, NULL);
+        __atomic_store_n(& search_trial_id, 0, __ATOMIC_RELEASE);
+        search_wait_receiver(0);
+        if (client_stop)
+            break; // a cut-short trial proves nothing
+        search_record_trial(& search, sent, send_errors, search_trial.received,
+                            (double) sent / spec -> trial_s,
+                            & search_trial.latency, stdout);
+    }
+    receiver_join(receiver);
+    free(packet);
+}
+
+/* one packet of the flow; a full socket buffer costs the packet its
+   departure but not its sequence number */
+void flow_send(struct flow *           flow,
+               struct stats_counters * counters,
+               char *                  packet) {
+    fill_message((struct message *) packet, flow -> seq_num++);
+    if (send(flow -> socket, packet, sizeof(struct message) + payload_size, 0) != -1) {
+        ++flow -> sent;
+        stats_count_tx(counters, 1, sizeof(struct message) + payload_size);
+    }
+}
+
+/* take every queued reply off the socket of the flow */
+void flow_receive(struct flow *           flow,
+                  struct latency_hist *   latency,
+                  struct stats_counters * counters,
+                  char *                  packet) {
+    ssize_t read_size;
+    while ((read_size = recv(flow -> socket, packet, DATAGRAM_BUFFER_SIZE, 0)) >= 0) {
+        /* the flows keep no send times, the RTT comes off the echoed T1 */
+        const u_ll now = realtime_ns();
+        const struct message * response = (struct message *) packet;
+        if (! message_valid(response, read_size))
+            continue;
+        const u_ll lost = flow -> seq.stats.lost;
+        const enum seq_class seq_class = seq_record(& flow -> seq,
+                                                    message_seq_num(response));
+        stats_count_rx(counters, read_size);
+        stats_count_seq(counters, seq_class, flow -> seq.stats.lost - lost);
+        if (seq_class == SEQ_DUPLICATE || seq_class == SEQ_LATE)
+            continue;
+        const u_ll rtt = now - be64toh(response -> client_tx_ns);
+        flow_record(flow, rtt);
+        hist_record(latency, rtt);
+        stats_record_latency(counters, rtt);
+    }
+}
+
+/* epoll loop of one thread: a timerfd on absolute deadlines paces the
+   thread, every expiry sends on the next flow round-robin */
+void * flow_thread_run(void * arg) {
+    struct flow_thread * ft = (struct flow_thread *) arg;
+    struct flow *        thread_flows = flows + ft -> first;
+    const u_int          timer_tag = ~0U;
+    char *               packet = payload_template_alloc(); // sends
+    char *               reply  = malloc(DATAGRAM_BUFFER_SIZE);
+    const int            epoll_fd = epoll_create1(0);
+    const int            timer_fd = timerfd_create(PACE_CLOCK, 0);
+    if (! reply || epoll_fd == -1 || timer_fd == -1) {
+        fprintf(stderr, "Error setting up flow thread.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct epoll_event event;
+    u_int i;
+    for (i = 0; i < ft -> count; ++i) {
+        event.events   = EPOLLIN;
+        event.data.u32 = i;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, thread_flows[i].socket, & event);
+    }
+    event.events   = EPOLLIN;
+    event.data.u32 = timer_tag;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, & event);
+
+    /* every flow sends once per interval, so the thread sends
+       count times as often; without an interval it sends flat out */
+    const u_ll thread_interval = interval / ft -> count;
+    if (thread_interval) {
+        struct itimerspec spec;
+        memset(& spec, 0, sizeof(spec));
+        clock_gettime(PACE_CLOCK, & spec.it_value);
+        spec.it_interval.tv_sec  = thread_interval / (u_ll) 1E9;
+        spec.it_interval.tv_nsec = thread_interval % (u_ll) 1E9;
+        timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, & spec, NULL);
+    }
+
+    const u_ll to_send   = max_responses * ft -> count; // 0: no limit
+    const u_ll drain_ns  = (timeout ? timeout : 1000) * (u_ll) 1E6;
+    u_ll       sent      = 0; // attempts, the flows count the sends which went out
+    u_ll       drain_end = 0;
+    u_int      next_flow = 0;
+    struct epoll_event events[64];
+    while (! client_stop) {
+        int wait_ms = FLOW_POLL_MS;
+        if (! thread_interval && ! drain_end) {
+            /* flat out: one round over the flows per loop */
+            for (i = 0; i < ft -> count && (! to_send || sent < to_send); ++i, ++sent)
+                flow_send(& thread_flows[i], ft -> stats, packet);
+            wait_ms = 0;
+        }
+        if (to_send && sent >= to_send && ! drain_end) {
+            /* all sent, give the last replies a chance to arrive */
+            const struct itimerspec stop = { { 0, 0 }, { 0, 0 } };
+            timerfd_settime(timer_fd, 0, & stop, NULL);
+            drain_end = pacer_clock_ns() + drain_ns;
+        }
+        if (drain_end) {
+            u_ll received = 0, delivered = 0;
+            for (i = 0; i < ft -> count; ++i) {
+                received  += thread_flows[i].received;
+                delivered += thread_flows[i].sent;
+            }
+            const u_ll now = pacer_clock_ns();
+            if (received >= delivered || now >= drain_end)
+                break;
+            if ((drain_end - now) / (u_ll) 1E6 + 1 < FLOW_POLL_MS)
+                wait_ms = (drain_end - now) / (u_ll) 1E6 + 1;
+        }
+
+        const int ready = epoll_wait(epoll_fd, events, 64, wait_ms);
+        int e;
+        for (e = 0; e < ready; ++e) {
+            if (events[e].data.u32 != timer_tag) {
+                flow_receive(& thread_flows[events[e].data.u32], & ft -> latency,
+                             ft -> stats, reply);
+                continue;
+            }
+            /* catch up on every deadline which has passed */
+            u_ll expirations = 0;
+            if (read(timer_fd, & expirations, sizeof(expirations)) <= 0)
+                continue;
+            for (; expirations > 0 && (! to_send || sent < to_send);
+                 --expirations, ++sent) {
+                flow_send(& thread_flows[next_flow], ft -> stats, packet);
+                if (++next_flow == ft -> count)
+                    next_flow = 0;
+            }
+        }
+    }
+    close(timer_fd);
+    close(epoll_fd);
+    free(packet);
+    free(reply);
+    return NULL;
+}
+
+/* open the flows, spread them over the threads and run them */
+void run_flows(const struct flow_destinations * destinations) {
+    /* every flow holds a descriptor */
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, & limit) == 0 &&
+        limit.rlim_cur < flow_count + 64 && limit.rlim_max > limit.rlim_cur) {
+        limit.rlim_cur = flow_count + 64 < limit.rlim_max ? flow_count + 64
+                                                           : limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, & limit);
+    }
+
+    flows        = calloc(flow_count, sizeof(struct flow));
+    flow_threads = calloc(flow_thread_count, sizeof(struct flow_thread));
+    if (! flows || ! flow_threads) {
+        fprintf(stderr, "Error allocating %u flows.\n", flow_count);
+        exit(EXIT_FAILURE);
+    }
+    u_int i;
+    for (i = 0; i < flow_count; ++i)
+        flow_open(& flows[i], & destinations -> addrs[i % destinations -> count],
+                  socket_tos);
+
+    u_int first = 0;
+    for (i = 0; i < flow_thread_count; ++i) {
+        struct flow_thread * ft = & flow_threads[i];
+        ft -> first = first;
+        ft -> count = flow_count / flow_thread_count +
+                      (i < flow_count % flow_thread_count);
+        first += ft -> count;
+        hist_init(& ft -> latency);
+        if (stats_segment)
+            ft -> stats = & stats_segment -> slots[i];
+    }
+    hist_init(& latency_hist);
+
+    /* only the main thread handles ^C */
+    for (i = 0; i < flow_thread_count; ++i)
+        start_thread(& flow_threads[i].thread, flow_thread_run, & flow_threads[i]);
+    for (i = 0; i < flow_thread_count; ++i)
+        pthread_join(flow_threads[i].thread, NULL);
+}
+
 int main(int argc, char ** argv) {
 
     /* handle ^C behavior */
-    signal(SIGINT, intHandler);
+    signal(SIGINT, stopHandler);
 
     /* parse command line arguments */
     int cmd_flag, err_count = 0, server_addr_given = 0;
-    while ((cmd_flag = getopt(argc, argv, ":s:p:i:n:w:t:P:f:mblrS")) != -1) {
+    while ((cmd_flag = getopt(argc, argv, ":s:p:i:k:R:n:w:t:P:f:O:A:H:I:u:F:D:j:G:M:o:X:L:W:Y:g:mblrSTQV")) != -1) {
         switch (cmd_flag) {
             case 's':
                 server_addr_given = 1;
@@ -99,6 +1201,15 @@ int main(int argc, char ** argv) {
             case 'i':
                 interval      = strtoul(optarg, NULL, 10);
                 break;
+            case 'k':
+                if (! pacer_parse_mode(optarg, & pacing_mode)) {
+                    fprintf(stderr, "Unknown pacing mode: %s\n", optarg);
+                    ++err_count;
+                }
+                break;
+            case 'R':
+                snprintf(profile_spec, sizeof(profile_spec), "%s", optarg);
+                break;
             case 'n':
                 max_responses = strtoul(optarg, NULL, 10);
                 break;
@@ -109,14 +1220,68 @@ int main(int argc, char ** argv) {
                 socket_tos    = strtoul(optarg, NULL, 10);
                 break;
             case 'P':
-                payload_size  = strtoul(optarg, NULL, 10);
+                if (! payload_parse(& payload_mix, optarg, & payload_size))
+                    ++err_count;
                 break;
             case 'f':
                 log_file = fopen(optarg, "w");
                 break;
+            case 'O':
+                snprintf(results_file_name, sizeof(results_file_name), "%s", optarg);
+                break;
+            case 'A':
+                window_size   = strtoull(optarg, NULL, 10);
+                break;
+            case 'H':
+                snprintf(hist_file_name, sizeof(hist_file_name), "%s", optarg);
+                break;
+            case 'I':
+                snprintf(tstamp_interface, sizeof(tstamp_interface), "%s", optarg);
+                break;
+            case 'T':
+                enable_tstamp    = TRUE;
+                break;
+            case 'u':
+                if (! transport_parse_kind(optarg, & transport_kind)) {
+                    fprintf(stderr, "Unknown transport: %s\n", optarg);
+                    ++err_count;
+                }
+                break;
+            case 'Q':
+                enable_sqpoll    = TRUE;
+                break;
+            case 'F':
+                flow_count    = strtoul(optarg, NULL, 10);
+                break;
+            case 'D':
+                snprintf(destinations_spec, sizeof(destinations_spec), "%s", optarg);
+                break;
+            case 'j':
+                flow_thread_count = strtoul(optarg, NULL, 10);
+                break;
+            case 'G':
+                gso_segments  = strtoul(optarg, NULL, 10);
+                break;
+            case 'M':
+                snprintf(stats_name, sizeof(stats_name), "%s", optarg);
+                break;
+            case 'o':
+                report_interval = strtoul(optarg, NULL, 10);
+                break;
+            case 'X':
+                snprintf(search_spec, sizeof(search_spec), "%s", optarg);
+                break;
+            case 'L':
+                if (! lowlat_parse(& lowlat, optarg))
+                    ++err_count;
+                break;
             case 'm':
                 enable_multicast = TRUE;
                 break;
+            case 'g':
+                server_addr_given = 1;
+                snprintf(fanout_spec, sizeof(fanout_spec), "%s", optarg);
+                break;
             case 'b':
                 enable_broadcast = 1;
                 break;
@@ -129,6 +1294,16 @@ int main(int argc, char ** argv) {
             case 'S':
                 send_only        = TRUE;
                 break;
+            case 'V':
+                verify_payload   = TRUE;
+                break;
+            case 'W':
+                if (! trace_writer_open(& trace_writer, optarg))
+                    ++err_count;
+                break;
+            case 'Y':
+                snprintf(replay_spec, sizeof(replay_spec), "%s", optarg);
+                break;
             case ':':
                 fprintf(stderr, "Option -%c requires an operand.\n", optopt);
                 ++err_count;
@@ -139,6 +1314,137 @@ int main(int argc, char ** argv) {
                 break;
         }
     }
+    if (window_size & (window_size - 1)) {
+        fprintf(stderr, "Window size must be a power of two.\n");
+        ++err_count;
+    }
+    if (transport_kind == TRANSPORT_URING && enable_tstamp) {
+        fprintf(stderr, "Kernel timestamps need the syscall transport.\n");
+        ++err_count;
+    }
+    if (profile_spec[0]) {
+        if (! profile_parse(& profile, profile_spec, payload_size, socket_tos))
+            ++err_count;
+    }
+    else
+        profile_constant(& profile, interval, payload_size, socket_tos);
+    if (replay_spec[0]) {
+        if (! trace_load(& replay, replay_spec))
+            ++err_count;
+        if (profile_spec[0] || payload_mix.mode != PAYLOAD_FIXED || gso_segments) {
+            fprintf(stderr, "A replay does not combine with -R, -G or a "
+                            "variable -P.\n");
+            ++err_count;
+        }
+    }
+    if ((replay_spec[0] || trace_writer.file) && (flow_count || search_spec[0])) {
+        fprintf(stderr, "Traces do not combine with -F or -X.\n");
+        ++err_count;
+    }
+
+    /* the largest payload any phase or the replay sends */
+    u_int max_payload = payload_size > replay.max_payload ? payload_size
+                                                          : replay.max_payload;
+    u_int i;
+    for (i = 0; i < profile.phase_count; ++i)
+        if (profile.phases[i].payload_size > max_payload)
+            max_payload = profile.phases[i].payload_size;
+    if (max_payload > MAX_DATAGRAM_SIZE - sizeof(struct message)) {
+        fprintf(stderr, "Payload size must not exceed %zu.\n",
+                MAX_DATAGRAM_SIZE - sizeof(struct message));
+        ++err_count;
+    }
+    if (transport_kind == TRANSPORT_URING &&
+        max_payload > BUFFER_SIZE - sizeof(struct message)) {
+        fprintf(stderr, "The io_uring transport carries at most %zu payload "
+                        "bytes.\n", BUFFER_SIZE - sizeof(struct message));
+        ++err_count;
+    }
+    if (verify_payload && send_only) {
+        fprintf(stderr, "Payload checks need replies, not -S.\n");
+        ++err_count;
+    }
+    if (gso_segments) {
+        /* every phase has to fit its train into one send */
+        const u_int segment_size = sizeof(struct message) + max_payload;
+        if (! window_size || window_size < gso_segments ||
+            enable_tstamp || transport_kind != TRANSPORT_SYSCALL) {
+            fprintf(stderr, "GSO needs -A with a window of at least the train "
+                            "and no -T or -u.\n");
+            ++err_count;
+        }
+        if (gso_segments > GSO_MAX_SEGMENTS ||
+            gso_segments * segment_size > GSO_MAX_PAYLOAD ||
+            segment_size > BUFFER_SIZE) {
+            fprintf(stderr, "A train holds at most %u segments, %u bytes "
+                            "and %u bytes per segment.\n",
+                    GSO_MAX_SEGMENTS, GSO_MAX_PAYLOAD, BUFFER_SIZE);
+            ++err_count;
+        }
+    }
+    struct flow_destinations destinations;
+    if (destinations_spec[0]) {
+        if (! flows_parse_destinations(& destinations, destinations_spec))
+            ++err_count;
+        else if (! flow_count)
+            flow_count = destinations.count;
+        server_addr_given = 1;
+        if (port_number == -1)
+            port_number = 0;
+    }
+    if (flow_count) {
+        if (window_size || enable_tstamp || profile_spec[0] || send_only ||
+            transport_kind != TRANSPORT_SYSCALL) {
+            fprintf(stderr, "Multi-flow mode does not combine with "
+                            "-A, -T, -R, -S or -u.\n");
+            ++err_count;
+        }
+        if (flow_thread_count < 1 || flow_thread_count > flow_count) {
+            fprintf(stderr, "Need between 1 and %u flow threads.\n", flow_count);
+            ++err_count;
+        }
+    }
+    if ((payload_mix.mode != PAYLOAD_FIXED || verify_payload) &&
+        (flow_count || search_spec[0])) {
+        fprintf(stderr, "Variable payloads and -V do not combine with -F or -X.\n");
+        ++err_count;
+    }
+    if (search_spec[0]) {
+        struct search_spec spec;
+        if (! search_parse(& spec, search_spec, payload_size))
+            ++err_count;
+        else
+            search_init(& search, & spec);
+        if (window_size || flow_count || enable_tstamp || profile_spec[0] ||
+            send_only || transport_kind != TRANSPORT_SYSCALL) {
+            fprintf(stderr, "Rate search does not combine with "
+                            "-A, -F, -T, -R, -S or -u.\n");
+            ++err_count;
+        }
+    }
+    if (fanout_spec[0]) {
+        struct fanout_groups groups;
+        if (! fanout_parse_groups(& groups, fanout_spec))
+            ++err_count;
+        else {
+            fanout_init(& fanout, & groups);
+            snprintf(server_addr_name, sizeof(server_addr_name), "%s",
+                     fanout_group_name(& groups, 0));
+        }
+        if (window_size || flow_count || search_spec[0] || send_only ||
+            enable_tstamp || gso_segments || lowlat.enabled || verify_payload ||
+            enable_multicast || results_file_name[0] ||
+            transport_kind != TRANSPORT_SYSCALL) {
+            fprintf(stderr, "Fan-out mode does not combine with -A, -F, -X, "
+                            "-S, -T, -G, -L, -V, -m, -O or -u.\n");
+            ++err_count;
+        }
+    }
+    if (lowlat.enabled && (flow_count || search_spec[0] ||
+                           transport_kind != TRANSPORT_SYSCALL)) {
+        fprintf(stderr, "Low-latency mode does not combine with -F, -X or -u.\n");
+        ++err_count;
+    }
     if (err_count > 0 || port_number == -1 || server_addr_given == 0) {
         fprintf(stderr, USAGE("%s"), argv[0]);
         exit(EXIT_FAILURE);
@@ -148,20 +1454,62 @@ int main(int argc, char ** argv) {
     LOG("Server address:        %s\n",   server_addr_name);
     LOG("Port number:           %i\n",   port_number);
     LOG("Packet interval (ns):  %llu\n", interval);
+    LOG("Pacing mode:           %s\n",   pacer_mode_name(pacing_mode));
+    LOG("Traffic profile:       %s\n",   profile_spec[0] ? profile_spec : "const");
     LOG("Max number of packets: %llu\n", max_responses);
-    LOG("Socket timeout (ms):   %llu\n", timeout);
+    LOG("Reply timeout (ms):    %llu\n", timeout);
     LOG("Socket ToS:            %u\n",   socket_tos);
-    LOG("Payload size:          %u\n",   payload_size);
+    LOG("Payload size:          %u (%s)\n", payload_size,
+        payload_mode_name(payload_mix.mode));
+    LOG("Payload check:         %s\n",   verify_payload   ? "yes" : "no");
+    LOG("Trace replay:          %s\n",   replay_spec[0] ? replay_spec : "no");
+    LOG("Trace recording:       %s\n",   trace_writer.file ? "yes" : "no");
+    LOG("Results file:          %s\n",   results_file_name[0] ? results_file_name : "none");
     LOG("Enable multicast:      %s\n",   enable_multicast ? "yes" : "no");
+    LOG("Fan-out groups:        %s\n",   fanout_spec[0] ? fanout_spec : "none");
     LOG("Enable broadcast:      %s\n",   enable_broadcast ? "yes" : "no");
     LOG("Enable loopback:       %s\n",   enable_loopback  ? "yes" : "no");
     LOG("Record system clock:   %s\n",   record_sys_clock ? "yes" : "no");
     LOG("Send only mode:        %s\n",   send_only        ? "yes" : "no");
+    LOG("Pipeline window:       %llu\n", window_size);
+    LOG("Kernel timestamps:     %s\n",   enable_tstamp    ? "yes" : "no");
+    LOG("Transport:             %s%s\n", transport_kind_name(transport_kind),
+        enable_sqpoll && transport_kind == TRANSPORT_URING ? " (SQPOLL)" : "");
+    LOG("Flows:                 %u\n",   flow_count);
+    LOG("GSO segments:          %u\n",   gso_segments);
+    LOG("Rate search:           %s\n",   search_spec[0] ? search_spec : "no");
+    LOG("Live counters:         %s\n",   stats_name[0] ? stats_name : "no");
+    LOG("Report interval (s):   %u\n",   report_interval);
+    LOG("Low latency:           %s\n",   lowlat.enabled   ? "yes" : "no");
+
+    /* lock before the big allocations so that they are faulted in too */
+    if (lowlat.enabled)
+        lowlat_lock_memory();
+    packet_template = payload_template_alloc();
+
+    /* the packet threads count, the reporter only reads */
+    if (stats_name[0] || report_interval) {
+        stats_segment = stats_create(stats_name, "client",
+                                     flow_count ? flow_thread_count : 1);
+        stats = & stats_segment -> slots[0];
+    }
+    if (report_interval)
+        stats_reporter_start(& stats_reporter, stats_segment, report_interval,
+                             stdout);
+
+    /* many flows, each on a socket of its own */
+    if (flow_count) {
+        if (! destinations_spec[0]) {
+            destinations.count = 1;
+            init_socket(& destinations.addrs[0], server_addr_name, port_number);
+        }
+        LOG("Start %u flows on %u threads.\n", flow_count, flow_thread_count);
+        run_flows(& destinations);
+        intHandler(stop_code);
+    }
 
     /* create socket */
-    struct sockaddr_in server_addr, rcv_addr;
-    socklen_t server_addr_size = sizeof(struct sockaddr_in);
-    socklen_t rcv_addr_size    = sizeof(struct sockaddr_in);
+    struct sockaddr_in server_addr;
 
     /* initialize socket */
     LOG("Initialize socket.\n");
@@ -172,11 +1520,9 @@ int main(int argc, char ** argv) {
     }
 
     /* set ToS */
-    int tos = (socket_tos & 0x3F) << 2;
-    if (tos) {
-        if(setsockopt(udp_socket, IPPROTO_IP, IP_TOS, & tos, sizeof(tos)) < 0)
-            fprintf(stderr, "Failed to set IP_TOS to %i.\n", tos);
-    }
+    if (socket_tos)
+        tos_set_on_socket(udp_socket, socket_tos);
+    current_tos = socket_tos;
 
     /* add to broad/multicast if possible */
     if (enable_multicast) {
@@ -190,100 +1536,84 @@ int main(int argc, char ** argv) {
     const u_long timeout_us = (timeout % (u_long) 1E3) * (u_long) 1E3;
     timeout_set_on_socket(udp_socket, timeout_s, timeout_us);
 
-    /* set time variables */
-    struct timespec sent_time;
-    clock_gettime(AVAILABLE_MONOTONIC_CLOCK, & sent_time);
+    /* kernel stamps; must be on before the first send for OPT_ID */
+    if (enable_tstamp) {
+        if (tstamp_interface[0])
+            tstamp_enable_hw_on_interface(udp_socket, tstamp_interface);
+        tstamp_enable_on_socket(udp_socket, send_only != TRUE);
+    }
 
-    /* talk to server */
-    LOG("Start communicating with the server.\n");
-    int  read_size = 0;
-    u_ll seq_num   = 0;
-    while (TRUE) {
+    /* spin on a non-blocking socket instead; the timeout above stays
+       the default path */
+    if (lowlat.enabled) {
+        lowlat_setup_socket(udp_socket, & lowlat);
+        if (! enable_tstamp)
+            tstamp_enable_on_socket(udp_socket, 0);
+        lowlat_resolve_cpu(& lowlat);
+    }
 
-        /* get current time */
-        struct timespec present_time;
-        clock_gettime(AVAILABLE_MONOTONIC_CLOCK, & present_time);
+    phase_stats = calloc(profile.phase_count, sizeof(struct phase_stats));
+    if (! phase_stats) {
+        fprintf(stderr, "Error allocating phase statistics.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < profile.phase_count; ++i)
+        hist_init(& phase_stats[i].latency);
+    hist_init(& latency_hist);
+    hist_init(& kernel_hist);
+    hist_init(& hw_hist);
+    hist_init(& wakeup_hist);
+    owd_init(& owd);
+    seq_init_at(& seq_tracker, 0);
 
-        /* if enough time is passed */
-        if ((present_time.tv_nsec + present_time.tv_sec * 1E9) -
-            (sent_time.tv_nsec + sent_time.tv_sec * 1E9) >= interval) {
-
-            /* construct the message */
-            struct message msg;
-            msg.header  = MSG_HEADER;
-            msg.sec     = present_time.tv_sec;
-            msg.nsec    = present_time.tv_nsec;
-            msg.seq_num =
-                #ifdef ARM
-                    swap_uint64(seq_num)
-                #else
-                    seq_num
-                #endif
-            ;
-            ++seq_num;
-
-            /* send the packet */
-            if (sendto(udp_socket, &msg, sizeof(struct message) + payload_size, 0,
-                    (struct sockaddr *) & server_addr, server_addr_size) == -1) {
-                fprintf(stderr, "Error on sending UDP packet.\n");
-            }
+    /* the sender receives itself unless a pipelined receiver does */
+    transport_open(& transport, transport_kind, udp_socket,
+                   send_only != TRUE && window_size == 0, enable_sqpoll);
+    if (send_only != TRUE && window_size)
+        transport_open(& rx_transport, transport_kind, udp_socket, TRUE,
+                       enable_sqpoll);
 
-            /* get current time */
-            clock_gettime(AVAILABLE_MONOTONIC_CLOCK, & present_time);
-
-            /* save sent time */
-            sent_time = present_time;
+    /* per-packet records go through the binary log ring */
+    if (results_file_name[0]) {
+        struct timespec now;
+        clock_gettime(AVAILABLE_MONOTONIC_CLOCK, & now);
+        results_open(& results_file, results_file_name, 0, timespec_to_ns(& now));
+    }
+    if (log_file || results_file_name[0])
+        log_ring_open(& log_ring, log_file,
+                      results_file_name[0] ? & results_file : NULL);
 
-            LOG("Sent packet number %llu to %s.\n", seq_num - 1, server_addr_name);
+    /* pin only now: the log writer must not inherit the CPU and the
+       SCHED_FIFO policy of the spinning sender */
+    if (lowlat.enabled)
+        lowlat_setup_thread(& lowlat, 0);
 
-            const struct message * response = NULL;
-            if (send_only != 1) {
-                /* get response from the server/multicast address */
-                read_size = recvfrom(udp_socket, buffer, BUFFER_SIZE, 0,
-                                    (struct sockaddr *) & rcv_addr, & rcv_addr_size);
-                if (read_size < 1)
-                    break;
-                response = (struct message *) buffer;
-                LOG("Received packet nr %llu from %s.\n", seq_num - 1, server_addr_name);
-
-                /* check if the packet has gone missing */
-                u_ll response_seq_num =
-                    #ifdef ARM
-                        swap_uint64(response -> seq_num)
-                    #else
-                        response -> seq_num
-                    #endif
-                ;
-                if (response_seq_num != seq_num - 1) {
-                    fprintf(stderr, "Packet no %llu has gone missing.\n", seq_num - 1);
-                    ++missing_packages;
-                }
-                ++total_responses;
-            }
+    /* requests to many groups, replies from many receivers */
+    if (fanout.groups.count) {
+        LOG("Start the fan-out to %u groups.\n", fanout.groups.count);
+        run_fanout();
+        intHandler(stop_code);
+    }
 
-            /* write results */
-            if (log_file) {
-                if (record_sys_clock) {
-                    const u_ll current_time = present_time.tv_sec * 1E9 +
-                                              present_time.tv_nsec;
-                    fprintf(log_file, "%llu,%llu\n", seq_num - 1, current_time);
-                }
-                else {
-                    const u_ll time_difference =
-                                  (present_time.tv_sec - response -> sec) * 1E9 +
-                                  (present_time.tv_nsec - response -> nsec);
-                    fprintf(log_file, "%llu,%.3f\n", seq_num - 1, time_difference / 1E3);
-                }
-                fflush(log_file);
-            }
+    /* capacity qualification */
+    if (search_spec[0]) {
+        LOG("Start the rate search.\n");
+        run_search(& server_addr);
+        intHandler(stop_code);
+    }
 
-            /* terminate if enough sent */
-            if (total_responses >= max_responses && max_responses)
-                break;
-        }
+    /* pipelined sender/receiver */
+    if (window_size) {
+        LOG("Start pipelined communication with the server.\n");
+        run_pipelined(& server_addr);
+        intHandler(stop_code);
     }
 
-    intHandler(EXIT_SUCCESS);
+    /* talk to server */
+    LOG("Start communicating with the server.\n");
+    run_ping_pong(& server_addr);
+
+    intHandler(stop_code);
 
     return EXIT_SUCCESS;
 }
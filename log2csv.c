@@ -0,0 +1,93 @@
+#include <stdlib.h> // EXIT_SUCCESS, EXIT_FAILURE
+#include <stdio.h>  // FILE, fopen(), fread(), fwrite(), fprintf(), stderr
+
+#include "dbg.h" // bool, TRUE, FALSE, DEBUG_PRINT()
+#include "udp_log.h"
+
+#define USAGE(exec_name) \
+  "Usage: " exec_name " <binary log> [<csv file>]\n" \
+  "Converts a binary client/server log (-f) to the CSV format.\n"
+
+int main(int argc, char ** argv) {
+
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, USAGE("%s"), argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    FILE * in = fopen(argv[1], "rb");
+    if (! in) {
+        fprintf(stderr, "Cannot open %s.\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    FILE * out = argc == 3 ? fopen(argv[2], "w") : stdout;
+    if (! out) {
+        fprintf(stderr, "Cannot open %s.\n", argv[2]);
+        exit(EXIT_FAILURE);
+    }
+
+    /* check the header */
+    struct log_header header;
+    if (fread(& header, sizeof(header), 1, in) != 1 ||
+        header.magic != LOG_MAGIC) {
+        fprintf(stderr, "%s is not a binary log.\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    if (header.version != LOG_VERSION ||
+        header.record_size != sizeof(struct log_record)) {
+        fprintf(stderr, "Unsupported log version %u (record size %u).\n",
+                header.version, header.record_size);
+        exit(EXIT_FAILURE);
+    }
+
+    /* convert the records */
+    struct log_record records[LOG_WRITE_BLOCK];
+    bool   trailer = FALSE;
+    size_t count;
+    u_ll   converted = 0;
+    while (! trailer &&
+           (count = fread(records, sizeof(struct log_record),
+                          LOG_WRITE_BLOCK, in)) > 0) {
+        size_t i;
+        for (i = 0; i < count; ++i) {
+            const struct log_record * r = & records[i];
+            if (r -> flags & LOG_FLAG_TRAILER) {
+                if (r -> seq_num)
+                    fprintf(stderr, "Log dropped %llu records.\n", r -> seq_num);
+                /* rewind to the first byte of the text summary */
+                fseek(in, sizeof(header) +
+                          (converted + 1) * sizeof(struct log_record), SEEK_SET);
+                trailer = TRUE;
+                break;
+            }
+            if (r -> flags & LOG_FLAG_SYS_CLOCK)
+                fprintf(out, "%llu,%llu", r -> seq_num, r -> recv_ns);
+            else
+                fprintf(out, "%llu,%.3f", r -> seq_num, r -> rtt_ns / 1E3);
+
+            /* kernel/hardware stamps next to the user space ones */
+            if (r -> flags & LOG_FLAG_KERNEL_TS) {
+                if (r -> flags & LOG_FLAG_SERVER)
+                    fprintf(out, ",%llu,%llu", r -> kern_ns, r -> hw_ns);
+                else
+                    fprintf(out, ",%.3f,%.3f", r -> kern_ns / 1E3, r -> hw_ns / 1E3);
+            }
+            fputc('\n', out);
+            ++converted;
+        }
+    }
+    if (! trailer)
+        fprintf(stderr, "Log has no trailer, the run was probably killed.\n");
+
+    /* copy the text summary verbatim */
+    char text[BUFFER_SIZE];
+    while ((count = fread(text, 1, sizeof(text), in)) > 0)
+        fwrite(text, 1, count, out);
+
+    fclose(in);
+    if (out != stdout)
+        fclose(out);
+    DEBUG_PRINT("Converted %llu records.\n", converted);
+
+    return EXIT_SUCCESS;
+}
@@ -1,45 +1,245 @@
+#define _GNU_SOURCE // recvmmsg(), sendmmsg(), MSG_WAITFORONE,
+                    // pthread_setaffinity_np(), CPU_SET()
+
 #include <stdlib.h> // EXIT_SUCCESS, EXIT_FAILURE, exit()
 #include <stdio.h> // fprintf(), stderr
 #include <unistd.h> // getopt(), optarg, optopt
-#include <signal.h> // signal(), SIGINT
+#include <signal.h> // signal(), SIGINT, SIGUSR1, sig_atomic_t
 #include <time.h> // timespec, clock_gettime(), CLOCK_MONOTONIC
+#include <pthread.h> // pthread_join()
+#include <sched.h> // cpu_set_t, CPU_ZERO(), CPU_SET()
 
 #include <netinet/in.h> // sockaddr_in, PF_INET, IPPROTO_UDP
 #include <sys/socket.h> // SOCK_DGRAM, socket(), sendto(), recvfrom(), close()
+                        // mmsghdr, recvmmsg(), sendmmsg()
+#include <sys/uio.h>    // iovec
 
 #include "dbg.h" // DEBUG_PRINT(), LOG()
 #include "udp_common.h"
+#include "udp_log.h" // log_ring_open(), log_ring_push(), log_ring_close()
+#include "udp_tstamp.h" // tstamp_enable_on_socket(), tstamp_recvfrom()
+#include "udp_transport.h" // transport_open(), transport_recv(), transport_echo()
+#include "udp_gso.h" // gro_enable_on_socket(), gro_segment_size(), gso_sendto()
+#define SEQ_WINDOW (256) // per peer, keeps the table entries small
+#include "udp_seq.h" // seq_merge(), seq_print_summary()
+#include "udp_peers.h" // peer_lookup(), peer_record(), peer_table_dump()
+#include "udp_stats.h" // stats_create(), stats_count_rx(), stats_reporter_start()
+#include "udp_lowlat.h" // lowlat_parse(), lowlat_setup_socket(), lowlat_again()
+#include "udp_payload.h" // payload_template_alloc(), payload_check_packet()
+#include "udp_fanout.h" // fanout_parse_groups(), fanout_membership()
+#include "udp_packet.h" // packet_ring_open(), packet_ring_wait(), packet_ring_next()
 
 #define USAGE(exec_name) \
  "Usage: " exec_name " [options]\n" \
  "Options:\n" \
   "  -p <port number>         -- port number \n" \
-  "  [-m <multicast address>] -- enable multicast\n" \
+  "  [-m <group>[/<count>]]   -- join <count> consecutive multicast groups;\n" \
+  "                              echoes leave from a socket of their own, so\n" \
+  "                              that receivers sharing a host stay apart;\n" \
+  "                              a single worker only\n" \
   "  [-w <timeout>] (=0)      -- timeout between sending the packets (ms)\n" \
   "  [-r]                     -- record system clock (default: time difference)\n"\
   "  [-x]                     -- enable reply\n" \
   "  [-f] <file name>         -- log file name\n" \
+  "  [-O <file name>]         -- columnar results file (see udpanalyze), the\n" \
+  "                              workers of -j write <file name>.<worker id>\n" \
+  "  [-B <batch size>] (=1)   -- receive/echo up to N packets per syscall\n" \
+  "  [-J <bytes>] (=4096)     -- largest datagram of a -B batch, up to 65507\n" \
+  "                              (io_uring buffers stay at 4096)\n" \
+  "  [-V]                     -- check the payload pattern of every datagram\n" \
+  "  [-j <threads>] (=1)      -- SO_REUSEPORT worker threads, one per CPU\n" \
+  "  [-T]                     -- log kernel (SO_TIMESTAMPING) receive stamps\n" \
+  "  [-u <transport>]         -- syscall (default) or uring (io_uring, Linux 6.0+)\n" \
+  "  [-Q]                     -- io_uring: kernel submission polling (SQPOLL)\n" \
+  "  [-K <interface>]         -- receive from a PACKET_MMAP (TPACKET_V3) ring\n" \
+  "                              on <interface> instead of the UDP socket,\n" \
+  "                              stamped by the ring, a block is handed over\n" \
+  "                              full or after 1 ms; needs CAP_NET_RAW\n" \
+  "  [-G]                     -- UDP_GRO receive, echo with UDP_SEGMENT (GSO)\n" \
+  "  [-E <peers>] (=16384)    -- per-peer statistics for up to N peers per worker\n" \
+  "  [-e <idle>] (=60)        -- expire peers idle for N s (0: never)\n" \
+  "  [-D <file name>]         -- peer table dump (csv), on exit and on SIGUSR1\n" \
+  "  [-M <name>]              -- live counters in shared memory (see udpstat)\n" \
+  "  [-o <seconds>]           -- print an interval report every N s\n" \
+  "  [-L <profile>]           -- low latency: busy-poll receive, workers pinned\n" \
+  "                              from the first CPU on, memory locked, kernel\n" \
+  "                              receive stamps; on or comma separated\n" \
+  "                              cpu=<first CPU>,fifo=<priority>,poll=<us>\n" \
+
+#define WORKER_POLL_MS (100) // io_uring and packet ring: checks for ^C
+
+/* per-thread state; aligned so that the counters of neighbouring
+   workers never share a cache line */
+struct worker {
+    pthread_t thread;
+    int       id;
+    int       udp_socket;
+    int       reply_socket; // udp_socket, or an unbound one for multicast
+    u_ll      seq_num;
+    char *    buffer;
+    FILE *    log_file;
+    struct log_ring log_ring;
+    struct results_file results;
+    struct transport transport;
+    struct packet_ring ring;
+    struct peer_table peers;
+    sig_atomic_t dump_generation;
+    struct stats_counters * stats;
+    struct latency_hist wakeup; // kernel RX stamp to user space
+    struct payload_check payload;
+    u_ll      truncated;            // datagrams larger than a batch slot or buffer
+} __attribute__((aligned(64)));
 
 /* initialize variables */
-int    udp_socket  = -1;
 int    port_number = -1;
 char   multicast_ip[32];
+struct fanout_groups multicast_groups;
+char   log_file_name[256];
+char   results_file_name[256];
 
 bool   enable_multicast = 0;
 bool   record_sys_clock = 0;
 bool   enable_reply     = 0;
-u_ll   seq_num          = 0;
-char   buffer[BUFFER_SIZE];
+bool   enable_tstamp    = 0;
 FILE * log_file         = NULL;
+u_int  batch_size       = 1;
+u_int  batch_slot_size  = BUFFER_SIZE;
+u_int  worker_count     = 1;
+bool   enable_sqpoll    = 0;
+bool   enable_gro       = 0;
+enum transport_kind transport_kind = TRANSPORT_SYSCALL;
+char   packet_interface[IF_NAMESIZE];
+
+/* per-peer statistics */
+u_int  max_peers        = 16384;
+u_ll   peer_idle_s      = 60;
+FILE * peer_file        = NULL;
+pthread_mutex_t peer_file_lock = PTHREAD_MUTEX_INITIALIZER;
+volatile sig_atomic_t dump_generation = 0;
+
+/* live counters, a slot per worker */
+char   stats_name[STATS_NAME_SIZE];
+u_int  report_interval  = 0;
+struct stats_segment * stats_segment = NULL;
+struct stats_reporter  stats_reporter;
+
+/* payload pattern the clients send */
+bool   verify_payload   = 0;
+char * payload_template = NULL;
+
+/* busy polling, pinning and real-time scheduling */
+struct lowlat lowlat;
+
+struct worker * workers = NULL;
+
+/* ^C: the workers leave their loops, main() finishes once they are done */
+volatile sig_atomic_t workers_stop = 0;
+int    stop_code        = EXIT_SUCCESS;
+
+/* SIGUSR1: every worker dumps its peer table with the next packet */
+void dumpHandler(int signal_number) {
+    (void) signal_number;
+    ++dump_generation;
+}
+
+/* blocked receives return 0 once the socket is shut down; io_uring and
+   the packet ring wake up every WORKER_POLL_MS to look at the flag */
+void stopHandler(int signal_number) {
+    stop_code    = signal_number;
+    workers_stop = 1;
+    u_int i;
+    for (i = 0; workers && i < worker_count; ++i)
+        if (workers[i].udp_socket > 0 && transport_kind == TRANSPORT_SYSCALL)
+            shutdown(workers[i].udp_socket, SHUT_RD);
+}
 
+/* the workers are done: close everything and print the summary */
 void intHandler(int return_code) {
-    if(enable_multicast)
-        mcast_drop_membership_on_socket(udp_socket, multicast_ip);
-    if(udp_socket)
-        close(udp_socket);
+    u_ll total_received = 0;
+    struct seq_stats seq;
+    memset(& seq, 0, sizeof(seq));
+    u_int i;
+    for (i = 0; workers && i < worker_count; ++i) {
+        struct worker * w = & workers[i];
+        log_ring_close(& w -> log_ring);
+        results_close(& w -> results, 0);
+        packet_ring_close(& w -> ring);
+        if(enable_multicast)
+            fanout_membership(w -> udp_socket, & multicast_groups, FALSE);
+        if(w -> reply_socket && w -> reply_socket != w -> udp_socket)
+            close(w -> reply_socket);
+        if(w -> udp_socket)
+            close(w -> udp_socket);
+        total_received += w -> seq_num;
+
+        /* the final dump makes the loss of the active peers final too */
+        if (w -> peers.slots) {
+            pthread_mutex_lock(& peer_file_lock);
+            peer_table_dump(& w -> peers, w -> id, TRUE, peer_file);
+            pthread_mutex_unlock(& peer_file_lock);
+            seq_merge(& seq, & w -> peers.expired_seq);
+        }
+
+        /* close the per-worker log streams */
+        if (w -> log_file && w -> log_file != log_file) {
+            fprintf(w -> log_file, "Packets received: %llu\n", w -> seq_num);
+            fprintf(w -> log_file, "Peers: %u active %llu expired "
+                                   "%llu packets untracked\n",
+                    w -> peers.count, w -> peers.expired, w -> peers.overflow);
+            seq_print_summary(& w -> peers.expired_seq, "Sequence", w -> log_file);
+            if (w -> truncated)
+                fprintf(w -> log_file, "Packets truncated: %llu\n", w -> truncated);
+            if (verify_payload)
+                payload_print_summary(& w -> payload, w -> log_file);
+            if (w -> wakeup.total)
+                hist_print_summary(& w -> wakeup, "Wakeup latency", w -> log_file);
+            if (packet_interface[0])
+                packet_ring_print_summary(& w -> ring, w -> log_file);
+            fflush(w -> log_file);
+            fclose(w -> log_file);
+        }
+    }
     if(log_file) {
         /* print statistics */
-        fprintf(log_file, "Packets received: %llu\n", seq_num);
+        if (worker_count > 1) {
+            for (i = 0; i < worker_count; ++i)
+                fprintf(log_file, "Worker %u received: %llu\n",
+                        i, workers[i].seq_num);
+        }
+        fprintf(log_file, "Packets received: %llu\n", total_received);
+        u_ll active = 0, expired = 0, untracked = 0, truncated = 0;
+        struct payload_check payload;
+        memset(& payload, 0, sizeof(payload));
+        for (i = 0; i < worker_count; ++i) {
+            active    += workers[i].peers.count;
+            expired   += workers[i].peers.expired;
+            untracked += workers[i].peers.overflow;
+            truncated += workers[i].truncated;
+            payload_check_merge(& payload, & workers[i].payload);
+        }
+        fprintf(log_file, "Peers: %llu active %llu expired %llu packets untracked\n",
+                active, expired, untracked);
+        seq_print_summary(& seq, "Sequence", log_file);
+        if (truncated)
+            fprintf(log_file, "Packets truncated: %llu (%s)\n", truncated,
+                    transport_kind == TRANSPORT_URING
+                        ? "dropped, larger than an io_uring buffer"
+                        : "raise -J");
+        if (verify_payload)
+            payload_print_summary(& payload, log_file);
+        struct latency_hist wakeup;
+        hist_init(& wakeup);
+        for (i = 0; i < worker_count; ++i)
+            hist_merge(& wakeup, & workers[i].wakeup);
+        if (wakeup.total)
+            hist_print_summary(& wakeup, "Wakeup latency", log_file);
+        if (packet_interface[0]) {
+            struct packet_ring ring;
+            memset(& ring, 0, sizeof(ring));
+            for (i = 0; i < worker_count; ++i)
+                packet_ring_merge(& ring, & workers[i].ring);
+            packet_ring_print_summary(& ring, log_file);
+        }
 
         /* print current time */
         time_t raw_time;
@@ -54,27 +254,568 @@ void intHandler(int return_code) {
 
         LOG("Communication end.\n");
     }
+    if (peer_file) {
+        fflush(peer_file);
+        fclose(peer_file);
+    }
+    if (stats_name[0])
+        stats_remove(stats_name);
     exit(return_code);
 }
 
+/* peer expiry and SIGUSR1 dumps, run by the worker which owns the table */
+void worker_housekeeping(struct worker * w,
+                         const u_ll      now_ns) {
+    if (w -> dump_generation != dump_generation) {
+        w -> dump_generation = dump_generation;
+        FILE * out = peer_file ? peer_file : stderr;
+        pthread_mutex_lock(& peer_file_lock);
+        fprintf(out, "# worker %u at %llu: %u peers\n", w -> id, now_ns,
+                w -> peers.count);
+        peer_table_dump(& w -> peers, w -> id, FALSE, out);
+        fflush(out);
+        pthread_mutex_unlock(& peer_file_lock);
+    }
+    if (w -> peers.idle_ns &&
+        now_ns - w -> peers.last_sweep_ns >= PEER_SWEEP_NS) {
+        pthread_mutex_lock(& peer_file_lock);
+        peer_table_sweep(& w -> peers, now_ns, w -> id, peer_file);
+        pthread_mutex_unlock(& peer_file_lock);
+    }
+}
+
+/* filter, count, log and stamp (T2) a single received datagram;
+   returns FALSE if the packet is not ours */
+bool process_packet(struct worker *            w,
+                    char *                     packet,
+                    const u_int                length,
+                    const struct sockaddr_in * peer_addr,
+                    const struct pkt_tstamp *  tstamp) {
+    struct message * msg = (struct message *) packet;
+
+    /* if not our packet, skip it */
+    if (! message_valid(msg, length))
+        return FALSE;
+
+    /* get current time; the kernel stamp is the better receive time,
+       and how far it lags behind tells how long the wakeup took */
+    struct timespec present_time;
+    clock_gettime(AVAILABLE_MONOTONIC_CLOCK, & present_time);
+    if (tstamp && tstamp -> sw_ns) {
+        message_stamp_rx(msg, tstamp -> sw_ns);
+        hist_record(& w -> wakeup, realtime_ns() - tstamp -> sw_ns);
+    }
+    else
+        message_stamp_rx(msg, realtime_ns());
+
+    const u_ll msg_seq_num = message_seq_num(msg);
+    ++w -> seq_num;
+    if (verify_payload)
+        payload_check_packet(& w -> payload, payload_template, packet, length, 0);
+
+    /* per-peer statistics */
+    const u_ll rx_ns = be64toh(msg -> server_rx_ns);
+    stats_count_rx(w -> stats, length);
+    struct peer * peer = peer_lookup(& w -> peers, peer_addr);
+    if (peer) {
+        const u_ll lost = peer -> seq.stats.lost;
+        const enum seq_class seq_class =
+            peer_record(peer, msg_seq_num, be64toh(msg -> client_tx_ns), rx_ns);
+        stats_count_seq(w -> stats, seq_class, peer -> seq.stats.lost - lost);
+    }
+    else
+        ++w -> peers.overflow;
+    worker_housekeeping(w, rx_ns);
+    LOG("Recieved packet from: %s\tPacket nr: %llu\n",
+        inet_ntoa(peer_addr -> sin_addr), msg_seq_num);
+
+    /* write results */
+    if (w -> log_ring.records) {
+        if (record_sys_clock || results_file_name[0]) {
+            const u_ll current_time =   present_time.tv_sec * (u_ll) 1E9
+                                       + present_time.tv_nsec;
+            if (tstamp)
+                log_ring_push(& w -> log_ring, msg_seq_num, 0, current_time, 0,
+                              tstamp -> sw_ns, tstamp -> hw_ns,
+                              LOG_FLAG_SYS_CLOCK | LOG_FLAG_SERVER |
+                              LOG_FLAG_KERNEL_TS);
+            else
+                log_ring_push(& w -> log_ring, msg_seq_num, 0, current_time, 0,
+                              0, 0, LOG_FLAG_SYS_CLOCK | LOG_FLAG_SERVER);
+        }
+    }
+    return TRUE;
+}
+
+/* one recvfrom() and at most one sendto() per datagram */
+void echo_single(struct worker * w) {
+    struct sockaddr_in peer_addr;
+    socklen_t peer_addr_size = sizeof(struct sockaddr_in);
+    int read_size = 0;
+    while (! workers_stop) {
+
+        /* receive signal from the client */
+        struct pkt_tstamp tstamp;
+        peer_addr_size = sizeof(struct sockaddr_in);
+        if (enable_tstamp)
+            read_size = tstamp_recvfrom(w -> udp_socket, w -> buffer,
+                                        DATAGRAM_BUFFER_SIZE, & peer_addr,
+                                        & peer_addr_size, & tstamp);
+        else
+            read_size = recvfrom(w -> udp_socket, w -> buffer, DATAGRAM_BUFFER_SIZE, 0,
+                                 (struct sockaddr *) & peer_addr, & peer_addr_size);
+        if (lowlat_again(read_size))
+            continue;
+        if (read_size == -1)
+            break;
+
+        if (! process_packet(w, w -> buffer, read_size, & peer_addr,
+                             enable_tstamp ? & tstamp : NULL))
+            continue;
+
+        /* if reply to the client */
+        if (enable_reply) {
+            /* send back to the client */
+            message_stamp_tx((struct message *) w -> buffer, realtime_ns());
+            if (sendto(w -> reply_socket, w -> buffer, read_size, 0,
+                       (struct sockaddr *) & peer_addr, peer_addr_size) == -1) {
+                fprintf(stderr, "Error sending packet to %s\n",
+                                inet_ntoa(peer_addr.sin_addr));
+            }
+            else
+                stats_count_tx(w -> stats, 1, read_size);
+        }
+    }
+}
+
+/* up to depth datagrams per recvmmsg(), echoed back with one sendmmsg() */
+void echo_batched(struct worker * w,
+                  const u_int     depth) {
+    /* preallocate buffers, peer addresses and message vectors */
+    char *               buffers    = malloc((size_t) depth * batch_slot_size);
+    struct sockaddr_in * peers      = calloc(depth, sizeof(struct sockaddr_in));
+    struct iovec *       rx_iov     = calloc(depth, sizeof(struct iovec));
+    struct iovec *       tx_iov     = calloc(depth, sizeof(struct iovec));
+    struct mmsghdr *     rx_msgs    = calloc(depth, sizeof(struct mmsghdr));
+    struct mmsghdr *     tx_msgs    = calloc(depth, sizeof(struct mmsghdr));
+    char *               controls   = enable_tstamp ?
+                          calloc(depth, TSTAMP_CONTROL_SIZE) : NULL;
+    if (! buffers || ! peers || ! rx_iov || ! tx_iov || ! rx_msgs || ! tx_msgs ||
+        (enable_tstamp && ! controls)) {
+        fprintf(stderr, "Error allocating batch of %u buffers.\n", depth);
+        exit(EXIT_FAILURE);
+    }
+
+    u_int i;
+    for (i = 0; i < depth; ++i) {
+        rx_iov[i].iov_base = buffers + (size_t) i * batch_slot_size;
+        rx_iov[i].iov_len  = batch_slot_size;
+        rx_msgs[i].msg_hdr.msg_iov    = & rx_iov[i];
+        rx_msgs[i].msg_hdr.msg_iovlen = 1;
+        rx_msgs[i].msg_hdr.msg_name   = & peers[i];
+    }
+
+    while (! workers_stop) {
+
+        /* reset the lengths clobbered by the previous batch */
+        for (i = 0; i < depth; ++i) {
+            rx_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            if (controls) {
+                rx_msgs[i].msg_hdr.msg_control    =
+                                     controls + (size_t) i * TSTAMP_CONTROL_SIZE;
+                rx_msgs[i].msg_hdr.msg_controllen = TSTAMP_CONTROL_SIZE;
+            }
+        }
+
+        /* block (or spin) until at least one datagram, then take what
+           is queued */
+        const int received = recvmmsg(w -> udp_socket, rx_msgs, depth,
+                                      MSG_WAITFORONE, NULL);
+        if (lowlat_again(received))
+            continue;
+        if (received == -1)
+            break;
+
+        /* filter and account every packet, collect the replies */
+        u_int replies = 0;
+        for (i = 0; i < (u_int) received; ++i) {
+            struct pkt_tstamp tstamp;
+            if (controls)
+                tstamp_parse_cmsg(& rx_msgs[i].msg_hdr, & tstamp);
+            if (rx_msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+                ++w -> truncated;
+            if (! process_packet(w, rx_iov[i].iov_base, rx_msgs[i].msg_len,
+                                 & peers[i],
+                                 controls ? & tstamp : NULL))
+                continue;
+            if (enable_reply) {
+                tx_iov[replies].iov_base = rx_iov[i].iov_base;
+                tx_iov[replies].iov_len  = rx_msgs[i].msg_len;
+                tx_msgs[replies].msg_hdr.msg_iov     = & tx_iov[replies];
+                tx_msgs[replies].msg_hdr.msg_iovlen  = 1;
+                tx_msgs[replies].msg_hdr.msg_name    = & peers[i];
+                tx_msgs[replies].msg_hdr.msg_namelen =
+                                           rx_msgs[i].msg_hdr.msg_namelen;
+                ++replies;
+            }
+        }
+
+        /* echo the whole batch back, T3 is shared by the batch */
+        const u_ll tx_ns = realtime_ns();
+        for (i = 0; i < replies; ++i)
+            message_stamp_tx(tx_iov[i].iov_base, tx_ns);
+        u_int sent = 0;
+        while (sent < replies) {
+            const int rc = sendmmsg(w -> reply_socket, tx_msgs + sent,
+                                    replies - sent, 0);
+            if (rc == -1) {
+                fprintf(stderr, "Error sending packet to %s\n",
+                        inet_ntoa(peers[0].sin_addr));
+                break;
+            }
+            u_ll bytes = 0;
+            int k;
+            for (k = 0; k < rc; ++k)
+                bytes += tx_iov[sent + k].iov_len;
+            stats_count_tx(w -> stats, rc, bytes);
+            sent += rc;
+        }
+    }
+
+    free(buffers);
+    free(peers);
+    free(rx_iov);
+    free(tx_iov);
+    free(rx_msgs);
+    free(tx_msgs);
+    free(controls);
+}
+
+/* io_uring: multishot receive into provided buffers, echoes are sent
+   straight out of those buffers and submitted once per batch */
+void echo_transport(struct worker * w) {
+    struct transport_packet packets[MAX_BATCH_SIZE];
+    transport_open(& w -> transport, transport_kind, w -> udp_socket, TRUE,
+                   enable_sqpoll);
+    while (! workers_stop) {
+        const int received = transport_recv(& w -> transport, packets,
+                                            batch_size > 1 ? batch_size
+                                                           : MAX_BATCH_SIZE,
+                                            WORKER_POLL_MS * (u_ll) 1E6);
+        if (received == -1)
+            continue;
+
+        int i;
+        for (i = 0; i < received; ++i) {
+            if (process_packet(w, packets[i].data, packets[i].length,
+                               & packets[i].addr, NULL) && enable_reply) {
+                message_stamp_tx((struct message *) packets[i].data,
+                                 realtime_ns());
+                transport_echo(& w -> transport, & packets[i]);
+                stats_count_tx(w -> stats, 1, packets[i].length);
+            }
+            else
+                transport_release(& w -> transport, & packets[i]);
+        }
+        transport_flush(& w -> transport);
+    }
+    w -> truncated += w -> transport.ring.truncated;
+    transport_close(& w -> transport);
+}
+
+/* UDP_GRO: one recvmsg() may carry many datagrams of a flow; each is
+   accounted on its own and they go back with a single GSO send */
+void echo_gro(struct worker * w) {
+    char * buffer = malloc(GSO_BUFFER_SIZE);
+    if (! buffer) {
+        fprintf(stderr, "Error allocating GRO buffer.\n");
+        exit(EXIT_FAILURE);
+    }
+    char               control[TSTAMP_CONTROL_SIZE + GSO_CONTROL_SIZE];
+    struct sockaddr_in peer_addr;
+    struct iovec       iov = { buffer, GSO_BUFFER_SIZE };
+    struct msghdr      msg;
+    while (! workers_stop) {
+        memset(& msg, 0, sizeof(msg));
+        msg.msg_name       = & peer_addr;
+        msg.msg_namelen    = sizeof(peer_addr);
+        msg.msg_iov        = & iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+        const int read_size = recvmsg(w -> udp_socket, & msg, 0);
+        if (lowlat_again(read_size))
+            continue;
+        if (read_size == -1)
+            break;
+
+        struct pkt_tstamp tstamp;
+        if (enable_tstamp)
+            tstamp_parse_cmsg(& msg, & tstamp);
+        u_int segment_size = gro_segment_size(& msg);
+        if (segment_size == 0 || segment_size > (u_int) read_size)
+            segment_size = read_size;
+
+        /* keep our segments, packed to the front of the buffer */
+        u_int offset, kept = 0;
+        for (offset = 0; offset < (u_int) read_size; offset += segment_size) {
+            const u_int length = (u_int) read_size - offset < segment_size ?
+                                 (u_int) read_size - offset : segment_size;
+            if (! process_packet(w, buffer + offset, length, & peer_addr,
+                                 enable_tstamp ? & tstamp : NULL))
+                continue;
+            if (kept != offset)
+                memmove(buffer + kept, buffer + offset, length);
+            kept += length;
+        }
+
+        /* echo them with the segmentation they arrived with */
+        const u_ll tx_ns = realtime_ns();
+        for (offset = 0; enable_reply && offset < kept; offset += segment_size)
+            message_stamp_tx((struct message *) (buffer + offset), tx_ns);
+        if (enable_reply && kept) {
+            if (gso_sendto(w -> reply_socket, buffer, kept, segment_size,
+                           & peer_addr) == -1)
+                fprintf(stderr, "Error sending packet to %s\n",
+                        inet_ntoa(peer_addr.sin_addr));
+            else
+                stats_count_tx(w -> stats, (kept + segment_size - 1) / segment_size,
+                               kept);
+        }
+    }
+    free(buffer);
+}
+
+/* PACKET_MMAP: every block the kernel hands over is a batch; its
+   datagrams are accounted right in the ring, stamped with the time the
+   frame was taken, and echoed from the UDP socket with sendmmsg() before
+   the block goes back */
+void echo_packet(struct worker * w) {
+    struct packet_frame packets[MAX_BATCH_SIZE];
+    struct iovec        tx_iov[MAX_BATCH_SIZE];
+    struct mmsghdr      tx_msgs[MAX_BATCH_SIZE];
+    memset(tx_msgs, 0, sizeof(tx_msgs));
+    while (! workers_stop) {
+        struct tpacket_block_desc * block = packet_ring_wait(& w -> ring,
+                                                             WORKER_POLL_MS);
+        if (! block)
+            continue;
+
+        struct tpacket3_hdr * frame = NULL;
+        u_int index = 0, replies = 0;
+        while (TRUE) {
+            const bool more = packet_ring_next(& w -> ring, block, & frame,
+                                               & index, & packets[replies]);
+            if (more) {
+                struct packet_frame * packet = & packets[replies];
+                const struct pkt_tstamp tstamp = {
+                    .sw_ns = packet -> tstamp_ns,
+                    .hw_ns = 0,
+                };
+                if (! process_packet(w, packet -> data, packet -> length,
+                                     & packet -> addr, & tstamp) ||
+                    ! enable_reply)
+                    continue;
+                tx_iov[replies].iov_base = packet -> data;
+                tx_iov[replies].iov_len  = packet -> length;
+                tx_msgs[replies].msg_hdr.msg_iov     = & tx_iov[replies];
+                tx_msgs[replies].msg_hdr.msg_iovlen  = 1;
+                tx_msgs[replies].msg_hdr.msg_name    = & packet -> addr;
+                tx_msgs[replies].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+                if (++replies < MAX_BATCH_SIZE)
+                    continue;
+            }
+
+            /* a block may hold more than a sendmmsg() batch, T3 is
+               shared by the batch */
+            const u_ll tx_ns = realtime_ns();
+            u_int i;
+            for (i = 0; i < replies; ++i)
+                message_stamp_tx(tx_iov[i].iov_base, tx_ns);
+            u_int sent = 0;
+            while (sent < replies) {
+                const int rc = sendmmsg(w -> reply_socket, tx_msgs + sent,
+                                        replies - sent, 0);
+                if (rc == -1) {
+                    fprintf(stderr, "Error sending packet to %s\n",
+                            inet_ntoa(packets[sent].addr.sin_addr));
+                    break;
+                }
+                u_ll bytes = 0;
+                int k;
+                for (k = 0; k < rc; ++k)
+                    bytes += tx_iov[sent + k].iov_len;
+                stats_count_tx(w -> stats, rc, bytes);
+                sent += rc;
+            }
+            replies = 0;
+            if (! more)
+                break;
+        }
+        packet_ring_release(& w -> ring, block);
+    }
+}
+
+/* open, configure and bind the socket of one worker */
+void worker_open_socket(struct worker * w) {
+    struct sockaddr_in socket_addr;
+    socklen_t socket_addr_size = sizeof(struct sockaddr_in);
+
+    init_socket_any(& socket_addr, port_number);
+    if ((w -> udp_socket = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
+        fprintf(stderr, "Error creating on UDP socket.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* let the kernel spread the flows across the workers; group members
+       share the port with the other receivers on the host, every one of
+       them gets a copy */
+    if (worker_count > 1 || enable_multicast)
+        reuseport_enable_on_socket(w -> udp_socket);
+
+    /* join the groups and echo from an ephemeral port */
+    w -> reply_socket = w -> udp_socket;
+    if (enable_multicast) {
+        fanout_membership(w -> udp_socket, & multicast_groups, TRUE);
+        if ((w -> reply_socket = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
+            fprintf(stderr, "Error creating reply socket.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* coalesced receives */
+    if (enable_gro)
+        gro_enable_on_socket(w -> udp_socket);
+
+    /* kernel receive stamps; the ring stamps its frames itself */
+    if (enable_tstamp && ! packet_interface[0])
+        tstamp_enable_on_socket(w -> udp_socket, 0);
+
+    /* the datagrams are taken from the ring, the socket only echoes */
+    if (packet_interface[0])
+        packet_mute_socket(w -> udp_socket);
+
+    /* non-blocking, busy polled */
+    if (lowlat.enabled)
+        lowlat_setup_socket(w -> udp_socket, & lowlat);
+
+    /* associate the socket with a port */
+    if ((bind(w -> udp_socket, (struct sockaddr *) & socket_addr,
+              socket_addr_size)) == -1) {
+        fprintf(stderr, "Error on binding UDP socket.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (packet_interface[0])
+        packet_ring_open(& w -> ring, packet_interface, port_number,
+                         worker_count > 1);
+}
+
+/* pin the calling thread to a CPU, round-robin over the online ones */
+void worker_pin_to_cpu(struct worker * w) {
+    const long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpu_count < 1)
+        return;
+    cpu_set_t cpu_set;
+    CPU_ZERO(& cpu_set);
+    CPU_SET(w -> id % cpu_count, & cpu_set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), & cpu_set))
+        fprintf(stderr, "Failed to pin worker %i to CPU %li.\n",
+                w -> id, w -> id % cpu_count);
+}
+
+void * worker_run(void * arg) {
+    struct worker * w = (struct worker *) arg;
+    if (lowlat.enabled)
+        lowlat_setup_thread(& lowlat, w -> id);
+    else if (worker_count > 1)
+        worker_pin_to_cpu(w);
+    LOG("Start echo worker %i.\n", w -> id);
+    if (packet_interface[0])
+        echo_packet(w);
+    else if (enable_gro)
+        echo_gro(w);
+    else if (transport_kind == TRANSPORT_URING)
+        echo_transport(w);
+    else if (batch_size > 1)
+        echo_batched(w, batch_size);
+    else
+        echo_single(w);
+    return NULL;
+}
+
 int main(int argc, char ** argv) {
 
     /* handle ^C behavior */
-    signal(SIGINT, intHandler);
+    signal(SIGINT, stopHandler);
+    signal(SIGUSR1, dumpHandler);
 
     /* parse command line arguments */
     int cmd_flag, err_count = 0;
-    while ((cmd_flag = getopt(argc, argv, ":p:m:f:rx")) != -1) {
+    while ((cmd_flag = getopt(argc, argv, ":p:m:f:O:B:J:j:u:K:E:e:D:M:o:L:rxTQGV")) != -1) {
         switch (cmd_flag) {
             case 'p':
                 port_number = strtol(optarg, NULL, 10);
                 break;
             case 'm':
                 enable_multicast = 1;
-                strcpy(multicast_ip, optarg);
+                snprintf(multicast_ip, sizeof(multicast_ip), "%s", optarg);
                 break;
             case 'f':
                 log_file = fopen(optarg, "w");
+                snprintf(log_file_name, sizeof(log_file_name), "%s", optarg);
+                break;
+            case 'O':
+                snprintf(results_file_name, sizeof(results_file_name), "%s", optarg);
+                break;
+            case 'B':
+                batch_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'J':
+                batch_slot_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'j':
+                worker_count = strtoul(optarg, NULL, 10);
+                break;
+            case 'u':
+                if (! transport_parse_kind(optarg, & transport_kind)) {
+                    fprintf(stderr, "Unknown transport: %s\n", optarg);
+                    ++err_count;
+                }
+                break;
+            case 'K':
+                snprintf(packet_interface, sizeof(packet_interface), "%s", optarg);
+                break;
+            case 'Q':
+                enable_sqpoll = 1;
+                break;
+            case 'G':
+                enable_gro = 1;
+                break;
+            case 'E':
+                max_peers = strtoul(optarg, NULL, 10);
+                break;
+            case 'e':
+                peer_idle_s = strtoull(optarg, NULL, 10);
+                break;
+            case 'D':
+                peer_file = fopen(optarg, "w");
+                if (! peer_file) {
+                    fprintf(stderr, "Cannot open %s.\n", optarg);
+                    ++err_count;
+                }
+                else
+                    peer_dump_header(peer_file);
+                break;
+            case 'M':
+                snprintf(stats_name, sizeof(stats_name), "%s", optarg);
+                break;
+            case 'o':
+                report_interval = strtoul(optarg, NULL, 10);
+                break;
+            case 'L':
+                if (! lowlat_parse(& lowlat, optarg))
+                    ++err_count;
                 break;
             case 'r':
                 record_sys_clock = 1;
@@ -82,6 +823,12 @@ int main(int argc, char ** argv) {
             case 'x':
                 enable_reply = 1;
                 break;
+            case 'T':
+                enable_tstamp = 1;
+                break;
+            case 'V':
+                verify_payload = 1;
+                break;
             case ':':
                 fprintf(stderr, "Option -%c requires an operand.\n", optopt);
                 ++err_count;
@@ -92,99 +839,163 @@ int main(int argc, char ** argv) {
                 break;
         }
     }
+    if (batch_size < 1 || batch_size > MAX_BATCH_SIZE) {
+        fprintf(stderr, "Batch size must be between 1 and %u.\n", MAX_BATCH_SIZE);
+        ++err_count;
+    }
+    if (batch_slot_size < sizeof(struct message) ||
+        batch_slot_size > MAX_DATAGRAM_SIZE) {
+        fprintf(stderr, "Batch slots must hold between %zu and %u bytes.\n",
+                sizeof(struct message), MAX_DATAGRAM_SIZE);
+        ++err_count;
+    }
+    if (transport_kind == TRANSPORT_URING && enable_tstamp) {
+        fprintf(stderr, "Kernel timestamps need the syscall transport.\n");
+        ++err_count;
+    }
+    if (enable_gro && (transport_kind != TRANSPORT_SYSCALL || batch_size > 1)) {
+        fprintf(stderr, "GRO does not combine with -u or -B.\n");
+        ++err_count;
+    }
+    if (lowlat.enabled && transport_kind != TRANSPORT_SYSCALL) {
+        fprintf(stderr, "Low-latency mode needs the syscall transport.\n");
+        ++err_count;
+    }
+    /* the ring is the batch, and there is no socket to busy-poll */
+    if (packet_interface[0] &&
+        (transport_kind != TRANSPORT_SYSCALL || batch_size > 1 || enable_gro ||
+         lowlat.enabled || enable_multicast)) {
+        fprintf(stderr, "The packet ring does not combine with -u, -B, -G, "
+                        "-L or -m.\n");
+        ++err_count;
+    }
+    if (worker_count < 1) {
+        fprintf(stderr, "Need at least one worker thread.\n");
+        ++err_count;
+    }
+    if (enable_multicast) {
+        if (! fanout_parse_groups(& multicast_groups, multicast_ip))
+            ++err_count;
+        /* io_uring echoes out of the receive socket */
+        if (transport_kind != TRANSPORT_SYSCALL) {
+            fprintf(stderr, "Multicast needs the syscall transport.\n");
+            ++err_count;
+        }
+        /* SO_REUSEPORT does not spread multicast, every worker would get
+           and echo its own copy and show up as a responder of its own */
+        if (worker_count > 1) {
+            fprintf(stderr, "Multicast needs a single worker (no -j).\n");
+            ++err_count;
+        }
+    }
     if (err_count > 0 || port_number == -1) {
         fprintf(stderr, USAGE("%s"), argv[0]);
         exit(EXIT_FAILURE);
     }
 
+    /* the wakeup latency is measured against the kernel receive stamps */
+    if (lowlat.enabled || packet_interface[0])
+        enable_tstamp = 1;
+
     /* print information */
     LOG("Port number:         %i\n", port_number);
     LOG("Enable multicast:    %s\n", enable_multicast ? "yes" : "no");
     if(enable_multicast)
         LOG("Multicast address:   %s\n", multicast_ip);
     LOG("Record system clock: %s\n", record_sys_clock ? "yes" : "no");
+    LOG("Results file:        %s\n", results_file_name[0] ? results_file_name : "none");
     LOG("Enable reply:        %s\n", enable_reply     ? "yes" : "no");
+    LOG("Batch size:          %u (%u byte slots)\n", batch_size, batch_slot_size);
+    LOG("Payload check:       %s\n", verify_payload   ? "yes" : "no");
+    LOG("Worker threads:      %u\n", worker_count);
+    LOG("Kernel timestamps:   %s\n", enable_tstamp    ? "yes" : "no");
+    LOG("UDP GRO:             %s\n", enable_gro       ? "yes" : "no");
+    LOG("Peers per worker:    %u (idle expiry %llu s)\n", max_peers, peer_idle_s);
+    LOG("Transport:           %s%s\n", transport_kind_name(transport_kind),
+        enable_sqpoll && transport_kind == TRANSPORT_URING ? " (SQPOLL)" : "");
+    LOG("Packet ring:         %s\n", packet_interface[0] ? packet_interface : "no");
+    LOG("Live counters:       %s\n", stats_name[0] ? stats_name : "no");
+    LOG("Report interval (s): %u\n", report_interval);
+    LOG("Low latency:         %s\n", lowlat.enabled   ? "yes" : "no");
 
-    /* create sockets */
-    struct sockaddr_in socket_addr;
-    struct sockaddr_in peer_addr;
-    socklen_t socket_addr_size = sizeof(struct sockaddr_in);
-    socklen_t peer_addr_size   = sizeof(struct sockaddr_in);
-
-    /* initialize server sockets */
-    LOG("Initialize socket.\n");
-    init_socket_any(&socket_addr, port_number);
-    if ((udp_socket = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
-        fprintf(stderr, "Error creating on UDP socket.\n");
-        return EXIT_FAILURE;
+    /* lock before the per-worker allocations so that they are faulted in */
+    if (lowlat.enabled) {
+        lowlat_lock_memory();
+        lowlat_resolve_cpu(& lowlat);
     }
+    if (verify_payload)
+        payload_template = payload_template_alloc();
 
-    /* add to multicast if possible */
-    if (enable_multicast) {
-        mcast_add_membership_on_socket(udp_socket, multicast_ip);
+    /* allocate per-worker state */
+    workers = aligned_alloc(64, worker_count * sizeof(struct worker));
+    if (! workers) {
+        fprintf(stderr, "Error allocating %u workers.\n", worker_count);
+        exit(EXIT_FAILURE);
     }
+    memset(workers, 0, worker_count * sizeof(struct worker));
+    if (stats_name[0] || report_interval)
+        stats_segment = stats_create(stats_name, "server", worker_count);
 
-    /* associate the socket with a port */
-    LOG("Bind the socket.\n");
-    if ((bind(udp_socket, (struct sockaddr *) & socket_addr, socket_addr_size))
-              == -1) {
-        fprintf(stderr, "Error on binding UDP socket.\n");
-        return EXIT_FAILURE;
+    /* initialize server sockets */
+    LOG("Initialize sockets.\n");
+    u_int i;
+    for (i = 0; i < worker_count; ++i) {
+        struct worker * w = & workers[i];
+        w -> id     = i;
+        hist_init(& w -> wakeup);
+        peer_table_init(& w -> peers, max_peers, peer_idle_s * (u_ll) 1E9);
+        if (stats_segment)
+            w -> stats = & stats_segment -> slots[i];
+        w -> buffer = malloc(DATAGRAM_BUFFER_SIZE);
+        if (! w -> buffer) {
+            fprintf(stderr, "Error allocating buffer of worker %u.\n", i);
+            exit(EXIT_FAILURE);
+        }
+
+        /* a single worker logs straight into the main file,
+           the others into <file name>.<worker id> */
+        if (log_file && worker_count == 1)
+            w -> log_file = log_file;
+        else if (log_file) {
+            char name[sizeof(log_file_name) + 16];
+            snprintf(name, sizeof(name), "%s.%u", log_file_name, i);
+            w -> log_file = fopen(name, "w");
+        }
+        struct timespec now;
+        clock_gettime(AVAILABLE_MONOTONIC_CLOCK, & now);
+        if (results_file_name[0] && worker_count == 1)
+            results_open(& w -> results, results_file_name,
+                         RESULTS_FLAG_SERVER,
+                         now.tv_sec * (u_ll) 1E9 + now.tv_nsec);
+        else if (results_file_name[0]) {
+            char name[sizeof(results_file_name) + 16];
+            snprintf(name, sizeof(name), "%s.%u", results_file_name, i);
+            results_open(& w -> results, name, RESULTS_FLAG_SERVER,
+                         now.tv_sec * (u_ll) 1E9 + now.tv_nsec);
+        }
+        if (w -> log_file || results_file_name[0])
+            log_ring_open(& w -> log_ring, w -> log_file,
+                          results_file_name[0] ? & w -> results : NULL);
+        worker_open_socket(w);
     }
 
+    if (report_interval)
+        stats_reporter_start(& stats_reporter, stats_segment, report_interval,
+                             stdout);
+
     /* send and receive datagrams */
     LOG("Start echo server.\n");
-    int read_size = 0;
-    while (TRUE) {
-
-        /* receive signal from the client */
-        read_size = recvfrom(udp_socket, buffer, BUFFER_SIZE, 0,
-                             (struct sockaddr *) & peer_addr, & peer_addr_size);
-        if (read_size == -1)
-            break;
-        const struct message * msg = (struct message *) buffer;
-
-        /* if not our packet, skip it */
-        if(msg -> header != MSG_HEADER)
-            continue;
-
-        /* get current time */
-        struct timespec present_time;
-        clock_gettime(AVAILABLE_MONOTONIC_CLOCK, & present_time);
-
-        u_ll msg_seq_num =
-            #ifdef ARM
-                swap_uint64(msg -> seq_num)
-            #else
-                msg -> seq_num
-            #endif
-        ;
-        ++seq_num;
-        LOG("Recieved packet from: %s\tPacket nr: %llu\n",
-            inet_ntoa(peer_addr.sin_addr), msg_seq_num);
-
-        /* write results */
-        if (log_file) {
-            if (record_sys_clock) {
-                const u_ll current_time =   present_time.tv_sec * 1E9
-                                           + present_time.tv_nsec;
-                fprintf(log_file, "%llu,%llu\n", msg_seq_num, current_time);
-                fflush(log_file);
-            }
-        }
-
-        /* if reply to the client */
-        if (enable_reply) {
-            /* send back to the client */
-            if (sendto(udp_socket, buffer, read_size, 0,
-                       (struct sockaddr *) & peer_addr, peer_addr_size) == -1) {
-                fprintf(stderr, "Error sending packet to %s\n",
-                                inet_ntoa(peer_addr.sin_addr));
-            }
-        }
+    if (worker_count == 1)
+        worker_run(& workers[0]);
+    else {
+        /* only the main thread handles ^C */
+        for (i = 0; i < worker_count; ++i)
+            start_thread(& workers[i].thread, worker_run, & workers[i]);
+        for (i = 0; i < worker_count; ++i)
+            pthread_join(workers[i].thread, NULL);
     }
 
-    intHandler(EXIT_SUCCESS);
+    intHandler(stop_code);
 
     return EXIT_SUCCESS;
 }
@@ -4,17 +4,27 @@
 #include <stdlib.h> // EXIT_FAILURE, exit()
 #include <stdio.h>  // fprintf(), stderr
 #include <string.h> // memset()
+#include <stdint.h> // uint16_t, uint32_t, uint64_t
+#include <endian.h> // htobe64(), be64toh()
 #include <time.h>   // timeval, CLOCK_MONOTONIC, CLOCK_MONOTONIC_RAW
+#include <signal.h> // sigset_t, sigemptyset(), sigaddset(), SIGINT
+#include <pthread.h> // pthread_t, pthread_create(), pthread_sigmask()
 
 #include <netinet/in.h> // sockaddr_in, ip_mreq, INADDR_ANY, IPPROTO_IP
                         // IP_ADD_MEMBERSHIP, IP_DROP_MEMBERSHIP, IP_MULTICAST_LOOP
 #include <sys/socket.h> // AF_INET, setsockopt(), SOL_SOCKET, SO_BROADCAST, SO_RCVTIMEO
+                        // SO_REUSEPORT
 #include <arpa/inet.h>  // htons(), htonl()
 
-#define BUFFER_SIZE        (4096)
+#define BUFFER_SIZE        (4096)     // per slot of receive batches and rings
+#define DATAGRAM_BUFFER_SIZE (65536)   // single buffers, fit any datagram
+#define MAX_DATAGRAM_SIZE  (65507)    // IPv4 UDP payload limit
 #define DEFAULT_INTERVAL   ((u_ll) 1E7)
 #define DSRD_PKG_SIZE      (86)
 #define MSG_HEADER         0xFEFEFEFE
+#define MSG_VERSION        (2)
+#define MSG_FLAG_STAMPED   (1 << 0)   // the server filled in T2 and T3
+#define MAX_BATCH_SIZE     (1024)
 
 #ifdef CLOCK_MONOTONIC_RAW
     #define AVAILABLE_MONOTONIC_CLOCK CLOCK_MONOTONIC_RAW
@@ -26,12 +36,17 @@ typedef unsigned int       u_int;
 typedef unsigned long      u_long;
 typedef unsigned long long u_ll;
 
+/* wire format: fixed width, all fields big endian; the four timestamps
+   are CLOCK_REALTIME nanoseconds so that client and server can be compared */
 struct message {
-    u_int header;
-    u_ll  seq_num;
-    u_ll  sec;
-    u_ll  nsec;
-};
+    uint32_t header;       // MSG_HEADER
+    uint16_t version;      // MSG_VERSION
+    uint16_t flags;
+    uint64_t seq_num;
+    uint64_t client_tx_ns; // T1
+    uint64_t server_rx_ns; // T2
+    uint64_t server_tx_ns; // T3
+} __attribute__((packed));
 
 void init_socket(struct sockaddr_in * sock_in,
                  const char *         addr_name,
@@ -90,6 +105,23 @@ void bcast_enable_on_socket(const int socket,
     }
 }
 
+void reuseport_enable_on_socket(const int socket) {
+    const int enable_reuseport = 1;
+    if (setsockopt(socket, SOL_SOCKET, SO_REUSEPORT,
+                   & enable_reuseport, sizeof(enable_reuseport)) < 0) {
+        fprintf(stderr, "Error on setting SO_REUSEPORT on socket.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* ToS code as given on the command line (DSCP, decimal) */
+void tos_set_on_socket(const int socket,
+                       const int tos_code) {
+    int tos = (tos_code & 0x3F) << 2;
+    if (setsockopt(socket, IPPROTO_IP, IP_TOS, & tos, sizeof(tos)) < 0)
+        fprintf(stderr, "Failed to set IP_TOS to %i.\n", tos);
+}
+
 void timeout_set_on_socket(const int    socket,
                            const u_int  timeout_s,
                            const u_long timeout_us) {
@@ -102,12 +134,60 @@ void timeout_set_on_socket(const int    socket,
     }
 }
 
-u_ll swap_uint64(u_ll val) {
-    val =  ((val << 8)  & 0xFF00FF00FF00FF00ULL ) |
-           ((val >> 8)  & 0x00FF00FF00FF00FFULL );
-    val =  ((val << 16) & 0xFFFF0000FFFF0000ULL ) |
-           ((val >> 16) & 0x0000FFFF0000FFFFULL );
-    return  (val << 32) | (val >> 32);
+/* start a helper thread with SIGINT blocked so that ^C always lands
+   in the thread which owns intHandler() */
+void start_thread(pthread_t * thread,
+                  void *   (* routine)(void *),
+                  void *      arg) {
+    sigset_t sig_set, old_set;
+    sigemptyset(& sig_set);
+    sigaddset(& sig_set, SIGINT);
+    pthread_sigmask(SIG_BLOCK, & sig_set, & old_set);
+    if (pthread_create(thread, NULL, routine, arg)) {
+        fprintf(stderr, "Error starting thread.\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_sigmask(SIG_SETMASK, & old_set, NULL);
+}
+
+static inline u_ll realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, & ts);
+    return (u_ll) ts.tv_sec * (u_ll) 1E9 + ts.tv_nsec;
+}
+
+void message_init(struct message * msg,
+                  const u_ll       seq_num,
+                  const u_ll       client_tx_ns) {
+    memset(msg, 0, sizeof(struct message));
+    msg -> header       = htonl(MSG_HEADER);
+    msg -> version      = htons(MSG_VERSION);
+    msg -> seq_num      = htobe64(seq_num);
+    msg -> client_tx_ns = htobe64(client_tx_ns);
+}
+
+/* one of ours, in a format we understand */
+static inline bool message_valid(const struct message * msg,
+                                 const size_t           length) {
+    return length >= sizeof(struct message) &&
+           msg -> header  == htonl(MSG_HEADER) &&
+           msg -> version == htons(MSG_VERSION);
+}
+
+static inline u_ll message_seq_num(const struct message * msg) {
+    return be64toh(msg -> seq_num);
+}
+
+/* server side: T2 on receive, T3 right before the echo */
+static inline void message_stamp_rx(struct message * msg,
+                                    const u_ll       server_rx_ns) {
+    msg -> server_rx_ns = htobe64(server_rx_ns);
+}
+
+static inline void message_stamp_tx(struct message * msg,
+                                    const u_ll       server_tx_ns) {
+    msg -> server_tx_ns = htobe64(server_tx_ns);
+    msg -> flags       |= htons(MSG_FLAG_STAMPED);
 }
 
 #endif
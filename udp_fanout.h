@@ -0,0 +1,370 @@
+#ifndef __udp_fanout__
+#define __udp_fanout__
+
+#include <stdlib.h> // EXIT_FAILURE, exit(), malloc(), aligned_alloc(), qsort()
+#include <stdio.h>  // FILE, fprintf(), snprintf(), stderr
+#include <string.h> // memset(), strchr()
+
+#include <netinet/in.h> // sockaddr_in, ip_mreq, IN_MULTICAST()
+#include <arpa/inet.h>  // inet_aton(), inet_ntoa()
+#include <sys/socket.h> // setsockopt()
+
+#include "udp_common.h" // u_int, u_ll
+#include "udp_hist.h"   // latency_hist, hist_record(), hist_percentile()
+#include "udp_owd.h"    // owd_filter
+#include "udp_seq.h"    // seq_tracker, seq_record(), seq_finish()
+
+/* multicast fan-out: requests go round-robin to a range of consecutive
+   groups, request n to group n % count, and every receiver of a group
+   answers; a reply is attributed to its (group, responder) pair, which
+   the group gets from the sequence number and the responder from the
+   source address, each pair with a sequence space of its own (n / count)
+   and its own loss and latency */
+#define FANOUT_MAX_GROUPS      (4096)
+#define FANOUT_MAX_RESPONDERS  (1024)
+#define FANOUT_SENT_SLOTS      (1 << 16) // send times kept, power of two
+#define FANOUT_TTL             (16)
+#define FANOUT_LOAD_PERCENT    (50)
+#define FANOUT_POLL_MS         (100)     // the receiver checks for the end
+
+struct fanout_groups {
+    u_int first; // host byte order
+    u_int count;
+};
+
+/* a (group, responder) pair; the histogram is allocated on first sight,
+   once per pair and never in the steady state; every responder stamps
+   T2 and T3 with a clock of its own, so each pair filters its offset */
+struct fanout_responder {
+    u_int                 addr;   // network byte order
+    unsigned short        port;
+    unsigned short        used;
+    u_int                 group;  // index
+    u_ll                  received;
+    u_ll                  rtt_sum;
+    struct latency_hist * latency;
+    struct seq_tracker    seq;
+    struct owd_filter     clock;
+};
+
+/* send time of a request; tag is seq_num + 1 once sent_ns is valid */
+struct fanout_sent {
+    u_ll tag;
+    u_ll sent_ns;
+};
+
+struct fanout {
+    struct fanout_groups      groups;
+    struct fanout_responder * slots;
+    u_int                     capacity; // power of two
+    u_int                     count;
+    struct fanout_sent *      sent;
+
+    /* replies matching no pair: too old for the send times, or from
+       responders beyond FANOUT_MAX_RESPONDERS */
+    u_ll                      stale;
+    u_ll                      overflow;
+    u_ll                      replies;
+    struct latency_hist       latency;  // every reply
+};
+
+/* <first group>[/<count>], count consecutive addresses */
+bool fanout_parse_groups(struct fanout_groups * groups,
+                         const char *           text) {
+    char address[32];
+    snprintf(address, sizeof(address), "%s", text);
+    char * slash = strchr(address, '/');
+    groups -> count = 1;
+    if (slash) {
+        * slash = '\0';
+        groups -> count = strtoul(slash + 1, NULL, 10);
+    }
+    struct in_addr first;
+    if (! inet_aton(address, & first) || ! IN_MULTICAST(ntohl(first.s_addr))) {
+        fprintf(stderr, "%s is not a multicast group.\n", address);
+        return FALSE;
+    }
+    groups -> first = ntohl(first.s_addr);
+    if (groups -> count < 1 || groups -> count > FANOUT_MAX_GROUPS ||
+        ! IN_MULTICAST(groups -> first + groups -> count - 1)) {
+        fprintf(stderr, "Need between 1 and %u multicast groups.\n",
+                FANOUT_MAX_GROUPS);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static inline u_int fanout_group_addr(const struct fanout_groups * groups,
+                                      const u_int                  index) {
+    return htonl(groups -> first + index);
+}
+
+const char * fanout_group_name(const struct fanout_groups * groups,
+                               const u_int                  index) {
+    struct in_addr addr = { fanout_group_addr(groups, index) };
+    return inet_ntoa(addr);
+}
+
+/* join or leave every group; the kernel allows
+   net.ipv4.igmp_max_memberships (20 by default) per socket */
+void fanout_membership(const int                    socket,
+                       const struct fanout_groups * groups,
+                       const bool                   join) {
+    u_int i;
+    for (i = 0; i < groups -> count; ++i) {
+        struct ip_mreq mreq;
+        mreq.imr_multiaddr.s_addr = fanout_group_addr(groups, i);
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        if (setsockopt(socket, IPPROTO_IP,
+                       join ? IP_ADD_MEMBERSHIP : IP_DROP_MEMBERSHIP,
+                       & mreq, sizeof(mreq)) < 0 && join) {
+            fprintf(stderr, "Error joining group %s (%u groups need "
+                            "net.ipv4.igmp_max_memberships >= %u).\n",
+                    fanout_group_name(groups, i), groups -> count, groups -> count);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void fanout_init(struct fanout *              fanout,
+                 const struct fanout_groups * groups) {
+    memset(fanout, 0, sizeof(struct fanout));
+    fanout -> groups   = * groups;
+    fanout -> capacity = 64;
+    while (fanout -> capacity * (u_ll) FANOUT_LOAD_PERCENT / 100 <
+           FANOUT_MAX_RESPONDERS)
+        fanout -> capacity <<= 1;
+    fanout -> slots = aligned_alloc(64, (size_t) fanout -> capacity *
+                                        sizeof(struct fanout_responder));
+    fanout -> sent  = aligned_alloc(64, FANOUT_SENT_SLOTS * sizeof(struct fanout_sent));
+    if (! fanout -> slots || ! fanout -> sent) {
+        fprintf(stderr, "Error allocating the fan-out tables.\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(fanout -> slots, 0, (size_t) fanout -> capacity *
+                               sizeof(struct fanout_responder));
+    memset(fanout -> sent, 0, FANOUT_SENT_SLOTS * sizeof(struct fanout_sent));
+    hist_init(& fanout -> latency);
+}
+
+/* sender side */
+static inline void fanout_record_send(struct fanout * fanout,
+                                      const u_ll      seq_num,
+                                      const u_ll      sent_ns) {
+    struct fanout_sent * sent = & fanout -> sent[seq_num & (FANOUT_SENT_SLOTS - 1)];
+    __atomic_store_n(& sent -> tag, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(& sent -> sent_ns, sent_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(& sent -> tag, seq_num + 1, __ATOMIC_RELEASE);
+}
+
+/* send time of seq_num, 0 if its slot has been taken by a later send */
+static inline u_ll fanout_sent_ns(const struct fanout * fanout,
+                                  const u_ll            seq_num) {
+    const struct fanout_sent * sent =
+        & fanout -> sent[seq_num & (FANOUT_SENT_SLOTS - 1)];
+    if (__atomic_load_n(& sent -> tag, __ATOMIC_ACQUIRE) != seq_num + 1)
+        return 0;
+    const u_ll sent_ns = __atomic_load_n(& sent -> sent_ns, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(& sent -> tag, __ATOMIC_RELAXED) == seq_num + 1 ?
+           sent_ns : 0;
+}
+
+static inline u_int fanout_hash(const u_int          addr,
+                                const unsigned short port,
+                                const u_int          group) {
+    /* murmur3 finalizer, as for the peer table */
+    u_ll h = ((u_ll) addr << 32) ^ ((u_ll) port << 16) ^ group;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return (u_int) h;
+}
+
+/* the pair of group and responder, created on first sight; NULL if full */
+static struct fanout_responder * fanout_lookup(struct fanout *            fanout,
+                                               const struct sockaddr_in * addr,
+                                               const u_int                group) {
+    const u_int mask = fanout -> capacity - 1;
+    u_int i = fanout_hash(addr -> sin_addr.s_addr, addr -> sin_port, group) & mask;
+    while (fanout -> slots[i].used) {
+        struct fanout_responder * r = & fanout -> slots[i];
+        if (r -> addr == addr -> sin_addr.s_addr && r -> port == addr -> sin_port &&
+            r -> group == group)
+            return r;
+        i = (i + 1) & mask;
+    }
+    if (fanout -> count >= FANOUT_MAX_RESPONDERS)
+        return NULL;
+    struct fanout_responder * r = & fanout -> slots[i];
+    r -> latency = malloc(sizeof(struct latency_hist));
+    if (! r -> latency) {
+        fprintf(stderr, "Error allocating the histogram of a responder.\n");
+        exit(EXIT_FAILURE);
+    }
+    hist_init(r -> latency);
+    /* a responder owes every request to its group from the first one on */
+    seq_init_at(& r -> seq, 0);
+    r -> addr  = addr -> sin_addr.s_addr;
+    r -> port  = addr -> sin_port;
+    r -> group = group;
+    r -> used  = 1;
+    ++fanout -> count;
+    return r;
+}
+
+/* receiver side: one reply of a responder at now_ns; returns the pair
+   if the reply counts, NULL if it is stale, untracked or a duplicate */
+struct fanout_responder * fanout_record_reply(struct fanout *            fanout,
+                                              const struct sockaddr_in * addr,
+                                              const u_ll                 seq_num,
+                                              const u_ll                 now_ns) {
+    ++fanout -> replies;
+    const u_ll sent_ns = fanout_sent_ns(fanout, seq_num);
+    if (! sent_ns) {
+        ++fanout -> stale;
+        return NULL;
+    }
+    struct fanout_responder * r =
+        fanout_lookup(fanout, addr, seq_num % fanout -> groups.count);
+    if (! r) {
+        ++fanout -> overflow;
+        return NULL;
+    }
+    const enum seq_class seq_class = seq_record(& r -> seq,
+                                                seq_num / fanout -> groups.count);
+    if (seq_class == SEQ_DUPLICATE || seq_class == SEQ_LATE)
+        return NULL;
+    ++r -> received;
+    r -> rtt_sum += now_ns - sent_ns;
+    hist_record(r -> latency, now_ns - sent_ns);
+    hist_record(& fanout -> latency, now_ns - sent_ns);
+    return r;
+}
+
+/* end of the run: a pair owes every request sent to its group */
+void fanout_finish(struct fanout * fanout,
+                   const u_ll      total_sent) {
+    u_int i;
+    for (i = 0; i < fanout -> capacity; ++i) {
+        struct fanout_responder * r = & fanout -> slots[i];
+        if (! r -> used || ! r -> seq.started)
+            continue;
+        const u_ll count = fanout -> groups.count;
+        seq_finish(& r -> seq, total_sent / count + (r -> group < total_sent % count));
+    }
+}
+
+static int fanout_compare(const void * a,
+                          const void * b) {
+    const struct fanout_responder * x = * (const struct fanout_responder **) a;
+    const struct fanout_responder * y = * (const struct fanout_responder **) b;
+    if (x -> group != y -> group)
+        return x -> group < y -> group ? -1 : 1;
+    if (x -> addr != y -> addr)
+        return ntohl(x -> addr) < ntohl(y -> addr) ? -1 : 1;
+    return ntohs(x -> port) < ntohs(y -> port) ? -1 : ntohs(x -> port) > ntohs(y -> port);
+}
+
+static int fanout_compare_ns(const void * a,
+                             const void * b) {
+    const u_ll x = * (const u_ll *) a, y = * (const u_ll *) b;
+    return x < y ? -1 : x > y;
+}
+
+static int fanout_compare_offset(const void * a,
+                                 const void * b) {
+    const long long x = * (const long long *) a, y = * (const long long *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* how a percentile spreads over the pairs: min, median and max */
+static void fanout_print_spread(struct fanout_responder ** pairs,
+                                const u_int                count,
+                                const double               fraction,
+                                const char *               label,
+                                FILE *                     out) {
+    u_ll values[FANOUT_MAX_RESPONDERS];
+    u_int i, n = 0;
+    for (i = 0; i < count; ++i)
+        if (pairs[i] -> latency -> total)
+            values[n++] = hist_percentile(pairs[i] -> latency, fraction);
+    if (! n)
+        return;
+    qsort(values, n, sizeof(u_ll), fanout_compare_ns);
+    fprintf(out, "Responder %s spread (us): min %.3f median %.3f max %.3f\n",
+            label, values[0] / 1E3, values[n / 2] / 1E3, values[n - 1] / 1E3);
+}
+
+/* how far the clocks of the responders are apart */
+static void fanout_print_offset_spread(struct fanout_responder ** pairs,
+                                       const u_int                count,
+                                       FILE *                     out) {
+    long long values[FANOUT_MAX_RESPONDERS];
+    u_int i, n = 0;
+    for (i = 0; i < count; ++i)
+        if (pairs[i] -> clock.samples)
+            values[n++] = pairs[i] -> clock.offset_ns;
+    if (! n)
+        return;
+    qsort(values, n, sizeof(long long), fanout_compare_offset);
+    fprintf(out, "Responder clock offset spread (us): min %.3f median %.3f "
+                 "max %.3f\n",
+            values[0] / 1E3, values[n / 2] / 1E3, values[n - 1] / 1E3);
+}
+
+/* a line per (group, responder), then the totals and the spread */
+void fanout_print_summary(struct fanout * fanout,
+                          const u_ll      total_sent,
+                          FILE *          out) {
+    struct fanout_responder * pairs[FANOUT_MAX_RESPONDERS];
+    u_int i, count = 0;
+    for (i = 0; i < fanout -> capacity; ++i)
+        if (fanout -> slots[i].used)
+            pairs[count++] = & fanout -> slots[i];
+    qsort(pairs, count, sizeof(pairs[0]), fanout_compare);
+
+    struct seq_stats totals;
+    memset(& totals, 0, sizeof(totals));
+    for (i = 0; i < count; ++i) {
+        const struct fanout_responder * r = pairs[i];
+        const struct seq_stats *        s = & r -> seq.stats;
+        struct in_addr addr = { r -> addr };
+        char responder[32];
+        snprintf(responder, sizeof(responder), "%s:%u", inet_ntoa(addr),
+                 ntohs(r -> port));
+        fprintf(out, "Group %s responder %s: received %llu lost %llu (%.3f%%) "
+                     "reordered %llu duplicate %llu late %llu ",
+                fanout_group_name(& fanout -> groups, r -> group), responder,
+                s -> received, s -> lost,
+                s -> received + s -> lost ?
+                100.0 * s -> lost / (s -> received + s -> lost) : 0.0,
+                s -> reordered, s -> duplicates, s -> late);
+        if (r -> clock.samples)
+            fprintf(out, "offset (us) %.3f ", r -> clock.offset_ns / 1E3);
+        if (r -> latency -> total)
+            fprintf(out, "latency (us) mean %.3f p50 %.3f p99 %.3f max %.3f\n",
+                    (double) r -> rtt_sum / r -> received / 1E3,
+                    hist_percentile(r -> latency, 0.5)  / 1E3,
+                    hist_percentile(r -> latency, 0.99) / 1E3,
+                    r -> latency -> max / 1E3);
+        else
+            fprintf(out, "\n");
+        seq_merge(& totals, s);
+    }
+
+    fprintf(out, "Fan-out: %u groups %u pairs sent %llu replies %llu "
+                 "(%.2f per request) stale %llu untracked %llu\n",
+            fanout -> groups.count, count, total_sent, fanout -> replies,
+            total_sent ? (double) fanout -> replies / total_sent : 0.0,
+            fanout -> stale, fanout -> overflow);
+    seq_print_summary(& totals, "Sequence", out);
+    hist_print_summary(& fanout -> latency, "Latency", out);
+    fanout_print_spread(pairs, count, 0.5,  "p50", out);
+    fanout_print_spread(pairs, count, 0.99, "p99", out);
+    fanout_print_offset_spread(pairs, count, out);
+}
+
+#endif
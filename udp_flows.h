@@ -0,0 +1,150 @@
+#ifndef __udp_flows__
+#define __udp_flows__
+
+#include <stdlib.h> // EXIT_FAILURE, exit(), strtoul()
+#include <stdio.h>  // FILE, fprintf(), stderr
+#include <string.h> // memset(), strchr(), strncpy()
+#include <fcntl.h>  // fcntl(), O_NONBLOCK
+#include <unistd.h> // close()
+
+#include "udp_common.h" // u_int, u_ll, init_socket(), tos_set_on_socket()
+#include "udp_hist.h"   // latency_hist, hist_record(), hist_print_summary()
+#include "udp_seq.h"    // seq_tracker, seq_record(), seq_finish()
+
+/* multi-flow mode: many sockets, each talking to one destination with a
+   sequence space and statistics of its own; a flow keeps no histogram,
+   which would cost 60 kB per flow, only the moments of its RTT */
+#define MAX_DESTINATIONS   (1024)
+
+struct flow {
+    int                socket;
+    struct sockaddr_in destination;
+    u_ll               seq_num;     // next to send
+    u_ll               sent;
+    u_ll               received;
+    u_ll               rtt_sum;
+    u_ll               rtt_min;
+    u_ll               rtt_max;
+    struct seq_tracker seq;
+};
+
+struct flow_destinations {
+    struct sockaddr_in addrs[MAX_DESTINATIONS];
+    u_int              count;
+};
+
+/* comma separated <address>:<port> or <address>:<first port>-<last port> */
+bool flows_parse_destinations(struct flow_destinations * dst,
+                              const char *               spec) {
+    memset(dst, 0, sizeof(struct flow_destinations));
+    char list[1024];
+    snprintf(list, sizeof(list), "%s", spec);
+    char * save = NULL;
+    char * item;
+    for (item = strtok_r(list, ",", & save); item;
+         item = strtok_r(NULL, ",", & save)) {
+        char * colon = strchr(item, ':');
+        if (! colon) {
+            fprintf(stderr, "Destination %s has no port.\n", item);
+            return FALSE;
+        }
+        * colon = '\0';
+        char * end;
+        u_int first = strtoul(colon + 1, & end, 10);
+        u_int last  = * end == '-' ? strtoul(end + 1, & end, 10) : first;
+        if (* end || first == 0 || last < first || last > 65535) {
+            fprintf(stderr, "Invalid port range for %s.\n", item);
+            return FALSE;
+        }
+        u_int port;
+        for (port = first; port <= last; ++port) {
+            if (dst -> count >= MAX_DESTINATIONS) {
+                fprintf(stderr, "More than %u destinations.\n", MAX_DESTINATIONS);
+                return FALSE;
+            }
+            init_socket(& dst -> addrs[dst -> count++], item, port);
+        }
+    }
+    return dst -> count > 0;
+}
+
+/* a non-blocking socket connected to the destination, so that the kernel
+   hands it the replies of its own flow only */
+void flow_open(struct flow *              flow,
+               const struct sockaddr_in * destination,
+               const int                  tos) {
+    memset(flow, 0, sizeof(struct flow));
+    flow -> destination = * destination;
+    flow -> rtt_min     = ~0ULL;
+    seq_init_at(& flow -> seq, 0);
+    if ((flow -> socket = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
+        fprintf(stderr, "Error creating UDP socket (raise ulimit -n?).\n");
+        exit(EXIT_FAILURE);
+    }
+    if (tos)
+        tos_set_on_socket(flow -> socket, tos);
+    if (connect(flow -> socket, (struct sockaddr *) destination,
+                sizeof(struct sockaddr_in)) == -1) {
+        fprintf(stderr, "Error connecting UDP socket to %s:%u.\n",
+                inet_ntoa(destination -> sin_addr), ntohs(destination -> sin_port));
+        exit(EXIT_FAILURE);
+    }
+    fcntl(flow -> socket, F_SETFL, fcntl(flow -> socket, F_GETFL) | O_NONBLOCK);
+}
+
+static inline void flow_record(struct flow * flow,
+                               const u_ll    rtt_ns) {
+    ++flow -> received;
+    flow -> rtt_sum += rtt_ns;
+    if (rtt_ns < flow -> rtt_min)
+        flow -> rtt_min = rtt_ns;
+    if (rtt_ns > flow -> rtt_max)
+        flow -> rtt_max = rtt_ns;
+}
+
+/* aggregated statistics; the spread of the per-flow mean RTTs shows how
+   evenly the flows are served, each flow gets a line when verbose */
+void flows_print_summary(struct flow *               flows,
+                         const u_int                 flow_count,
+                         const u_int                 thread_count,
+                         const struct latency_hist * latency,
+                         const bool                  verbose,
+                         FILE *                      out) {
+    static struct latency_hist flow_means;
+    hist_init(& flow_means);
+    struct seq_stats seq;
+    memset(& seq, 0, sizeof(seq));
+    u_ll sent = 0, received = 0;
+    u_int i;
+    for (i = 0; i < flow_count; ++i) {
+        struct flow * flow = & flows[i];
+        sent     += flow -> sent;
+        received += flow -> received;
+        seq_finish(& flow -> seq, flow -> seq_num);
+        seq_merge(& seq, & flow -> seq.stats);
+        if (flow -> received)
+            hist_record(& flow_means, flow -> rtt_sum / flow -> received);
+        if (! verbose)
+            continue;
+        fprintf(out, "Flow %u %s:%u\tSent: %llu\tReceived: %llu\t",
+                i, inet_ntoa(flow -> destination.sin_addr),
+                ntohs(flow -> destination.sin_port), flow -> sent,
+                flow -> received);
+        if (flow -> received)
+            fprintf(out, "RTT (us): min %.3f mean %.3f max %.3f\n",
+                    flow -> rtt_min / 1E3,
+                    (double) flow -> rtt_sum / flow -> received / 1E3,
+                    flow -> rtt_max / 1E3);
+        else
+            fprintf(out, "RTT (us): no samples\n");
+    }
+    fprintf(out, "Flows: %u\tThreads: %u\tSent: %llu\tReceived: %llu\t"
+                 "Packet loss: %.3f%%\n",
+            flow_count, thread_count, sent, received,
+            sent && received < sent ? 100.0 * (sent - received) / sent : 0.0);
+    seq_print_summary(& seq, "Sequence", out);
+    hist_print_summary(latency, "Latency", out);
+    hist_print_summary(& flow_means, "Per-flow mean latency", out);
+}
+
+#endif
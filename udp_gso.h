@@ -0,0 +1,76 @@
+#ifndef __udp_gso__
+#define __udp_gso__
+
+#include <stdlib.h> // EXIT_FAILURE, exit()
+#include <stdio.h>  // fprintf(), stderr
+#include <string.h> // memset(), memcpy()
+
+#include <netinet/in.h>  // sockaddr_in, IPPROTO_UDP
+#include <netinet/udp.h> // UDP_SEGMENT, UDP_GRO
+#include <sys/socket.h>  // msghdr, cmsghdr, sendmsg(), setsockopt(), SOL_UDP
+#include <sys/uio.h>     // iovec
+
+#include "udp_common.h" // u_int
+
+/* UDP segmentation offload: one send of up to GSO_MAX_SEGMENTS equal-size
+   datagrams, and on the receive side datagrams of a flow coalesced into
+   one buffer plus the size of its segments (Linux 4.18 / 5.0) */
+#define GSO_BUFFER_SIZE      (65536)
+#define GSO_MAX_PAYLOAD      (65507) // largest UDP payload over IPv4
+#define GSO_MAX_SEGMENTS     (64)    // UDP_MAX_SEGMENTS of the kernel
+#define GSO_CONTROL_SIZE     (CMSG_SPACE(sizeof(int)))
+
+void gro_enable_on_socket(const int socket) {
+    const int enable_gro = 1;
+    if (setsockopt(socket, IPPROTO_UDP, UDP_GRO,
+                   & enable_gro, sizeof(enable_gro)) < 0) {
+        fprintf(stderr, "Error on setting UDP_GRO on socket.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* send length bytes as datagrams of segment_size, the last may be shorter */
+int gso_sendto(const int                  socket,
+               const void *               buffer,
+               const u_int                length,
+               const u_int                segment_size,
+               const struct sockaddr_in * addr) {
+    struct iovec iov = { (void *) buffer, length };
+    struct msghdr msg;
+    memset(& msg, 0, sizeof(msg));
+    msg.msg_name    = (void *) addr;
+    msg.msg_namelen = sizeof(struct sockaddr_in);
+    msg.msg_iov     = & iov;
+    msg.msg_iovlen  = 1;
+
+    /* a single segment goes out without the cmsg */
+    char control[GSO_CONTROL_SIZE];
+    if (length > segment_size) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr * cmsg = CMSG_FIRSTHDR(& msg);
+        cmsg -> cmsg_level = SOL_UDP;
+        cmsg -> cmsg_type  = UDP_SEGMENT;
+        cmsg -> cmsg_len   = CMSG_LEN(sizeof(uint16_t));
+        const uint16_t gso_size = segment_size;
+        memcpy(CMSG_DATA(cmsg), & gso_size, sizeof(gso_size));
+        msg.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+    }
+    return sendmsg(socket, & msg, 0);
+}
+
+/* segment size of a coalesced receive; 0 if the kernel did not merge */
+u_int gro_segment_size(struct msghdr * msg) {
+    struct cmsghdr * cmsg;
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg -> cmsg_level == SOL_UDP && cmsg -> cmsg_type == UDP_GRO) {
+            int gso_size;
+            memcpy(& gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+            return gso_size;
+        }
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef __udp_hist__
+#define __udp_hist__
+
+#include <stdio.h>  // FILE, fprintf()
+#include <string.h> // memset()
+
+#include "udp_common.h" // u_int, u_ll
+
+/* log-linear latency histogram in the spirit of HdrHistogram: every power
+   of two is split into HIST_SUB_COUNT linear sub-buckets, which bounds the
+   relative error to 1 / HIST_SUB_COUNT over the whole u_ll range */
+#define HIST_SUB_BITS      (7)
+#define HIST_SUB_COUNT     (1 << HIST_SUB_BITS)
+#define HIST_BUCKET_COUNT  ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+struct latency_hist {
+    u_ll counts[HIST_BUCKET_COUNT];
+    u_ll total;
+    u_ll sum;
+    u_ll min;
+    u_ll max;
+};
+
+void hist_init(struct latency_hist * hist) {
+    memset(hist, 0, sizeof(struct latency_hist));
+    hist -> min = ~0ULL;
+}
+
+static inline u_int hist_index(const u_ll value) {
+    /* values below 2 * HIST_SUB_COUNT are stored exactly */
+    if (value < 2 * HIST_SUB_COUNT)
+        return value;
+    const u_int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return shift * HIST_SUB_COUNT + (value >> shift);
+}
+
+/* smallest value which falls into the bucket */
+static inline u_ll hist_lower_bound(const u_int index) {
+    if (index < 2 * HIST_SUB_COUNT)
+        return index;
+    const u_int shift = index / HIST_SUB_COUNT - 1;
+    return (u_ll) (index - shift * HIST_SUB_COUNT) << shift;
+}
+
+static inline u_ll hist_upper_bound(const u_int index) {
+    if (index < 2 * HIST_SUB_COUNT)
+        return index;
+    const u_int shift = index / HIST_SUB_COUNT - 1;
+    return hist_lower_bound(index) + ((1ULL << shift) - 1);
+}
+
+/* O(1), allocation free */
+static inline void hist_record(struct latency_hist * hist,
+                               const u_ll            value) {
+    ++hist -> counts[hist_index(value)];
+    ++hist -> total;
+    hist -> sum += value;
+    if (value < hist -> min)
+        hist -> min = value;
+    if (value > hist -> max)
+        hist -> max = value;
+}
+
+/* add all samples of src to dst */
+void hist_merge(struct latency_hist *       dst,
+                const struct latency_hist * src) {
+    u_int i;
+    for (i = 0; i < HIST_BUCKET_COUNT; ++i)
+        dst -> counts[i] += src -> counts[i];
+    dst -> total += src -> total;
+    dst -> sum   += src -> sum;
+    if (src -> min < dst -> min)
+        dst -> min = src -> min;
+    if (src -> max > dst -> max)
+        dst -> max = src -> max;
+}
+
+/* value at quantile q (0..1), reported as the middle of its bucket */
+u_ll hist_percentile(const struct latency_hist * hist,
+                     const double                q) {
+    if (hist -> total == 0)
+        return 0;
+    u_ll rank = (u_ll) (q * hist -> total + 0.5);
+    if (rank < 1)
+        rank = 1;
+    u_ll seen = 0;
+    u_int i;
+    for (i = 0; i < HIST_BUCKET_COUNT; ++i) {
+        seen += hist -> counts[i];
+        if (seen >= rank) {
+            u_ll value = (hist_lower_bound(i) + hist_upper_bound(i)) / 2;
+            if (value > hist -> max)
+                value = hist -> max;
+            if (value < hist -> min)
+                value = hist -> min;
+            return value;
+        }
+    }
+    return hist -> max;
+}
+
+/* one line summary in microseconds, like the CSV log */
+void hist_print_summary(const struct latency_hist * hist,
+                        const char *                label,
+                        FILE *                      out) {
+    if (hist -> total == 0) {
+        fprintf(out, "%s (us): no samples\n", label);
+        return;
+    }
+    fprintf(out, "%s (us): min %.3f mean %.3f p50 %.3f p90 %.3f "
+                 "p99 %.3f p99.9 %.3f p99.99 %.3f max %.3f\n",
+            label,
+            hist -> min / 1E3,
+            (double) hist -> sum / hist -> total / 1E3,
+            hist_percentile(hist, 0.5)    / 1E3,
+            hist_percentile(hist, 0.9)    / 1E3,
+            hist_percentile(hist, 0.99)   / 1E3,
+            hist_percentile(hist, 0.999)  / 1E3,
+            hist_percentile(hist, 0.9999) / 1E3,
+            hist -> max / 1E3);
+}
+
+/* non-empty buckets as lower_ns,upper_ns,count,cumulative_fraction */
+void hist_dump(const struct latency_hist * hist,
+               FILE *                      out) {
+    u_ll seen = 0;
+    u_int i;
+    for (i = 0; i < HIST_BUCKET_COUNT; ++i) {
+        if (hist -> counts[i] == 0)
+            continue;
+        seen += hist -> counts[i];
+        fprintf(out, "%llu,%llu,%llu,%.6f\n",
+                hist_lower_bound(i), hist_upper_bound(i), hist -> counts[i],
+                (double) seen / hist -> total);
+    }
+}
+
+#endif
@@ -0,0 +1,200 @@
+#ifndef __udp_log__
+#define __udp_log__
+
+#include <stdlib.h>  // EXIT_FAILURE, exit(), aligned_alloc(), free()
+#include <stdio.h>   // FILE, fileno(), fprintf(), stderr
+#include <string.h>  // memset()
+#include <time.h>    // timespec, nanosleep()
+#include <unistd.h>  // write()
+#include <pthread.h> // pthread_t, pthread_join()
+
+#include "udp_common.h"  // u_int, u_ll, start_thread()
+#include "udp_results.h" // results_file, results_append(), results_commit()
+
+/* binary per-packet log: a log_header followed by fixed-size log_records;
+   a record carrying LOG_FLAG_TRAILER marks the start of the plain-text
+   summary which runs until the end of the file */
+#define LOG_MAGIC          0x55445047 // "UDPG"
+#define LOG_VERSION        2
+#define LOG_RING_SIZE      (1 << 16)  // records, power of two
+#define LOG_WRITE_BLOCK    (1 << 12)  // records per write() when busy
+#define LOG_FLUSH_NS       ((u_ll) 1E7)
+
+#define LOG_FLAG_SYS_CLOCK (1 << 0)   // CSV line is seq,recv_ns
+#define LOG_FLAG_SERVER    (1 << 1)
+#define LOG_FLAG_SEND_ONLY (1 << 2)
+#define LOG_FLAG_KERNEL_TS (1 << 3)   // kern_ns/hw_ns are filled in
+#define LOG_FLAG_TRAILER   (1U << 31)
+
+struct log_header {
+    u_int magic;
+    u_int version;
+    u_int record_size;
+    u_int reserved;
+};
+
+struct log_record {
+    u_ll  seq_num;
+    u_ll  sent_ns;
+    u_ll  recv_ns;
+    u_ll  rtt_ns;
+    u_ll  kern_ns;  // client: kernel RTT, server: kernel RX stamp
+    u_ll  hw_ns;    // client: hardware RTT, server: hardware RX stamp
+    u_int flags;
+    u_int reserved;
+};
+
+/* single-producer single-consumer ring drained by a writer thread into
+   the binary log, the columnar results file or both; the indices live on
+   their own cache lines */
+struct log_ring {
+    struct log_record *   records;
+    int                   fd;      // -1: no binary log
+    struct results_file * results; // NULL: no results file
+    pthread_t           writer;
+    volatile int        stop;
+    u_ll                dropped;
+
+    u_ll head __attribute__((aligned(64))); // written by the packet loop
+    u_ll tail __attribute__((aligned(64))); // written by the writer thread
+};
+
+/* transpose records into the columns of the results file */
+static void log_ring_store_results(struct log_ring *         ring,
+                                   const struct log_record * records,
+                                   const u_ll                count,
+                                   const u_ll                first_row) {
+    u_ll i;
+    for (i = 0; i < count; ++i) {
+        const struct log_record * r = & records[i];
+        const u_ll values[RESULTS_COLUMNS] = {
+            r -> seq_num, r -> sent_ns, r -> recv_ns,
+            r -> rtt_ns,  r -> kern_ns, r -> hw_ns
+        };
+        results_append(ring -> results, first_row + i, values, r -> flags);
+    }
+    results_commit(ring -> results, first_row + count);
+}
+
+/* write out everything between tail and head; returns records written */
+u_ll log_ring_drain(struct log_ring * ring,
+                    const u_ll        max_records) {
+    const u_ll head = __atomic_load_n(& ring -> head, __ATOMIC_ACQUIRE);
+    u_ll       tail = ring -> tail;
+    u_ll       written = 0;
+    while (tail != head && written < max_records) {
+        /* contiguous run up to the end of the ring */
+        const u_ll start = tail & (LOG_RING_SIZE - 1);
+        u_ll count = head - tail;
+        if (count > LOG_RING_SIZE - start)
+            count = LOG_RING_SIZE - start;
+        if (count > max_records - written)
+            count = max_records - written;
+        const char * data  = (const char *) & ring -> records[start];
+        size_t       bytes = ring -> fd == -1 ? 0 : count * sizeof(struct log_record);
+        while (bytes > 0) {
+            const ssize_t rc = write(ring -> fd, data, bytes);
+            if (rc <= 0) {
+                fprintf(stderr, "Error writing binary log.\n");
+                break;
+            }
+            data  += rc;
+            bytes -= rc;
+        }
+        if (ring -> results)
+            log_ring_store_results(ring, & ring -> records[start], count, tail);
+        tail    += count;
+        written += count;
+        __atomic_store_n(& ring -> tail, tail, __ATOMIC_RELEASE);
+    }
+    return written;
+}
+
+void * log_ring_writer(void * arg) {
+    struct log_ring * ring = (struct log_ring *) arg;
+    const struct timespec nap = { 0, LOG_FLUSH_NS };
+    while (! ring -> stop) {
+        /* keep writing big blocks while busy, otherwise doze off */
+        if (log_ring_drain(ring, LOG_WRITE_BLOCK) < LOG_WRITE_BLOCK)
+            nanosleep(& nap, NULL);
+    }
+    return NULL;
+}
+
+/* attach a binary log ring to an already opened (empty) log file and/or
+   an opened results file */
+void log_ring_open(struct log_ring *     ring,
+                   FILE *                log_file,
+                   struct results_file * results) {
+    memset(ring, 0, sizeof(struct log_ring));
+    ring -> fd      = log_file ? fileno(log_file) : -1;
+    ring -> results = results;
+    ring -> records = aligned_alloc(64, LOG_RING_SIZE * sizeof(struct log_record));
+    if (! ring -> records) {
+        fprintf(stderr, "Error allocating binary log ring.\n");
+        exit(EXIT_FAILURE);
+    }
+    /* pre-fault the ring so that the packet loop never does */
+    memset(ring -> records, 0, LOG_RING_SIZE * sizeof(struct log_record));
+
+    const struct log_header header = {
+        LOG_MAGIC, LOG_VERSION, sizeof(struct log_record), 0
+    };
+    if (ring -> fd != -1 &&
+        write(ring -> fd, & header, sizeof(header)) != sizeof(header)) {
+        fprintf(stderr, "Error writing binary log header.\n");
+        exit(EXIT_FAILURE);
+    }
+    start_thread(& ring -> writer, log_ring_writer, ring);
+}
+
+/* called from the packet loop; never blocks, drops when the ring is full */
+static inline void log_ring_push(struct log_ring * ring,
+                                 const u_ll        seq_num,
+                                 const u_ll        sent_ns,
+                                 const u_ll        recv_ns,
+                                 const u_ll        rtt_ns,
+                                 const u_ll        kern_ns,
+                                 const u_ll        hw_ns,
+                                 const u_int       flags) {
+    const u_ll head = ring -> head;
+    if (head - __atomic_load_n(& ring -> tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE) {
+        ++ring -> dropped;
+        return;
+    }
+    struct log_record * record = & ring -> records[head & (LOG_RING_SIZE - 1)];
+    record -> seq_num = seq_num;
+    record -> sent_ns = sent_ns;
+    record -> recv_ns = recv_ns;
+    record -> rtt_ns  = rtt_ns;
+    record -> kern_ns = kern_ns;
+    record -> hw_ns   = hw_ns;
+    record -> flags   = flags;
+    __atomic_store_n(& ring -> head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* stop the writer, flush the rest and mark the start of the text trailer;
+   the caller may keep fprintf()-ing the summary into the same FILE */
+void log_ring_close(struct log_ring * ring) {
+    if (! ring -> records)
+        return;
+    ring -> stop = 1;
+    pthread_join(ring -> writer, NULL);
+    while (log_ring_drain(ring, LOG_RING_SIZE) > 0)
+        ;
+
+    struct log_record trailer;
+    memset(& trailer, 0, sizeof(trailer));
+    trailer.seq_num = ring -> dropped;
+    trailer.flags   = LOG_FLAG_TRAILER;
+    if (ring -> fd != -1 &&
+        write(ring -> fd, & trailer, sizeof(trailer)) != sizeof(trailer))
+        fprintf(stderr, "Error writing binary log trailer.\n");
+    if (ring -> dropped)
+        fprintf(stderr, "Binary log dropped %llu records.\n", ring -> dropped);
+
+    free(ring -> records);
+    ring -> records = NULL;
+}
+
+#endif
@@ -0,0 +1,171 @@
+#ifndef __udp_lowlat__
+#define __udp_lowlat__
+
+#include <stdlib.h>  // strtoul()
+#include <stdio.h>   // fprintf(), snprintf(), stderr
+#include <string.h>  // strtok_r(), strchr(), strcmp()
+#include <errno.h>   // errno, EAGAIN, EWOULDBLOCK
+#include <fcntl.h>   // fcntl(), O_NONBLOCK
+#include <unistd.h>  // sysconf()
+#include <sched.h>   // cpu_set_t, CPU_ZERO(), CPU_SET(), sched_getcpu(), SCHED_FIFO
+#include <pthread.h> // pthread_setaffinity_np(), pthread_setschedparam()
+#include <sys/mman.h>   // mlockall(), MCL_CURRENT, MCL_FUTURE
+#include <sys/socket.h> // setsockopt(), SO_BUSY_POLL
+
+#include "udp_common.h" // u_int, u_ll
+#include "udp_tstamp.h" // pkt_tstamp, tstamp_recvfrom()
+
+/* low-latency profile: receive threads spin on a non-blocking socket
+   (with the kernel busy polling the device queue underneath) instead of
+   sleeping in recvfrom(), on a CPU of their own, optionally SCHED_FIFO,
+   with all memory locked and faulted in up front; the price is a core
+   per receive thread */
+#ifndef SO_PREFER_BUSY_POLL
+    #define SO_PREFER_BUSY_POLL   (69) // Linux 5.11
+#endif
+#define LOWLAT_BUSY_POLL_US       (50)
+#define LOWLAT_STACK_PREFAULT     (256 * 1024)
+#define LOWLAT_CLOCK_SPINS        (64) // receive attempts per clock read
+
+struct lowlat {
+    bool  enabled;
+    int   cpu;          // first CPU, -1: the one the process starts on
+    int   rt_priority;  // SCHED_FIFO priority, 0: keep SCHED_OTHER
+    u_int busy_poll_us; // SO_BUSY_POLL, 0: spin in user space only
+};
+
+/* "on" or comma separated cpu=<n>,fifo=<priority>,poll=<us> */
+bool lowlat_parse(struct lowlat * lowlat,
+                  const char *    text) {
+    lowlat -> enabled      = TRUE;
+    lowlat -> cpu          = -1;
+    lowlat -> rt_priority  = 0;
+    lowlat -> busy_poll_us = LOWLAT_BUSY_POLL_US;
+    if (strcmp(text, "on") == 0)
+        return TRUE;
+
+    char list[128];
+    snprintf(list, sizeof(list), "%s", text);
+    char * save = NULL;
+    char * item;
+    for (item = strtok_r(list, ",", & save); item;
+         item = strtok_r(NULL, ",", & save)) {
+        char * value = strchr(item, '=');
+        if (! value) {
+            fprintf(stderr, "Low-latency parameter %s has no value.\n", item);
+            return FALSE;
+        }
+        * value++ = '\0';
+        if (strcmp(item, "cpu") == 0)
+            lowlat -> cpu = strtoul(value, NULL, 10);
+        else if (strcmp(item, "fifo") == 0)
+            lowlat -> rt_priority = strtoul(value, NULL, 10);
+        else if (strcmp(item, "poll") == 0)
+            lowlat -> busy_poll_us = strtoul(value, NULL, 10);
+        else {
+            fprintf(stderr, "Unknown low-latency parameter: %s\n", item);
+            return FALSE;
+        }
+    }
+    if (lowlat -> rt_priority < 0 || lowlat -> rt_priority > 99) {
+        fprintf(stderr, "SCHED_FIFO priority must be between 1 and 99.\n");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* lock everything which is and will be mapped, so that neither the
+   packet buffers nor the stacks take a page fault on the hot path */
+void lowlat_lock_memory(void) {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+        fprintf(stderr, "Failed to lock memory (raise ulimit -l?).\n");
+}
+
+/* touch the stack the thread will run on */
+void lowlat_prefault_stack(void) {
+    volatile char stack[LOWLAT_STACK_PREFAULT];
+    u_int i;
+    for (i = 0; i < sizeof(stack); i += 4096)
+        stack[i] = 0;
+}
+
+/* non-blocking socket with busy polling; busy polling beyond the
+   net.core.busy_read default needs CAP_NET_ADMIN, failing only warns */
+void lowlat_setup_socket(const int             socket,
+                         const struct lowlat * lowlat) {
+    fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK);
+    if (! lowlat -> busy_poll_us)
+        return;
+    const int busy_poll = lowlat -> busy_poll_us;
+    const int prefer    = 1;
+    if (setsockopt(socket, SOL_SOCKET, SO_BUSY_POLL,
+                   & busy_poll, sizeof(busy_poll)) < 0)
+        fprintf(stderr, "Failed to set SO_BUSY_POLL to %i us.\n", busy_poll);
+    if (setsockopt(socket, SOL_SOCKET, SO_PREFER_BUSY_POLL,
+                   & prefer, sizeof(prefer)) < 0)
+        fprintf(stderr, "Failed to set SO_PREFER_BUSY_POLL.\n");
+}
+
+/* settle on the first CPU before any thread is pinned, so that the
+   threads only ever read it */
+void lowlat_resolve_cpu(struct lowlat * lowlat) {
+    if (lowlat -> cpu < 0)
+        lowlat -> cpu = sched_getcpu() < 0 ? 0 : sched_getcpu();
+}
+
+/* pin the calling thread to the offset-th CPU of the profile and raise
+   it to SCHED_FIFO if asked */
+void lowlat_setup_thread(const struct lowlat * lowlat,
+                         const u_int           offset) {
+    const long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpu_count > 0) {
+        const long cpu = (lowlat -> cpu + offset) % cpu_count;
+        cpu_set_t cpu_set;
+        CPU_ZERO(& cpu_set);
+        CPU_SET(cpu, & cpu_set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), & cpu_set))
+            fprintf(stderr, "Failed to pin thread to CPU %li.\n", cpu);
+    }
+    if (lowlat -> rt_priority) {
+        const struct sched_param param = { lowlat -> rt_priority };
+        if (pthread_setschedparam(pthread_self(), SCHED_FIFO, & param))
+            fprintf(stderr, "Failed to set SCHED_FIFO (needs CAP_SYS_NICE).\n");
+    }
+    lowlat_prefault_stack();
+}
+
+/* nothing queued on a non-blocking socket; a blocking socket without a
+   timeout never says so */
+static inline bool lowlat_again(const int rc) {
+    return rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* spin until a datagram arrives or timeout_ns (0: no limit) has passed;
+   the kernel RX stamp comes along for the wakeup latency */
+int lowlat_recvfrom(const int            socket,
+                    void *               buffer,
+                    const size_t         length,
+                    struct sockaddr_in * addr,
+                    socklen_t *          addr_size,
+                    struct pkt_tstamp *  tstamp,
+                    const u_ll           timeout_ns) {
+    u_ll  deadline = 0;
+    u_int spins    = 0;
+    while (TRUE) {
+        const int read_size = tstamp_recvfrom(socket, buffer, length,
+                                              addr, addr_size, tstamp);
+        if (! lowlat_again(read_size))
+            return read_size;
+        if (timeout_ns && ++spins % LOWLAT_CLOCK_SPINS == 0) {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, & ts);
+            const u_ll now = (u_ll) ts.tv_sec * (u_ll) 1E9 + ts.tv_nsec;
+            if (! deadline)
+                deadline = now + timeout_ns;
+            else if (now >= deadline)
+                return -1;
+        }
+    }
+}
+
+#endif
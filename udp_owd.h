@@ -0,0 +1,103 @@
+#ifndef __udp_owd__
+#define __udp_owd__
+
+#include <stdio.h>  // FILE, fprintf()
+#include <string.h> // memset()
+
+#include "udp_common.h" // u_int, u_ll
+#include "udp_hist.h"   // latency_hist, hist_record(), hist_print_summary()
+
+/* NTP-style analysis of the four timestamps of a reply:
+     T1 client send, T2 server receive, T3 server send, T4 client receive
+   offset = ((T2 - T1) + (T3 - T4)) / 2, delay = (T4 - T1) - (T3 - T2);
+   like the NTP clock filter, the offset of the sample with the smallest
+   delay out of the last OWD_FILTER_SIZE wins, since queueing delay on
+   either path skews the offset of a sample but not the minimum; a filter
+   belongs to the clock of one server, the delays of several servers can
+   share the histograms as long as each is corrected with its own */
+#define OWD_FILTER_SIZE    (8)
+
+struct owd_sample {
+    long long offset_ns;
+    long long delay_ns;
+};
+
+struct owd_filter {
+    struct owd_sample   filter[OWD_FILTER_SIZE];
+    u_int               filter_count;
+    u_int               filter_next;
+    long long           offset_ns;     // current filtered estimate
+    long long           offset_min_ns;
+    long long           offset_max_ns;
+    u_ll                samples;
+};
+
+struct owd_stats {
+    struct owd_filter   clock;         // the one server of -s
+
+    struct latency_hist forward;       // T2 - T1 - offset
+    struct latency_hist reverse;       // T4 - T3 + offset
+    struct latency_hist residence;     // T3 - T2
+};
+
+void owd_init(struct owd_stats * owd) {
+    memset(owd, 0, sizeof(struct owd_stats));
+    hist_init(& owd -> forward);
+    hist_init(& owd -> reverse);
+    hist_init(& owd -> residence);
+}
+
+/* a one-way delay below zero is noise around a wrong offset */
+static inline u_ll owd_clamp(const long long value) {
+    return value > 0 ? (u_ll) value : 0;
+}
+
+/* T1 to T4 of a reply stamped by the server clock behind the filter */
+void owd_record(struct owd_stats *  owd,
+                struct owd_filter * clock,
+                const u_ll          t1,
+                const u_ll          t2,
+                const u_ll          t3,
+                const u_ll          t4) {
+    const long long forward = (long long) (t2 - t1);
+    const long long reverse = (long long) (t4 - t3);
+
+    /* clock filter */
+    struct owd_sample * sample = & clock -> filter[clock -> filter_next];
+    sample -> offset_ns = (forward - reverse) / 2;
+    sample -> delay_ns  = forward + reverse;
+    clock -> filter_next = (clock -> filter_next + 1) % OWD_FILTER_SIZE;
+    if (clock -> filter_count < OWD_FILTER_SIZE)
+        ++clock -> filter_count;
+    const struct owd_sample * best = & clock -> filter[0];
+    u_int i;
+    for (i = 1; i < clock -> filter_count; ++i)
+        if (clock -> filter[i].delay_ns < best -> delay_ns)
+            best = & clock -> filter[i];
+    clock -> offset_ns = best -> offset_ns;
+    if (clock -> samples == 0 || clock -> offset_ns < clock -> offset_min_ns)
+        clock -> offset_min_ns = clock -> offset_ns;
+    if (clock -> samples == 0 || clock -> offset_ns > clock -> offset_max_ns)
+        clock -> offset_max_ns = clock -> offset_ns;
+    ++clock -> samples;
+
+    hist_record(& owd -> forward,   owd_clamp(forward - clock -> offset_ns));
+    hist_record(& owd -> reverse,   owd_clamp(reverse + clock -> offset_ns));
+    hist_record(& owd -> residence, owd_clamp((long long) (t3 - t2)));
+}
+
+void owd_print_summary(const struct owd_stats * owd,
+                       FILE *                   out) {
+    if (owd -> forward.total == 0)
+        return;
+    hist_print_summary(& owd -> forward,   "Forward delay", out);
+    hist_print_summary(& owd -> reverse,   "Reverse delay", out);
+    hist_print_summary(& owd -> residence, "Server residence", out);
+    const struct owd_filter * clock = & owd -> clock;
+    if (clock -> samples)
+        fprintf(out, "Clock offset (us): estimate %.3f min %.3f max %.3f\n",
+                clock -> offset_ns / 1E3, clock -> offset_min_ns / 1E3,
+                clock -> offset_max_ns / 1E3);
+}
+
+#endif
@@ -0,0 +1,207 @@
+#ifndef __udp_pacing__
+#define __udp_pacing__
+
+#include <stdio.h>  // FILE, fprintf()
+#include <string.h> // memset(), strcmp()
+#include <math.h>   // sqrt()
+#include <time.h>   // timespec, clock_gettime(), clock_nanosleep(), TIMER_ABSTIME
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h> // __rdtsc()
+    #define PACE_HAVE_TSC 1
+#else
+    #define PACE_HAVE_TSC 0
+#endif
+
+#include "udp_common.h" // u_int, u_ll
+
+/* clock_nanosleep() cannot sleep on CLOCK_MONOTONIC_RAW,
+   so the deadlines live on CLOCK_MONOTONIC */
+#define PACE_CLOCK              CLOCK_MONOTONIC
+#define PACE_SPIN_THRESHOLD_NS  ((u_ll) 5E4)  // hybrid: spin the last 50 us
+#define PACE_CALIBRATION_NS     ((u_ll) 2E7)  // TSC calibration period
+
+enum pacing_mode {
+    PACE_SLEEP,  // clock_nanosleep(TIMER_ABSTIME) only, lowest CPU
+    PACE_HYBRID, // sleep until shortly before the deadline, then spin
+    PACE_SPIN    // spin on the TSC, most accurate, burns a core
+};
+
+/* sends are scheduled on absolute deadlines start + n * interval, so a late
+   departure never shifts the ones after it */
+struct pacer {
+    enum pacing_mode mode;
+    u_ll             interval_ns;
+    u_ll             deadline;
+
+    /* TSC to PACE_CLOCK conversion */
+    u_ll             tsc_base;
+    u_ll             ns_base;
+    double           ns_per_tick;
+
+    /* departure statistics */
+    u_ll             departures;
+    u_ll             first_deadline;
+    u_ll             last_deadline;
+    u_ll             first_ns;
+    u_ll             last_ns;
+    double           ipd_mean;  // inter-departure time, Welford
+    double           ipd_m2;
+    u_ll             late_sum;
+    u_ll             late_max;
+};
+
+static inline u_ll pacer_clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(PACE_CLOCK, & ts);
+    return (u_ll) ts.tv_sec * (u_ll) 1E9 + ts.tv_nsec;
+}
+
+static inline u_ll pacer_now(const struct pacer * p) {
+#if PACE_HAVE_TSC
+    if (p -> mode == PACE_SPIN)
+        return p -> ns_base +
+               (u_ll) ((double) (__rdtsc() - p -> tsc_base) * p -> ns_per_tick);
+#endif
+    (void) p;
+    return pacer_clock_ns();
+}
+
+/* measure the TSC frequency against PACE_CLOCK; assumes an invariant TSC */
+void pacer_calibrate_tsc(struct pacer * p) {
+#if PACE_HAVE_TSC
+    const u_ll ns_start  = pacer_clock_ns();
+    const u_ll tsc_start = __rdtsc();
+    u_ll ns_end;
+    do {
+        ns_end = pacer_clock_ns();
+    } while (ns_end - ns_start < PACE_CALIBRATION_NS);
+    const u_ll tsc_end = __rdtsc();
+    p -> ns_per_tick = (double) (ns_end - ns_start) / (tsc_end - tsc_start);
+    p -> tsc_base    = tsc_end;
+    p -> ns_base     = ns_end;
+#else
+    fprintf(stderr, "No TSC on this platform, spinning on clock_gettime().\n");
+#endif
+}
+
+bool pacer_parse_mode(const char *       name,
+                      enum pacing_mode * mode) {
+    if (strcmp(name, "sleep") == 0)
+        * mode = PACE_SLEEP;
+    else if (strcmp(name, "hybrid") == 0)
+        * mode = PACE_HYBRID;
+    else if (strcmp(name, "spin") == 0)
+        * mode = PACE_SPIN;
+    else
+        return FALSE;
+    return TRUE;
+}
+
+const char * pacer_mode_name(const enum pacing_mode mode) {
+    switch (mode) {
+        case PACE_SLEEP:  return "sleep";
+        case PACE_HYBRID: return "hybrid";
+        case PACE_SPIN:   return "spin";
+    }
+    return "?";
+}
+
+/* the first departure is due right away */
+void pacer_init(struct pacer *         p,
+                const enum pacing_mode mode,
+                const u_ll             interval_ns) {
+    memset(p, 0, sizeof(struct pacer));
+    p -> mode        = mode;
+    p -> interval_ns = interval_ns;
+    if (mode == PACE_SPIN)
+        pacer_calibrate_tsc(p);
+    p -> deadline    = pacer_now(p);
+}
+
+/* change the rate from the next departure on */
+static inline void pacer_set_interval(struct pacer * p,
+                                      const u_ll     interval_ns) {
+    p -> deadline   += interval_ns;
+    p -> deadline   -= p -> interval_ns;
+    p -> interval_ns = interval_ns;
+}
+
+static inline void pacer_sleep_until(const u_ll deadline) {
+    struct timespec ts;
+    ts.tv_sec  = deadline / (u_ll) 1E9;
+    ts.tv_nsec = deadline % (u_ll) 1E9;
+    while (clock_nanosleep(PACE_CLOCK, TIMER_ABSTIME, & ts, NULL))
+        ; // interrupted, go back to sleep
+}
+
+/* block until the next deadline; returns the departure time */
+static inline u_ll pacer_wait(struct pacer * p) {
+    u_ll now = pacer_now(p);
+    if (now < p -> deadline) {
+        switch (p -> mode) {
+            case PACE_SLEEP:
+                pacer_sleep_until(p -> deadline);
+                now = pacer_now(p);
+                break;
+            case PACE_HYBRID:
+                if (p -> deadline - now > PACE_SPIN_THRESHOLD_NS)
+                    pacer_sleep_until(p -> deadline - PACE_SPIN_THRESHOLD_NS);
+                /* fall through */
+            case PACE_SPIN:
+                do {
+                    now = pacer_now(p);
+                } while (now < p -> deadline);
+                break;
+        }
+    }
+
+    /* bookkeeping */
+    const u_ll late = now > p -> deadline ? now - p -> deadline : 0;
+    p -> late_sum += late;
+    if (late > p -> late_max)
+        p -> late_max = late;
+    if (p -> departures == 0) {
+        p -> first_ns       = now;
+        p -> first_deadline = p -> deadline;
+    }
+    else {
+        const double ipd   = (double) (now - p -> last_ns);
+        const double delta = ipd - p -> ipd_mean;
+        p -> ipd_mean += delta / p -> departures;
+        p -> ipd_m2   += delta * (ipd - p -> ipd_mean);
+    }
+    ++p -> departures;
+    p -> last_ns       = now;
+    p -> last_deadline = p -> deadline;
+    p -> deadline += p -> interval_ns;
+    return now;
+}
+
+/* achieved against requested rate and inter-departure jitter */
+void pacer_print_summary(const struct pacer * p,
+                         FILE *               out) {
+    if (p -> departures < 2) {
+        fprintf(out, "Pacing (%s): not enough departures\n",
+                pacer_mode_name(p -> mode));
+        return;
+    }
+    /* requested rate from the schedule, which may vary over the run */
+    const double scheduled = (double) (p -> last_deadline - p -> first_deadline);
+    const double elapsed   = (double) (p -> last_ns - p -> first_ns);
+    const double achieved  = (p -> departures - 1) * 1E9 / elapsed;
+    const double jitter    = sqrt(p -> ipd_m2 / (p -> departures - 1));
+    if (scheduled > 0)
+        fprintf(out, "Pacing (%s): requested %.1f pps achieved %.1f pps\t",
+                pacer_mode_name(p -> mode),
+                (p -> departures - 1) * 1E9 / scheduled, achieved);
+    else
+        fprintf(out, "Pacing (%s): requested unlimited achieved %.1f pps\t",
+                pacer_mode_name(p -> mode), achieved);
+    fprintf(out, "Inter-departure (us): mean %.3f jitter %.3f\t",
+            p -> ipd_mean / 1E3, jitter / 1E3);
+    fprintf(out, "Lateness (us): mean %.3f max %.3f\n",
+            (double) p -> late_sum / p -> departures / 1E3, p -> late_max / 1E3);
+}
+
+#endif
@@ -0,0 +1,306 @@
+#ifndef __udp_packet__
+#define __udp_packet__
+
+#include <stddef.h> // offsetof()
+#include <stdlib.h> // EXIT_FAILURE, exit()
+#include <stdio.h>  // FILE, fprintf(), stderr
+#include <string.h> // memset()
+#include <unistd.h> // close(), getpid()
+#include <poll.h>   // poll(), POLLIN, POLLERR
+
+#include <arpa/inet.h>          // htons(), ntohs()
+#include <net/if.h>             // if_nametoindex()
+#include <netinet/in.h>         // sockaddr_in, IPPROTO_UDP
+#include <netinet/ip.h>         // iphdr, IP_MF, IP_OFFMASK
+#include <netinet/udp.h>        // udphdr
+#include <linux/filter.h>       // sock_filter, sock_fprog, BPF_STMT(), BPF_JUMP()
+#include <linux/if_ether.h>     // ETH_P_IP
+#include <linux/if_packet.h>    // sockaddr_ll, tpacket_req3, tpacket3_hdr
+#include <sys/mman.h>           // mmap(), munmap(), MAP_LOCKED
+#include <sys/socket.h>         // socket(), setsockopt(), bind(), SO_ATTACH_FILTER
+
+#include "udp_common.h" // u_int, u_ll, MSG_HEADER
+
+/* PACKET_MMAP receive: an AF_PACKET socket shares a TPACKET_V3 ring of
+   blocks with the kernel, which packs the frames of many datagrams into
+   a block and hands the whole block over at once, full or after
+   PACKET_BLOCK_TIMEOUT ms. A classic BPF program keeps everything but
+   our datagrams out of the ring. The socket is a SOCK_DGRAM one, so the
+   frames start at the IP header on any link type (lo, veth, ethernet).
+   Datagrams are seen before the UDP socket layer and fragments are never
+   reassembled, so they have to fit the MTU of the interface. */
+#define PACKET_BLOCK_SIZE    (1 << 20)
+#define PACKET_BLOCK_COUNT   (16)
+#define PACKET_FRAME_SIZE    (2048)   // nominal only, V3 frames are packed
+#define PACKET_BLOCK_TIMEOUT (1)      // ms
+
+#ifndef PACKET_IGNORE_OUTGOING
+#define PACKET_IGNORE_OUTGOING 23     // Linux 4.20
+#endif
+
+struct packet_ring {
+    int    fd;
+    char * map;
+    size_t map_size;
+    u_int  block_index;
+
+    /* accounting */
+    u_ll   blocks;                    // handed over by the kernel
+    u_ll   frames;
+    u_ll   dropped;                   // kernel: no free block (PACKET_STATISTICS)
+    u_ll   freezes;                   // kernel: times the ring was full
+    u_ll   outgoing;                  // copies of our own sends
+    u_ll   malformed;
+};
+
+/* one datagram of a block, pointing into the ring */
+struct packet_frame {
+    char *             data;
+    u_int              length;
+    struct sockaddr_in addr;
+    u_ll               tstamp_ns;     // CLOCK_REALTIME, when the frame was taken
+};
+
+/* accept IPv4 UDP to port whose payload starts with MSG_HEADER, unless
+   it is a fragment; X holds the IP header length */
+static void packet_attach_filter(const int socket,
+                                 const int port) {
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD  | BPF_B   | BPF_ABS, offsetof(struct iphdr, protocol)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   IPPROTO_UDP, 0, 8),
+        BPF_STMT(BPF_LD  | BPF_H   | BPF_ABS, offsetof(struct iphdr, frag_off)),
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K,  IP_MF | IP_OFFMASK, 6, 0),
+        BPF_STMT(BPF_LDX | BPF_B   | BPF_MSH, 0),
+        BPF_STMT(BPF_LD  | BPF_H   | BPF_IND, offsetof(struct udphdr, dest)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   (u_int) port, 0, 3),
+        BPF_STMT(BPF_LD  | BPF_W   | BPF_IND, sizeof(struct udphdr)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   MSG_HEADER, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K,             0xFFFFFFFF),
+        BPF_STMT(BPF_RET | BPF_K,             0),
+    };
+    struct sock_fprog program = {
+        .len    = sizeof(code) / sizeof(code[0]),
+        .filter = code,
+    };
+    if (setsockopt(socket, SOL_SOCKET, SO_ATTACH_FILTER,
+                   & program, sizeof(program)) < 0) {
+        fprintf(stderr, "Error attaching the packet filter.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* the UDP socket of a ring only sends the echoes and keeps the port
+   bound, so that the kernel does not answer with port unreachable;
+   its copies are dropped by the filter (and counted as UDP InErrors) */
+void packet_mute_socket(const int socket) {
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog program = {
+        .len    = 1,
+        .filter = code,
+    };
+    if (setsockopt(socket, SOL_SOCKET, SO_ATTACH_FILTER,
+                   & program, sizeof(program)) < 0) {
+        fprintf(stderr, "Error attaching the drop filter.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* open the ring on interface, for datagrams to port; the rings of a
+   fanout group (fanout > 0) share the flows like SO_REUSEPORT does */
+void packet_ring_open(struct packet_ring * ring,
+                      const char *         interface,
+                      const int            port,
+                      const u_int          fanout) {
+    memset(ring, 0, sizeof(struct packet_ring));
+    const u_int ifindex = if_nametoindex(interface);
+    if (ifindex == 0) {
+        fprintf(stderr, "Unknown interface %s.\n", interface);
+        exit(EXIT_FAILURE);
+    }
+
+    /* no protocol until bound, so nothing gets in before the filter */
+    if ((ring -> fd = socket(AF_PACKET, SOCK_DGRAM, 0)) == -1) {
+        fprintf(stderr, "Error creating packet socket (needs CAP_NET_RAW).\n");
+        exit(EXIT_FAILURE);
+    }
+    const int version = TPACKET_V3;
+    if (setsockopt(ring -> fd, SOL_PACKET, PACKET_VERSION,
+                   & version, sizeof(version)) < 0) {
+        fprintf(stderr, "Error setting TPACKET_V3 on packet socket.\n");
+        exit(EXIT_FAILURE);
+    }
+    /* on lo every request would show up twice, also as it is sent;
+       older kernels are left to the check in packet_ring_next() */
+    const int ignore_outgoing = 1;
+    setsockopt(ring -> fd, SOL_PACKET, PACKET_IGNORE_OUTGOING,
+               & ignore_outgoing, sizeof(ignore_outgoing));
+    packet_attach_filter(ring -> fd, port);
+
+    struct tpacket_req3 request = {
+        .tp_block_size       = PACKET_BLOCK_SIZE,
+        .tp_block_nr         = PACKET_BLOCK_COUNT,
+        .tp_frame_size       = PACKET_FRAME_SIZE,
+        .tp_frame_nr         = PACKET_BLOCK_SIZE / PACKET_FRAME_SIZE *
+                               PACKET_BLOCK_COUNT,
+        .tp_retire_blk_tov   = PACKET_BLOCK_TIMEOUT,
+        .tp_sizeof_priv      = 0,
+        .tp_feature_req_word = 0,
+    };
+    if (setsockopt(ring -> fd, SOL_PACKET, PACKET_RX_RING,
+                   & request, sizeof(request)) < 0) {
+        fprintf(stderr, "Error setting up the packet ring.\n");
+        exit(EXIT_FAILURE);
+    }
+    ring -> map_size = (size_t) PACKET_BLOCK_SIZE * PACKET_BLOCK_COUNT;
+    ring -> map = mmap(NULL, ring -> map_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_LOCKED | MAP_POPULATE, ring -> fd, 0);
+    if (ring -> map == MAP_FAILED)
+        ring -> map = mmap(NULL, ring -> map_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, ring -> fd, 0);
+    if (ring -> map == MAP_FAILED) {
+        fprintf(stderr, "Error mapping the packet ring.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct sockaddr_ll link_addr;
+    memset(& link_addr, 0, sizeof(link_addr));
+    link_addr.sll_family   = AF_PACKET;
+    link_addr.sll_protocol = htons(ETH_P_IP);
+    link_addr.sll_ifindex  = ifindex;
+    if (bind(ring -> fd, (struct sockaddr *) & link_addr, sizeof(link_addr)) == -1) {
+        fprintf(stderr, "Error binding packet socket to %s.\n", interface);
+        exit(EXIT_FAILURE);
+    }
+
+    if (fanout) {
+        const int fanout_arg = (getpid() & 0xFFFF) | (PACKET_FANOUT_HASH << 16);
+        if (setsockopt(ring -> fd, SOL_PACKET, PACKET_FANOUT,
+                       & fanout_arg, sizeof(fanout_arg)) < 0) {
+            fprintf(stderr, "Error joining the packet fanout group.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/* wait for the next block; returns NULL on timeout or error */
+struct tpacket_block_desc * packet_ring_wait(struct packet_ring * ring,
+                                             const int            timeout_ms) {
+    struct tpacket_block_desc * block = (struct tpacket_block_desc *)
+        (ring -> map + (size_t) ring -> block_index * PACKET_BLOCK_SIZE);
+    while (! (__atomic_load_n(& block -> hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+              TP_STATUS_USER)) {
+        struct pollfd pfd = { .fd = ring -> fd, .events = POLLIN | POLLERR,
+                              .revents = 0 };
+        if (poll(& pfd, 1, timeout_ms) <= 0 || pfd.revents & POLLERR)
+            return NULL;
+    }
+    ++ring -> blocks;
+    return block;
+}
+
+/* walk the frames of a block: frame is the previous one (NULL for the
+   first) and returns FALSE after the last; non-IPv4/UDP frames are skipped */
+bool packet_ring_next(struct packet_ring *        ring,
+                      struct tpacket_block_desc * block,
+                      struct tpacket3_hdr **      frame,
+                      u_int *                     index,
+                      struct packet_frame *       packet) {
+    while (* index < block -> hdr.bh1.num_pkts) {
+        * frame = * frame ?
+            (struct tpacket3_hdr *) ((char *) * frame + (* frame) -> tp_next_offset) :
+            (struct tpacket3_hdr *) ((char *) block +
+                                     block -> hdr.bh1.offset_to_first_pkt);
+        ++* index;
+        ++ring -> frames;
+
+        const struct sockaddr_ll * link_addr = (const struct sockaddr_ll *)
+            ((char *) * frame + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+        if (link_addr -> sll_pkttype == PACKET_OUTGOING) {
+            ++ring -> outgoing;
+            continue;
+        }
+
+        /* the filter let only unfragmented UDP in, check the lengths */
+        char * data = (char *) * frame + (* frame) -> tp_net;
+        const u_int captured = (* frame) -> tp_snaplen;
+        const struct iphdr * ip = (const struct iphdr *) data;
+        const u_int ip_length = ip -> ihl * 4;
+        if (captured < sizeof(struct iphdr) ||
+            captured < ip_length + sizeof(struct udphdr)) {
+            ++ring -> malformed;
+            continue;
+        }
+        const struct udphdr * udp = (const struct udphdr *) (data + ip_length);
+        u_int length = ntohs(udp -> len);
+        if (length < sizeof(struct udphdr) || ip_length + length > captured) {
+            ++ring -> malformed;
+            continue;
+        }
+
+        packet -> data   = data + ip_length + sizeof(struct udphdr);
+        packet -> length = length - sizeof(struct udphdr);
+        memset(& packet -> addr, 0, sizeof(packet -> addr));
+        packet -> addr.sin_family      = AF_INET;
+        packet -> addr.sin_addr.s_addr = ip -> saddr;
+        packet -> addr.sin_port        = udp -> source;
+        packet -> tstamp_ns = (u_ll) (* frame) -> tp_sec * (u_ll) 1E9 +
+                              (* frame) -> tp_nsec;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/* give the block back to the kernel and move on to the next one */
+static inline void packet_ring_release(struct packet_ring *        ring,
+                                       struct tpacket_block_desc * block) {
+    __atomic_store_n(& block -> hdr.bh1.block_status, TP_STATUS_KERNEL,
+                     __ATOMIC_RELEASE);
+    ring -> block_index = (ring -> block_index + 1) % PACKET_BLOCK_COUNT;
+}
+
+/* collect the kernel counters, which reset on every read */
+void packet_ring_update_stats(struct packet_ring * ring) {
+    struct tpacket_stats_v3 stats;
+    socklen_t stats_size = sizeof(stats);
+    if (getsockopt(ring -> fd, SOL_PACKET, PACKET_STATISTICS,
+                   & stats, & stats_size) == 0) {
+        ring -> dropped += stats.tp_drops;
+        ring -> freezes += stats.tp_freeze_q_cnt;
+    }
+}
+
+void packet_ring_close(struct packet_ring * ring) {
+    if (! ring -> map)
+        return;
+    packet_ring_update_stats(ring);
+    munmap(ring -> map, ring -> map_size);
+    close(ring -> fd);
+    ring -> map = NULL;
+}
+
+void packet_ring_merge(struct packet_ring *       into,
+                       const struct packet_ring * ring) {
+    into -> blocks    += ring -> blocks;
+    into -> frames    += ring -> frames;
+    into -> dropped   += ring -> dropped;
+    into -> freezes   += ring -> freezes;
+    into -> outgoing  += ring -> outgoing;
+    into -> malformed += ring -> malformed;
+}
+
+void packet_ring_print_summary(const struct packet_ring * ring,
+                               FILE *                     out) {
+    fprintf(out, "Packet ring: %llu blocks %llu frames (%.1f per block) "
+                 "%llu dropped %llu ring full",
+            ring -> blocks, ring -> frames,
+            ring -> blocks ? (double) ring -> frames / ring -> blocks : 0.0,
+            ring -> dropped, ring -> freezes);
+    if (ring -> outgoing || ring -> malformed)
+        fprintf(out, " %llu outgoing %llu malformed",
+                ring -> outgoing, ring -> malformed);
+    fprintf(out, "\n");
+}
+
+#endif
@@ -0,0 +1,184 @@
+#ifndef __udp_payload__
+#define __udp_payload__
+
+#include <stdio.h>  // FILE, fprintf(), snprintf()
+#include <stdlib.h> // aligned_alloc(), strtoul(), exit()
+#include <string.h> // memcmp(), memcpy(), strcmp(), strncmp(), strtok_r()
+
+#include "udp_common.h" // u_int, u_ll, struct message, DATAGRAM_BUFFER_SIZE
+
+/* datagrams are built from a template: the payload is a pseudo-random
+   pattern written once at start-up and only the header is patched per
+   send; both ends derive the same pattern, so a receiver checks a payload
+   with one memcmp() against its own copy, which libc vectorizes */
+#define PAYLOAD_SEED       (0x9E3779B97F4A7C15ULL)
+#define PAYLOAD_MAX_SIZES  (16)
+#define IP_UDP_HEADER_SIZE (28) // IPv4 and UDP headers ahead of the datagram
+
+enum payload_mode {
+    PAYLOAD_FIXED,
+    PAYLOAD_UNIFORM, // every size in [min, max] equally likely
+    PAYLOAD_IMIX     // weighted mix of sizes
+};
+
+struct payload_mix {
+    enum payload_mode mode;
+    u_int             min;
+    u_int             max;
+    u_int             sizes[PAYLOAD_MAX_SIZES];   // payload bytes
+    u_int             weights[PAYLOAD_MAX_SIZES];
+    u_int             count;
+    u_int             weight_total;
+    u_ll              rng;
+};
+
+/* replies which came back with another size or other payload bytes */
+struct payload_check {
+    u_ll checked;
+    u_ll corrupt;
+    u_ll resized;
+};
+
+/* splitmix64 over the datagram offset, the same bytes on every host */
+void payload_fill(char *       data,
+                  const size_t length) {
+    u_ll state = PAYLOAD_SEED;
+    size_t offset;
+    for (offset = 0; offset < length; offset += sizeof(u_ll)) {
+        u_ll z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        z ^= z >> 31;
+        memcpy(data + offset, & z,
+               length - offset < sizeof(u_ll) ? length - offset : sizeof(u_ll));
+    }
+}
+
+/* a cache-aligned datagram of the largest size, payload pattern filled in */
+char * payload_template_alloc(void) {
+    char * template = aligned_alloc(64, DATAGRAM_BUFFER_SIZE);
+    if (! template) {
+        fprintf(stderr, "Error allocating packet template.\n");
+        exit(EXIT_FAILURE);
+    }
+    payload_fill(template, DATAGRAM_BUFFER_SIZE);
+    return template;
+}
+
+/* IP packet bytes of an IMIX entry to payload bytes behind our header */
+static inline u_int payload_from_ip_size(const u_int ip_size) {
+    const u_int overhead = IP_UDP_HEADER_SIZE + sizeof(struct message);
+    return ip_size > overhead ? ip_size - overhead : 0;
+}
+
+/* <payload>, <min>-<max>, imix (7:4:1 of 40, 576 and 1500 byte IP
+   packets) or imix:<IP bytes>x<weight>/...; IMIX sizes are IP packet
+   sizes as in the literature, sizes below our header are sent as the
+   bare header; payload_size gets the fixed or the largest size */
+bool payload_parse(struct payload_mix * mix,
+                   const char *         text,
+                   u_int *              payload_size) {
+    memset(mix, 0, sizeof(struct payload_mix));
+    mix -> rng = PAYLOAD_SEED;
+
+    char list[256];
+    snprintf(list, sizeof(list), "%s", strcmp(text, "imix") == 0 ?
+                                       "imix:40x7/576x4/1500x1" : text);
+    if (strncmp(list, "imix:", 5) == 0) {
+        mix -> mode = PAYLOAD_IMIX;
+        char * save = NULL;
+        char * item;
+        for (item = strtok_r(list + 5, "/", & save); item;
+             item = strtok_r(NULL, "/", & save)) {
+            if (mix -> count >= PAYLOAD_MAX_SIZES) {
+                fprintf(stderr, "More than %u IMIX sizes.\n", PAYLOAD_MAX_SIZES);
+                return FALSE;
+            }
+            char * weight = strchr(item, 'x');
+            mix -> sizes[mix -> count]   = payload_from_ip_size(strtoul(item, NULL, 10));
+            mix -> weights[mix -> count] = weight ? strtoul(weight + 1, NULL, 10) : 1;
+            mix -> weight_total         += mix -> weights[mix -> count];
+            if (mix -> sizes[mix -> count] > mix -> max)
+                mix -> max = mix -> sizes[mix -> count];
+            ++mix -> count;
+        }
+        if (mix -> weight_total == 0) {
+            fprintf(stderr, "IMIX needs at least one size with a weight.\n");
+            return FALSE;
+        }
+    }
+    else if (strchr(list, '-')) {
+        mix -> mode = PAYLOAD_UNIFORM;
+        mix -> min  = strtoul(list, NULL, 10);
+        mix -> max  = strtoul(strchr(list, '-') + 1, NULL, 10);
+        if (mix -> min > mix -> max) {
+            fprintf(stderr, "Payload range %s is empty.\n", text);
+            return FALSE;
+        }
+    }
+    else
+        mix -> max = strtoul(list, NULL, 10);
+    * payload_size = mix -> max;
+    return TRUE;
+}
+
+const char * payload_mode_name(const enum payload_mode mode) {
+    switch (mode) {
+        case PAYLOAD_UNIFORM: return "uniform";
+        case PAYLOAD_IMIX:    return "imix";
+        default:              return "fixed";
+    }
+}
+
+/* payload bytes of the next packet; a fixed mix leaves the size to the
+   caller, whose traffic phase may have its own */
+static inline u_int payload_next(struct payload_mix * mix,
+                                 const u_int          fixed_size) {
+    if (mix -> mode == PAYLOAD_FIXED)
+        return fixed_size;
+    mix -> rng ^= mix -> rng >> 12;
+    mix -> rng ^= mix -> rng << 25;
+    mix -> rng ^= mix -> rng >> 27;
+    const u_ll r = (mix -> rng * 0x2545F4914F6CDD1DULL) >> 32;
+    if (mix -> mode == PAYLOAD_UNIFORM)
+        return mix -> min + r % (mix -> max - mix -> min + 1);
+    u_int pick = r % mix -> weight_total, i;
+    for (i = 0; pick >= mix -> weights[i]; ++i)
+        pick -= mix -> weights[i];
+    return mix -> sizes[i];
+}
+
+/* compare a received datagram against the template; expected_length 0
+   takes any length */
+static inline void payload_check_packet(struct payload_check * check,
+                                        const char *           template,
+                                        const char *           packet,
+                                        const u_int            length,
+                                        const u_int            expected_length) {
+    ++check -> checked;
+    if (expected_length && length != expected_length)
+        ++check -> resized;
+    else if (memcmp(packet + sizeof(struct message),
+                    template + sizeof(struct message),
+                    length - sizeof(struct message)) != 0)
+        ++check -> corrupt;
+}
+
+void payload_check_merge(struct payload_check *       dst,
+                         const struct payload_check * src) {
+    dst -> checked += src -> checked;
+    dst -> corrupt += src -> corrupt;
+    dst -> resized += src -> resized;
+}
+
+void payload_print_summary(const struct payload_check * check,
+                           FILE *                       out) {
+    fprintf(out, "Payload check: checked %llu corrupt %llu (%.3f%%) "
+                 "resized %llu (%.3f%%)\n", check -> checked,
+            check -> corrupt,
+            check -> checked ? 100.0 * check -> corrupt / check -> checked : 0.0,
+            check -> resized,
+            check -> checked ? 100.0 * check -> resized / check -> checked : 0.0);
+}
+
+#endif
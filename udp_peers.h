@@ -0,0 +1,213 @@
+#ifndef __udp_peers__
+#define __udp_peers__
+
+#include <stdlib.h> // EXIT_FAILURE, exit(), aligned_alloc(), free()
+#include <stdio.h>  // FILE, fprintf(), stderr
+#include <string.h> // memset()
+
+#include <netinet/in.h> // sockaddr_in
+#include <arpa/inet.h>  // inet_ntoa()
+
+#include "udp_common.h" // u_int, u_ll
+#include "udp_seq.h"    // seq_tracker, seq_record(), seq_finish(), seq_merge()
+
+/* per-peer state in an open-addressing table with linear probing; the
+   entries are allocated once, keyed on address and port, and removed
+   with backward shifting so that no tombstones pile up */
+#define PEER_LOAD_PERCENT   (75)
+#define PEER_SWEEP_NS       ((u_ll) 1E9)
+
+struct peer {
+    /* the key, first so that probing touches a single cache line */
+    u_int              addr;      // network byte order
+    unsigned short     port;
+    unsigned short     used;
+    u_ll               received;
+    u_ll               first_ns;  // CLOCK_REALTIME of the first packet
+    u_ll               last_ns;
+    long long          last_transit_ns;
+    double             jitter_ns; // RFC 3550 inter-arrival jitter
+    struct seq_tracker seq;
+} __attribute__((aligned(64)));
+
+struct peer_table {
+    struct peer *    slots;
+    u_int            capacity;    // power of two
+    u_int            count;
+    u_ll             idle_ns;     // 0: never expire
+    u_ll             last_sweep_ns;
+
+    /* stats of the retired peers, plus packets of peers it had no room for */
+    u_ll             expired;
+    u_ll             overflow;
+    struct seq_stats expired_seq;
+};
+
+static inline u_int peer_hash(const u_int          addr,
+                              const unsigned short port) {
+    /* murmur3 finalizer */
+    u_ll h = ((u_ll) addr << 16) | port;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return (u_int) h;
+}
+
+void peer_table_init(struct peer_table * table,
+                     const u_int         max_peers,
+                     const u_ll          idle_ns) {
+    memset(table, 0, sizeof(struct peer_table));
+    table -> capacity = 64;
+    while (table -> capacity * (u_ll) PEER_LOAD_PERCENT / 100 < max_peers)
+        table -> capacity <<= 1;
+    table -> idle_ns = idle_ns;
+    table -> slots   = aligned_alloc(64, (size_t) table -> capacity *
+                                         sizeof(struct peer));
+    if (! table -> slots) {
+        fprintf(stderr, "Error allocating table of %u peers.\n", max_peers);
+        exit(EXIT_FAILURE);
+    }
+    /* pre-fault, the packet loop never allocates */
+    memset(table -> slots, 0, (size_t) table -> capacity * sizeof(struct peer));
+}
+
+void peer_table_free(struct peer_table * table) {
+    free(table -> slots);
+    table -> slots = NULL;
+}
+
+/* the entry of the peer, created on first sight; NULL if the table is full */
+static inline struct peer * peer_lookup(struct peer_table *        table,
+                                        const struct sockaddr_in * addr) {
+    const u_int          key_addr = addr -> sin_addr.s_addr;
+    const unsigned short key_port = addr -> sin_port;
+    const u_int          mask     = table -> capacity - 1;
+    u_int i = peer_hash(key_addr, key_port) & mask;
+    while (table -> slots[i].used) {
+        struct peer * p = & table -> slots[i];
+        if (p -> addr == key_addr && p -> port == key_port)
+            return p;
+        i = (i + 1) & mask;
+    }
+    if ((u_ll) (table -> count + 1) * 100 > (u_ll) table -> capacity *
+                                            PEER_LOAD_PERCENT)
+        return NULL;
+    struct peer * p = & table -> slots[i];
+    memset(p, 0, sizeof(struct peer));
+    p -> addr = key_addr;
+    p -> port = key_port;
+    p -> used = 1;
+    ++table -> count;
+    return p;
+}
+
+/* one packet of the peer: T1 of the client and the receive time T2 */
+static inline enum seq_class peer_record(struct peer * p,
+                               const u_ll    seq_num,
+                               const u_ll    client_tx_ns,
+                               const u_ll    rx_ns) {
+    const long long transit = (long long) (rx_ns - client_tx_ns);
+    if (p -> received == 0)
+        p -> first_ns = rx_ns;
+    else {
+        const long long d = transit - p -> last_transit_ns;
+        p -> jitter_ns += ((d < 0 ? -d : d) - p -> jitter_ns) / 16;
+    }
+    p -> last_transit_ns = transit;
+    p -> last_ns         = rx_ns;
+    ++p -> received;
+    return seq_record(& p -> seq, seq_num);
+}
+
+/* CSV, one line per peer, see peer_dump_header() */
+void peer_dump(const struct peer * p,
+               const u_int         worker_id,
+               const char *        state,
+               FILE *              out) {
+    struct in_addr addr = { p -> addr };
+    const struct seq_stats * s = & p -> seq.stats;
+    fprintf(out, "%u,%s,%u,%s,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%.3f\n",
+            worker_id, inet_ntoa(addr), ntohs(p -> port), state, p -> received,
+            s -> lost, s -> reordered, s -> duplicates, s -> late,
+            p -> first_ns, p -> last_ns, p -> jitter_ns / 1E3);
+}
+
+void peer_dump_header(FILE * out) {
+    fprintf(out, "worker,address,port,state,received,lost,reordered,"
+                 "duplicate,late,first_ns,last_ns,jitter_us\n");
+}
+
+/* remove slot i, shifting later members of its probe run back */
+void peer_remove(struct peer_table * table,
+                 u_int               i) {
+    const u_int mask = table -> capacity - 1;
+    u_int j = i;
+    while (TRUE) {
+        table -> slots[i].used = 0;
+        u_int home;
+        do {
+            j = (j + 1) & mask;
+            if (! table -> slots[j].used) {
+                --table -> count;
+                return;
+            }
+            home = peer_hash(table -> slots[j].addr, table -> slots[j].port) & mask;
+            /* j may move to i unless its home lies cyclically in (i, j] */
+        } while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+        table -> slots[i] = table -> slots[j];
+        i = j;
+    }
+}
+
+/* retire a peer: its loss becomes final, its stats go into the totals */
+static void peer_retire(struct peer_table * table,
+                        struct peer *       p) {
+    seq_finish(& p -> seq, 0);
+    seq_merge(& table -> expired_seq, & p -> seq.stats);
+}
+
+/* expire the peers idle for longer than idle_ns, at most once per
+   PEER_SWEEP_NS; expired peers are dumped if out is given */
+void peer_table_sweep(struct peer_table * table,
+                      const u_ll          now_ns,
+                      const u_int         worker_id,
+                      FILE *              out) {
+    if (! table -> idle_ns || now_ns - table -> last_sweep_ns < PEER_SWEEP_NS)
+        return;
+    table -> last_sweep_ns = now_ns;
+    u_int i = 0;
+    while (i < table -> capacity) {
+        struct peer * p = & table -> slots[i];
+        if (p -> used && now_ns - p -> last_ns > table -> idle_ns) {
+            peer_retire(table, p);
+            ++table -> expired;
+            if (out)
+                peer_dump(p, worker_id, "expired", out);
+            peer_remove(table, i);
+            continue; // a shifted entry may now sit in slot i
+        }
+        ++i;
+    }
+}
+
+/* all active peers; final turns their loss final and adds them to the
+   totals, which is only done once, on shutdown */
+void peer_table_dump(struct peer_table * table,
+                     const u_int         worker_id,
+                     const bool          final,
+                     FILE *              out) {
+    u_int i;
+    for (i = 0; i < table -> capacity; ++i) {
+        struct peer * p = & table -> slots[i];
+        if (! p -> used)
+            continue;
+        if (final)
+            peer_retire(table, p);
+        if (out)
+            peer_dump(p, worker_id, "active", out);
+    }
+}
+
+#endif
@@ -0,0 +1,253 @@
+#ifndef __udp_results__
+#define __udp_results__
+
+#include <stdlib.h>   // EXIT_FAILURE, exit()
+#include <stdio.h>    // fprintf(), stderr
+#include <string.h>   // memset(), memcpy()
+#include <unistd.h>   // ftruncate(), close(), sysconf()
+#include <fcntl.h>    // open(), posix_fallocate(), O_CREAT, O_RDWR, O_RDONLY
+#include <sys/mman.h> // mmap(), munmap(), msync()
+#include <sys/stat.h> // fstat()
+
+#include "udp_common.h" // u_int, u_ll
+
+/* columnar per-packet results written through mmap: a header page, then
+   row groups of RESULTS_GROUP_ROWS rows in which every field is a
+   contiguous column, so that a reader scanning one field touches only
+   its pages; the file grows by doubling its preallocated groups, rows
+   counts the complete rows, also while the run is still going */
+#define RESULTS_MAGIC        0x55445043 // "UDPC"
+#define RESULTS_VERSION      1
+#define RESULTS_HEADER_SIZE  (4096)
+#define RESULTS_GROUP_ROWS   (1 << 16)
+#define RESULTS_PREALLOC     (4)        // groups allocated up front
+
+#define RESULTS_FLAG_SERVER  (1 << 0)   // receive side of the server
+#define RESULTS_FLAG_CLOSED  (1 << 1)
+
+enum results_column {
+    RESULTS_SEQ_NUM,
+    RESULTS_SENT_NS,
+    RESULTS_RECV_NS,
+    RESULTS_RTT_NS,
+    RESULTS_KERN_NS,  // client: kernel RTT, server: kernel RX stamp
+    RESULTS_HW_NS,    // client: hardware RTT, server: hardware RX stamp
+    RESULTS_COLUMNS
+};
+
+struct results_header {
+    u_int magic;
+    u_int version;
+    u_int group_rows;
+    u_int column_count; // u_ll columns, followed by a u_int flags column
+    u_int flags;
+    u_int reserved;
+    u_ll  start_ns;     // clock of the recv_ns column when the run started
+    u_ll  rows;
+    u_ll  sent;         // client: requests sent, known once closed
+};
+
+static inline size_t results_group_size(void) {
+    return (size_t) RESULTS_GROUP_ROWS *
+           (RESULTS_COLUMNS * sizeof(u_ll) + sizeof(u_int));
+}
+
+static inline off_t results_group_offset(const u_ll group) {
+    return RESULTS_HEADER_SIZE + (off_t) group * results_group_size();
+}
+
+/* writer side, owned by the log ring writer thread */
+struct results_file {
+    int                     fd;
+    struct results_header * header;
+    char *                  group;     // mapping of the group being filled
+    u_ll                    group_index;
+    u_ll                    allocated; // groups backed by the file
+};
+
+static void results_map_group(struct results_file * results,
+                              const u_ll            index) {
+    if (results -> group)
+        munmap(results -> group, results_group_size());
+    if (index >= results -> allocated) {
+        const u_ll allocated = results -> allocated * 2;
+        if (posix_fallocate(results -> fd, 0, results_group_offset(allocated)) != 0 &&
+            ftruncate(results -> fd, results_group_offset(allocated)) != 0) {
+            fprintf(stderr, "Error growing results file to %llu groups.\n",
+                    allocated);
+            exit(EXIT_FAILURE);
+        }
+        results -> allocated = allocated;
+    }
+    results -> group = mmap(NULL, results_group_size(), PROT_READ | PROT_WRITE,
+                            MAP_SHARED, results -> fd, results_group_offset(index));
+    if (results -> group == MAP_FAILED) {
+        fprintf(stderr, "Error mapping results group %llu.\n", index);
+        exit(EXIT_FAILURE);
+    }
+    results -> group_index = index;
+}
+
+void results_open(struct results_file * results,
+                  const char *          name,
+                  const u_int           flags,
+                  const u_ll            start_ns) {
+    memset(results, 0, sizeof(struct results_file));
+    results -> fd = open(name, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (results -> fd == -1) {
+        fprintf(stderr, "Cannot open results file %s.\n", name);
+        exit(EXIT_FAILURE);
+    }
+    /* real blocks, so that a full disk shows up now and not as SIGBUS */
+    results -> allocated = RESULTS_PREALLOC;
+    if (posix_fallocate(results -> fd, 0, results_group_offset(RESULTS_PREALLOC)) != 0 &&
+        ftruncate(results -> fd, results_group_offset(RESULTS_PREALLOC)) != 0) {
+        fprintf(stderr, "Error preallocating results file %s.\n", name);
+        exit(EXIT_FAILURE);
+    }
+    results -> header = mmap(NULL, RESULTS_HEADER_SIZE, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, results -> fd, 0);
+    if (results -> header == MAP_FAILED) {
+        fprintf(stderr, "Error mapping results file %s.\n", name);
+        exit(EXIT_FAILURE);
+    }
+    results -> header -> version      = RESULTS_VERSION;
+    results -> header -> group_rows   = RESULTS_GROUP_ROWS;
+    results -> header -> column_count = RESULTS_COLUMNS;
+    results -> header -> flags        = flags;
+    results -> header -> start_ns     = start_ns;
+    results_map_group(results, 0);
+    __atomic_store_n(& results -> header -> magic, RESULTS_MAGIC, __ATOMIC_RELEASE);
+}
+
+/* append one row; the row count is published by results_commit() */
+static inline void results_append(struct results_file * results,
+                                  const u_ll            row,
+                                  const u_ll            values[RESULTS_COLUMNS],
+                                  const u_int           flags) {
+    const u_ll index = row & (RESULTS_GROUP_ROWS - 1);
+    if (row / RESULTS_GROUP_ROWS != results -> group_index)
+        results_map_group(results, row / RESULTS_GROUP_ROWS);
+    u_ll * columns = (u_ll *) results -> group;
+    u_int c;
+    for (c = 0; c < RESULTS_COLUMNS; ++c)
+        columns[c * RESULTS_GROUP_ROWS + index] = values[c];
+    ((u_int *) (columns + RESULTS_COLUMNS * RESULTS_GROUP_ROWS))[index] = flags;
+}
+
+static inline void results_commit(struct results_file * results,
+                                  const u_ll            rows) {
+    __atomic_store_n(& results -> header -> rows, rows, __ATOMIC_RELEASE);
+}
+
+/* cut the file after the last used group and mark it complete */
+void results_close(struct results_file * results,
+                   const u_ll            sent) {
+    if (! results -> header)
+        return;
+    const u_ll rows = results -> header -> rows;
+    results -> header -> sent   = sent;
+    results -> header -> flags |= RESULTS_FLAG_CLOSED;
+    munmap(results -> group, results_group_size());
+    munmap(results -> header, RESULTS_HEADER_SIZE);
+    if (ftruncate(results -> fd, results_group_offset(
+                      (rows + RESULTS_GROUP_ROWS - 1) / RESULTS_GROUP_ROWS)) != 0)
+        fprintf(stderr, "Error truncating results file.\n");
+    close(results -> fd);
+    results -> header = NULL;
+}
+
+/* reader side: the whole file mapped read-only */
+struct results_map {
+    const struct results_header * header;
+    const char *                  data;
+    size_t                        size;
+    u_ll                          rows;
+};
+
+bool results_map_open(struct results_map * map,
+                      const char *         name) {
+    memset(map, 0, sizeof(struct results_map));
+    const int fd = open(name, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Cannot open %s.\n", name);
+        return FALSE;
+    }
+    struct stat st;
+    if (fstat(fd, & st) == -1 || (size_t) st.st_size < RESULTS_HEADER_SIZE) {
+        fprintf(stderr, "%s is not a results file.\n", name);
+        close(fd);
+        return FALSE;
+    }
+    map -> size = st.st_size;
+    map -> data = mmap(NULL, map -> size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map -> data == MAP_FAILED) {
+        fprintf(stderr, "Error mapping %s.\n", name);
+        return FALSE;
+    }
+    map -> header = (const struct results_header *) map -> data;
+    if (map -> header -> magic != RESULTS_MAGIC) {
+        fprintf(stderr, "%s is not a results file.\n", name);
+        return FALSE;
+    }
+    if (map -> header -> version != RESULTS_VERSION ||
+        map -> header -> group_rows != RESULTS_GROUP_ROWS ||
+        map -> header -> column_count != RESULTS_COLUMNS) {
+        fprintf(stderr, "Unsupported results version %u.\n", map -> header -> version);
+        return FALSE;
+    }
+    /* a file still being written only has its complete groups mapped */
+    map -> rows = __atomic_load_n(& map -> header -> rows, __ATOMIC_ACQUIRE);
+    const u_ll mapped_groups = (map -> size - RESULTS_HEADER_SIZE) /
+                               results_group_size();
+    if (map -> rows > mapped_groups * RESULTS_GROUP_ROWS)
+        map -> rows = mapped_groups * RESULTS_GROUP_ROWS;
+    madvise((void *) map -> data, map -> size, MADV_SEQUENTIAL);
+    return TRUE;
+}
+
+void results_map_close(struct results_map * map) {
+    if (map -> data && map -> data != MAP_FAILED)
+        munmap((void *) map -> data, map -> size);
+    map -> data = NULL;
+}
+
+/* the column of the group holding row, and the index of row in it */
+static inline const u_ll * results_column(const struct results_map * map,
+                                          const enum results_column  column,
+                                          const u_ll                 row) {
+    return (const u_ll *) (map -> data +
+                           results_group_offset(row / RESULTS_GROUP_ROWS)) +
+           (size_t) column * RESULTS_GROUP_ROWS;
+}
+
+static inline u_ll results_value(const struct results_map * map,
+                                 const enum results_column  column,
+                                 const u_ll                 row) {
+    return results_column(map, column, row)[row & (RESULTS_GROUP_ROWS - 1)];
+}
+
+/* the log_record flags of a row */
+static inline u_int results_flags(const struct results_map * map,
+                                  const u_ll                 row) {
+    const u_int * flags = (const u_int *) results_column(map, RESULTS_COLUMNS, row);
+    return flags[row & (RESULTS_GROUP_ROWS - 1)];
+}
+
+/* first row received at or after time_ns; the rows of a file are in
+   receive order */
+u_ll results_find_time(const struct results_map * map,
+                       const u_ll                 time_ns) {
+    u_ll low = 0, high = map -> rows;
+    while (low < high) {
+        const u_ll middle = low + (high - low) / 2;
+        if (results_value(map, RESULTS_RECV_NS, middle) < time_ns)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+#endif
@@ -0,0 +1,246 @@
+#ifndef __udp_search__
+#define __udp_search__
+
+#include <stdio.h>  // FILE, fprintf(), snprintf()
+#include <stdlib.h> // strtod(), strtoul()
+#include <string.h> // memset(), strtok_r(), strchr(), strcmp()
+
+#include "udp_common.h" // u_int, u_ll, struct message
+#include "udp_hist.h"   // latency_hist, hist_percentile()
+
+/* RFC 2544 style throughput search: fixed-duration trials at a constant
+   rate, each followed by a settle period for the stragglers; a trial
+   passes if its loss and p99 RTT stay within bounds, and a binary search
+   between the last passing and the first failing rate closes in on the
+   highest rate which passes, once per payload size */
+#define SEARCH_MAX_SIZES   (16)
+
+struct search_spec {
+    double min_rate;      // pps
+    double max_rate;
+    double loss_pct;      // acceptable loss
+    u_ll   p99_ns;        // 0: no latency bound
+    u_int  trial_s;
+    u_int  settle_s;
+    double precision_pct; // stop once the bounds are this close
+    u_int  sizes[SEARCH_MAX_SIZES];
+    u_int  size_count;
+};
+
+/* the best trial of a payload size */
+struct search_result {
+    u_int  payload_size;
+    bool   found;
+    double rate;
+    double loss_pct;
+    u_ll   p50_ns;
+    u_ll   p99_ns;
+    u_int  trials;
+};
+
+struct rate_search {
+    struct search_spec   spec;
+    struct search_result results[SEARCH_MAX_SIZES];
+    u_int                size_index;
+    u_int                trial_count;
+
+    /* bounds of the current size: lo passed (or is the minimum), hi failed */
+    double               lo;
+    double               hi;
+    double               next;
+};
+
+/* comma separated key=value: max=<pps> (required), min=<pps> (=1),
+   loss=<%> (=0), p99=<us> (=no bound), trial=<s> (=10), settle=<s> (=2),
+   precision=<%> (=1), sizes=<payload>/<payload>/... (=the -P payload) */
+bool search_parse(struct search_spec * spec,
+                  const char *         text,
+                  const u_int          payload_size) {
+    memset(spec, 0, sizeof(struct search_spec));
+    spec -> min_rate      = 1;
+    spec -> trial_s       = 10;
+    spec -> settle_s      = 2;
+    spec -> precision_pct = 1;
+
+    char list[256];
+    snprintf(list, sizeof(list), "%s", text);
+    char * save = NULL;
+    char * item;
+    for (item = strtok_r(list, ",", & save); item;
+         item = strtok_r(NULL, ",", & save)) {
+        char * value = strchr(item, '=');
+        if (! value) {
+            fprintf(stderr, "Search parameter %s has no value.\n", item);
+            return FALSE;
+        }
+        * value++ = '\0';
+        if (strcmp(item, "max") == 0)
+            spec -> max_rate = strtod(value, NULL);
+        else if (strcmp(item, "min") == 0)
+            spec -> min_rate = strtod(value, NULL);
+        else if (strcmp(item, "loss") == 0)
+            spec -> loss_pct = strtod(value, NULL);
+        else if (strcmp(item, "p99") == 0)
+            spec -> p99_ns = (u_ll) (strtod(value, NULL) * 1E3);
+        else if (strcmp(item, "trial") == 0)
+            spec -> trial_s = strtoul(value, NULL, 10);
+        else if (strcmp(item, "settle") == 0)
+            spec -> settle_s = strtoul(value, NULL, 10);
+        else if (strcmp(item, "precision") == 0)
+            spec -> precision_pct = strtod(value, NULL);
+        else if (strcmp(item, "sizes") == 0) {
+            char * size_save = NULL;
+            char * size;
+            for (size = strtok_r(value, "/", & size_save); size;
+                 size = strtok_r(NULL, "/", & size_save)) {
+                if (spec -> size_count >= SEARCH_MAX_SIZES) {
+                    fprintf(stderr, "More than %u payload sizes.\n",
+                            SEARCH_MAX_SIZES);
+                    return FALSE;
+                }
+                spec -> sizes[spec -> size_count++] = strtoul(size, NULL, 10);
+            }
+        }
+        else {
+            fprintf(stderr, "Unknown search parameter: %s\n", item);
+            return FALSE;
+        }
+    }
+    if (spec -> size_count == 0)
+        spec -> sizes[spec -> size_count++] = payload_size;
+
+    u_int i;
+    for (i = 0; i < spec -> size_count; ++i) {
+        if (spec -> sizes[i] > MAX_DATAGRAM_SIZE - sizeof(struct message)) {
+            fprintf(stderr, "Payload size must not exceed %zu.\n",
+                    MAX_DATAGRAM_SIZE - sizeof(struct message));
+            return FALSE;
+        }
+    }
+    if (spec -> max_rate <= 0 || spec -> min_rate <= 0 ||
+        spec -> min_rate > spec -> max_rate || spec -> trial_s == 0 ||
+        spec -> precision_pct <= 0 || spec -> loss_pct < 0) {
+        fprintf(stderr, "Search needs 0 < min <= max, a trial duration "
+                        "and a positive precision.\n");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* start on the payload size at size_index; the first trial runs at the
+   maximum rate, which ends the search right away if the path takes it */
+void search_begin_size(struct rate_search * search) {
+    struct search_result * result = & search -> results[search -> size_index];
+    memset(result, 0, sizeof(struct search_result));
+    result -> payload_size = search -> spec.sizes[search -> size_index];
+    search -> lo   = search -> spec.min_rate;
+    search -> hi   = search -> spec.max_rate;
+    search -> next = search -> spec.max_rate;
+}
+
+void search_init(struct rate_search *       search,
+                 const struct search_spec * spec) {
+    memset(search, 0, sizeof(struct rate_search));
+    search -> spec = * spec;
+    search_begin_size(search);
+}
+
+/* FALSE once every payload size is done */
+bool search_next_trial(const struct rate_search * search,
+                       double *                   rate,
+                       u_int *                    payload_size) {
+    if (search -> size_index >= search -> spec.size_count)
+        return FALSE;
+    * rate         = search -> next;
+    * payload_size = search -> results[search -> size_index].payload_size;
+    return TRUE;
+}
+
+/* outcome of the trial at the rate handed out last; sent counts what
+   left the host, send_errors what the local stack refused. achieved is
+   the rate the sender really managed, a sender which falls behind fails
+   the trial rather than pass a rate which was never offered */
+void search_record_trial(struct rate_search *        search,
+                         const u_ll                  sent,
+                         const u_ll                  send_errors,
+                         const u_ll                  received,
+                         const double                achieved,
+                         const struct latency_hist * latency,
+                         FILE *                      out) {
+    const struct search_spec * spec   = & search -> spec;
+    struct search_result *     result = & search -> results[search -> size_index];
+    const double rate     = search -> next;
+    const double loss_pct = sent && received < sent ?
+                            100.0 * (sent - received) / sent : 0.0;
+    const u_ll   p99      = hist_percentile(latency, 0.99);
+    const bool   pass     = sent > 0 && loss_pct <= spec -> loss_pct &&
+                            (! spec -> p99_ns || p99 <= spec -> p99_ns) &&
+                            achieved >= 0.99 * rate;
+    ++result -> trials;
+    ++search -> trial_count;
+    fprintf(out, "Trial %u: payload %u at %.0f pps (achieved %.0f): sent %llu "
+                 "send errors %llu received %llu loss %.3f%% p99 %.3f us: %s\n",
+            search -> trial_count, result -> payload_size, rate, achieved,
+            sent, send_errors, received, loss_pct, p99 / 1E3,
+            pass ? "pass" : "fail");
+    fflush(out);
+
+    if (pass) {
+        result -> found    = TRUE;
+        result -> rate     = rate;
+        result -> loss_pct = loss_pct;
+        result -> p50_ns   = hist_percentile(latency, 0.5);
+        result -> p99_ns   = p99;
+        search -> lo       = rate;
+    }
+    else
+        search -> hi = rate;
+
+    /* done with the size when the maximum passes, the minimum fails or
+       the bounds are within the precision or a packet per second */
+    const bool done = (pass && rate >= spec -> max_rate) ||
+                      (! pass && rate <= spec -> min_rate) ||
+                      search -> hi - search -> lo <= 1 ||
+                      search -> hi - search -> lo <=
+                      search -> hi * spec -> precision_pct / 100;
+    if (! done) {
+        search -> next = (u_ll) ((search -> lo + search -> hi) / 2);
+        return;
+    }
+    if (++search -> size_index < spec -> size_count)
+        search_begin_size(search);
+}
+
+/* max rate per payload size, in the units of the rest of the summary */
+void search_print_table(const struct rate_search * search,
+                        FILE *                     out) {
+    const struct search_spec * spec = & search -> spec;
+    fprintf(out, "Rate search: loss <= %.3f%%, ", spec -> loss_pct);
+    if (spec -> p99_ns)
+        fprintf(out, "p99 <= %.3f us, ", spec -> p99_ns / 1E3);
+    else
+        fprintf(out, "no latency bound, ");
+    fprintf(out, "%u s trials, %u s settle, %.0f-%.0f pps\n",
+            spec -> trial_s, spec -> settle_s, spec -> min_rate, spec -> max_rate);
+    fprintf(out, "Payload\tDatagram\tMax rate (pps)\tMbit/s\tLoss (%%)\t"
+                 "p50 (us)\tp99 (us)\tTrials\n");
+    u_int i;
+    for (i = 0; i < spec -> size_count; ++i) {
+        const struct search_result * result = & search -> results[i];
+        if (result -> trials == 0)
+            break;
+        const u_int datagram = sizeof(struct message) + result -> payload_size;
+        if (result -> found)
+            fprintf(out, "%u\t%u\t%.0f\t%.3f\t%.3f\t%.3f\t%.3f\t%u",
+                    result -> payload_size, datagram, result -> rate,
+                    result -> rate * datagram * 8 / 1E6, result -> loss_pct,
+                    result -> p50_ns / 1E3, result -> p99_ns / 1E3,
+                    result -> trials);
+        else
+            fprintf(out, "%u\t%u\tnone\t-\t-\t-\t-\t%u",
+                    result -> payload_size, datagram, result -> trials);
+        fprintf(out, "%s\n", i == search -> size_index ? "\t(interrupted)" : "");
+    }
+}
+
+#endif
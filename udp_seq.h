@@ -0,0 +1,202 @@
+#ifndef __udp_seq__
+#define __udp_seq__
+
+#include <stdio.h>  // FILE, fprintf()
+#include <string.h> // memset()
+
+#include "udp_common.h" // u_int, u_ll
+
+/* sequence tracker over a sliding window of SEQ_WINDOW sequence numbers:
+   a bit per number says whether it has arrived; a number leaving the
+   window without its bit set is lost, one arriving below the window is
+   late (and stays lost, as in RFC 4737); a number below the next expected
+   one is reordered, a number whose bit is set a duplicate */
+#ifndef SEQ_WINDOW
+    #define SEQ_WINDOW     (4096) // bits, power of two, at least 64
+#endif
+#define SEQ_WORDS          (SEQ_WINDOW / 64)
+#define SEQ_DENSITY_MAX    (16)   // RFC 5236 displacement threshold
+
+enum seq_class {
+    SEQ_IN_ORDER,
+    SEQ_REORDERED,
+    SEQ_DUPLICATE,
+    SEQ_LATE
+};
+
+struct seq_stats {
+    u_ll received;     // unique, in the window
+    u_ll in_order;
+    u_ll reordered;
+    u_ll duplicates;
+    u_ll late;
+    u_ll lost;
+    u_ll distance_sum; // reorder distance: next expected - 1 - seq
+    u_ll distance_max;
+    u_ll density[SEQ_DENSITY_MAX + 1]; // by distance, the last is ">="
+};
+
+struct seq_tracker {
+    struct seq_stats stats;
+    bool             started;
+    u_ll             first;    // lowest sequence number tracked
+    u_ll             next;     // highest seen + 1
+    u_ll             bits[SEQ_WORDS];
+};
+
+void seq_init(struct seq_tracker * tracker) {
+    memset(tracker, 0, sizeof(struct seq_tracker));
+}
+
+/* for a stream known to start at first, so that what is lost before the
+   first arrival counts too; seq_init() starts at whatever arrives first */
+void seq_init_at(struct seq_tracker * tracker,
+                 const u_ll           first) {
+    seq_init(tracker);
+    tracker -> started = TRUE;
+    tracker -> first   = first;
+    tracker -> next    = first;
+}
+
+static inline bool seq_test(const struct seq_tracker * tracker,
+                            const u_ll                 seq) {
+    const u_int bit = seq & (SEQ_WINDOW - 1);
+    return (tracker -> bits[bit / 64] >> (bit % 64)) & 1;
+}
+
+static inline void seq_set(struct seq_tracker * tracker,
+                           const u_ll           seq) {
+    const u_int bit = seq & (SEQ_WINDOW - 1);
+    tracker -> bits[bit / 64] |= 1ULL << (bit % 64);
+}
+
+/* empty the whole window, counting what never arrived in it */
+void seq_flush(struct seq_tracker * tracker) {
+    u_int i, received = 0;
+    for (i = 0; i < SEQ_WORDS; ++i) {
+        received += __builtin_popcountll(tracker -> bits[i]);
+        tracker -> bits[i] = 0;
+    }
+    const u_ll tracked = tracker -> next - tracker -> first < SEQ_WINDOW ?
+                         tracker -> next - tracker -> first : SEQ_WINDOW;
+    tracker -> stats.lost += tracked - received;
+}
+
+/* move the window up to end: every number dropping out without its bit
+   is lost; amortised O(1), a number passes the window once */
+void seq_advance(struct seq_tracker * tracker,
+                 const u_ll           end) {
+    u_ll seq = tracker -> next;
+    if (end - seq >= SEQ_WINDOW) {
+        /* the whole window goes at once, what lies between the old and
+           the new window was never seen */
+        seq_flush(tracker);
+        tracker -> stats.lost += end - SEQ_WINDOW - seq;
+        tracker -> first = end - SEQ_WINDOW;
+        tracker -> next  = end;
+        return;
+    }
+    for (; seq < end; ++seq) {
+        /* the bit of seq still belongs to seq - SEQ_WINDOW */
+        if (seq - tracker -> first >= SEQ_WINDOW) {
+            if (! seq_test(tracker, seq))
+                ++tracker -> stats.lost;
+            const u_int bit = seq & (SEQ_WINDOW - 1);
+            tracker -> bits[bit / 64] &= ~(1ULL << (bit % 64));
+        }
+    }
+    tracker -> next = end;
+}
+
+/* classify one arriving sequence number */
+enum seq_class seq_record(struct seq_tracker * tracker,
+                          const u_ll           seq) {
+    struct seq_stats * stats = & tracker -> stats;
+    if (! tracker -> started) {
+        tracker -> started = TRUE;
+        tracker -> first   = seq;
+        tracker -> next    = seq;
+    }
+
+    /* RFC 4737: in order if not below the next expected number */
+    if (seq >= tracker -> next) {
+        seq_advance(tracker, seq + 1);
+        seq_set(tracker, seq);
+        ++stats -> received;
+        ++stats -> in_order;
+        return SEQ_IN_ORDER;
+    }
+    if (tracker -> next - seq > SEQ_WINDOW || seq < tracker -> first) {
+        ++stats -> late;
+        return SEQ_LATE;
+    }
+    if (seq_test(tracker, seq)) {
+        ++stats -> duplicates;
+        return SEQ_DUPLICATE;
+    }
+    seq_set(tracker, seq);
+    ++stats -> received;
+    ++stats -> reordered;
+    const u_ll distance = tracker -> next - 1 - seq;
+    stats -> distance_sum += distance;
+    if (distance > stats -> distance_max)
+        stats -> distance_max = distance;
+    ++stats -> density[distance < SEQ_DENSITY_MAX ? distance : SEQ_DENSITY_MAX];
+    return SEQ_REORDERED;
+}
+
+/* end of the stream at end (one past the last number sent, 0 if unknown):
+   whatever is missing in the window and after it is lost */
+void seq_finish(struct seq_tracker * tracker,
+                const u_ll           end) {
+    if (! tracker -> started) {
+        tracker -> stats.lost += end;
+        return;
+    }
+    seq_flush(tracker);
+    if (end > tracker -> next)
+        tracker -> stats.lost += end - tracker -> next;
+    tracker -> started = FALSE;
+}
+
+void seq_merge(struct seq_stats *       dst,
+               const struct seq_stats * src) {
+    u_int i;
+    dst -> received     += src -> received;
+    dst -> in_order     += src -> in_order;
+    dst -> reordered    += src -> reordered;
+    dst -> duplicates   += src -> duplicates;
+    dst -> late         += src -> late;
+    dst -> lost         += src -> lost;
+    dst -> distance_sum += src -> distance_sum;
+    if (src -> distance_max > dst -> distance_max)
+        dst -> distance_max = src -> distance_max;
+    for (i = 0; i <= SEQ_DENSITY_MAX; ++i)
+        dst -> density[i] += src -> density[i];
+}
+
+/* RFC 4737 reordered ratio and extent, RFC 5236 reorder density */
+void seq_print_summary(const struct seq_stats * stats,
+                       const char *             label,
+                       FILE *                   out) {
+    const u_ll total = stats -> received + stats -> lost;
+    fprintf(out, "%s: received %llu in-order %llu reordered %llu (%.3f%%) "
+                 "duplicate %llu late %llu lost %llu (%.3f%%)\n",
+            label, stats -> received, stats -> in_order, stats -> reordered,
+            stats -> received ? 100.0 * stats -> reordered / stats -> received : 0.0,
+            stats -> duplicates, stats -> late, stats -> lost,
+            total ? 100.0 * stats -> lost / total : 0.0);
+    if (stats -> reordered == 0)
+        return;
+    fprintf(out, "%s reorder distance: mean %.2f max %llu density",
+            label, (double) stats -> distance_sum / stats -> reordered,
+            stats -> distance_max);
+    u_int i;
+    for (i = 0; i <= SEQ_DENSITY_MAX; ++i)
+        if (stats -> density[i])
+            fprintf(out, " %s%u:%.4f", i == SEQ_DENSITY_MAX ? ">=" : "", i,
+                    (double) stats -> density[i] / stats -> reordered);
+    fprintf(out, "\n");
+}
+
+#endif
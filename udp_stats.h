@@ -0,0 +1,318 @@
+#ifndef __udp_stats__
+#define __udp_stats__
+
+#include <stdlib.h>  // EXIT_FAILURE, exit()
+#include <stdio.h>   // FILE, fprintf(), fflush(), stderr
+#include <string.h>  // memset(), snprintf()
+#include <time.h>    // timespec, nanosleep(), clock_gettime()
+#include <unistd.h>  // ftruncate(), close(), getpid()
+#include <fcntl.h>   // O_CREAT, O_RDWR, O_RDONLY
+#include <pthread.h> // pthread_t
+#include <sys/mman.h> // shm_open(), shm_unlink(), mmap()
+#include <sys/stat.h> // fstat()
+
+#include "udp_common.h" // u_int, u_ll, start_thread(), realtime_ns()
+#include "udp_hist.h"   // latency_hist, hist_record(), hist_percentile()
+#include "udp_seq.h"    // seq_class
+
+/* live counters in a shared memory segment: one slot per packet thread,
+   cumulative since the start, so that a reader gets the figures of any
+   interval as the difference of two snapshots; the packet threads only
+   store to memory, no syscalls and no locks */
+#define STATS_MAGIC        0x55445053 // "UDPS"
+#define STATS_VERSION      1
+#define STATS_NAME_SIZE    (64)
+
+/* every field has a single writer; the send side and the receive side
+   of a slot may be different threads and live on cache lines of their own */
+struct stats_counters {
+    u_ll tx_packets;
+    u_ll tx_bytes;
+
+    u_ll rx_packets __attribute__((aligned(64)));
+    u_ll rx_bytes;
+    u_ll lost;
+    u_ll reordered;
+    u_ll duplicates;
+    u_ll late;
+    struct latency_hist latency; // RTT (client) only
+} __attribute__((aligned(64)));
+
+struct stats_segment {
+    u_int magic;       // stored last, once the segment is initialized
+    u_int version;
+    u_int slot_size;   // sizeof(struct stats_counters)
+    u_int slot_count;
+    int   pid;
+    char  role[12];    // "client" or "server"
+    u_ll  start_ns;    // CLOCK_REALTIME
+    struct stats_counters slots[] __attribute__((aligned(64)));
+};
+
+static inline size_t stats_segment_size(const u_int slot_count) {
+    return sizeof(struct stats_segment) +
+           (size_t) slot_count * sizeof(struct stats_counters);
+}
+
+/* POSIX shared memory names start with a slash */
+void stats_shm_name(char *       dst,
+                    const char * name) {
+    snprintf(dst, STATS_NAME_SIZE, "%s%s", name[0] == '/' ? "" : "/", name);
+}
+
+/* the counters of the process; published under name if given, else
+   private to the process for the interval reports */
+struct stats_segment * stats_create(const char * name,
+                                    const char * role,
+                                    const u_int  slot_count) {
+    const size_t size = stats_segment_size(slot_count);
+    struct stats_segment * segment;
+    if (name && name[0]) {
+        char shm_name[STATS_NAME_SIZE];
+        stats_shm_name(shm_name, name);
+        const int fd = shm_open(shm_name, O_CREAT | O_TRUNC | O_RDWR, 0644);
+        if (fd == -1 || ftruncate(fd, size) == -1) {
+            fprintf(stderr, "Error creating shared memory %s.\n", shm_name);
+            exit(EXIT_FAILURE);
+        }
+        segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    }
+    else
+        segment = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (segment == MAP_FAILED) {
+        fprintf(stderr, "Error mapping %zu bytes of counters.\n", size);
+        exit(EXIT_FAILURE);
+    }
+
+    /* fresh mappings are zeroed */
+    u_int i;
+    for (i = 0; i < slot_count; ++i)
+        hist_init(& segment -> slots[i].latency);
+    segment -> version    = STATS_VERSION;
+    segment -> slot_size  = sizeof(struct stats_counters);
+    segment -> slot_count = slot_count;
+    segment -> pid        = getpid();
+    segment -> start_ns   = realtime_ns();
+    snprintf(segment -> role, sizeof(segment -> role), "%s", role);
+    __atomic_store_n(& segment -> magic, STATS_MAGIC, __ATOMIC_RELEASE);
+    return segment;
+}
+
+void stats_remove(const char * name) {
+    char shm_name[STATS_NAME_SIZE];
+    stats_shm_name(shm_name, name);
+    shm_unlink(shm_name);
+}
+
+/* reader side: map the segment of a running process; NULL if there is
+   none or it is of another version */
+const struct stats_segment * stats_attach(const char * name) {
+    char shm_name[STATS_NAME_SIZE];
+    stats_shm_name(shm_name, name);
+    const int fd = shm_open(shm_name, O_RDONLY, 0);
+    if (fd == -1) {
+        fprintf(stderr, "No counters under %s.\n", shm_name);
+        return NULL;
+    }
+    struct stat st;
+    const struct stats_segment * segment = MAP_FAILED;
+    if (fstat(fd, & st) == 0 && (size_t) st.st_size >= sizeof(struct stats_segment))
+        segment = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) {
+        fprintf(stderr, "Cannot map %s.\n", shm_name);
+        return NULL;
+    }
+    if (__atomic_load_n(& segment -> magic, __ATOMIC_ACQUIRE) != STATS_MAGIC ||
+        segment -> version   != STATS_VERSION ||
+        segment -> slot_size != sizeof(struct stats_counters) ||
+        (size_t) st.st_size < stats_segment_size(segment -> slot_count)) {
+        fprintf(stderr, "%s holds no counters of version %u.\n",
+                shm_name, STATS_VERSION);
+        return NULL;
+    }
+    return segment;
+}
+
+/* hot path; counters is NULL when neither -M nor -o is given */
+static inline void stats_count(u_ll *     counter,
+                               const u_ll n) {
+    __atomic_store_n(counter, * counter + n, __ATOMIC_RELAXED);
+}
+
+static inline void stats_count_tx(struct stats_counters * counters,
+                                  const u_ll              packets,
+                                  const u_ll              bytes) {
+    if (! counters)
+        return;
+    stats_count(& counters -> tx_packets, packets);
+    stats_count(& counters -> tx_bytes,   bytes);
+}
+
+static inline void stats_count_rx(struct stats_counters * counters,
+                                  const u_ll              bytes) {
+    if (! counters)
+        return;
+    stats_count(& counters -> rx_packets, 1);
+    stats_count(& counters -> rx_bytes,   bytes);
+}
+
+/* the class of an arrival plus what its tracker declared lost meanwhile */
+static inline void stats_count_seq(struct stats_counters * counters,
+                                   const enum seq_class    seq_class,
+                                   const u_ll              lost) {
+    if (! counters)
+        return;
+    if (lost)
+        stats_count(& counters -> lost, lost);
+    if (seq_class == SEQ_REORDERED)
+        stats_count(& counters -> reordered, 1);
+    else if (seq_class == SEQ_DUPLICATE)
+        stats_count(& counters -> duplicates, 1);
+    else if (seq_class == SEQ_LATE)
+        stats_count(& counters -> late, 1);
+}
+
+static inline void stats_record_latency(struct stats_counters * counters,
+                                        const u_ll              latency_ns) {
+    if (counters)
+        hist_record(& counters -> latency, latency_ns);
+}
+
+/* sum of all slots */
+void stats_snapshot(const struct stats_segment * segment,
+                    struct stats_counters *      total) {
+    memset(total, 0, sizeof(struct stats_counters));
+    hist_init(& total -> latency);
+    u_int i;
+    for (i = 0; i < segment -> slot_count; ++i) {
+        const struct stats_counters * slot = & segment -> slots[i];
+        total -> tx_packets += slot -> tx_packets;
+        total -> tx_bytes   += slot -> tx_bytes;
+        total -> rx_packets += slot -> rx_packets;
+        total -> rx_bytes   += slot -> rx_bytes;
+        total -> lost       += slot -> lost;
+        total -> reordered  += slot -> reordered;
+        total -> duplicates += slot -> duplicates;
+        total -> late       += slot -> late;
+        hist_merge(& total -> latency, & slot -> latency);
+    }
+}
+
+/* what happened between two snapshots; min and max of the interval
+   are only known to the resolution of the buckets */
+void stats_diff(struct stats_counters *       delta,
+                const struct stats_counters * now,
+                const struct stats_counters * before) {
+    delta -> tx_packets = now -> tx_packets - before -> tx_packets;
+    delta -> tx_bytes   = now -> tx_bytes   - before -> tx_bytes;
+    delta -> rx_packets = now -> rx_packets - before -> rx_packets;
+    delta -> rx_bytes   = now -> rx_bytes   - before -> rx_bytes;
+    delta -> lost       = now -> lost       - before -> lost;
+    delta -> reordered  = now -> reordered  - before -> reordered;
+    delta -> duplicates = now -> duplicates - before -> duplicates;
+    delta -> late       = now -> late       - before -> late;
+
+    struct latency_hist * hist = & delta -> latency;
+    hist_init(hist);
+    u_int i;
+    for (i = 0; i < HIST_BUCKET_COUNT; ++i) {
+        hist -> counts[i] = now -> latency.counts[i] - before -> latency.counts[i];
+        if (hist -> counts[i] == 0)
+            continue;
+        if (hist -> min == ~0ULL)
+            hist -> min = hist_lower_bound(i);
+        hist -> max = hist_upper_bound(i);
+    }
+    hist -> total = now -> latency.total - before -> latency.total;
+    hist -> sum   = now -> latency.sum   - before -> latency.sum;
+}
+
+/* one line per interval: rates, sequence events and RTT percentiles */
+void stats_print_interval(const struct stats_counters * delta,
+                          const double                  seconds,
+                          const double                  elapsed,
+                          FILE *                        out) {
+    const u_ll total = delta -> rx_packets + delta -> lost;
+    fprintf(out, "[%8.1f s] tx %.0f pps %.3f Mbit/s  rx %.0f pps %.3f Mbit/s  "
+                 "lost %llu (%.3f%%) reordered %llu dup %llu late %llu",
+            elapsed,
+            delta -> tx_packets / seconds, delta -> tx_bytes * 8 / seconds / 1E6,
+            delta -> rx_packets / seconds, delta -> rx_bytes * 8 / seconds / 1E6,
+            delta -> lost, total ? 100.0 * delta -> lost / total : 0.0,
+            delta -> reordered, delta -> duplicates, delta -> late);
+    const struct latency_hist * hist = & delta -> latency;
+    if (hist -> total)
+        fprintf(out, "  RTT (us) p50 %.3f p99 %.3f p99.9 %.3f max %.3f",
+                hist_percentile(hist, 0.5)   / 1E3,
+                hist_percentile(hist, 0.99)  / 1E3,
+                hist_percentile(hist, 0.999) / 1E3,
+                hist -> max / 1E3);
+    fprintf(out, "\n");
+    fflush(out);
+}
+
+/* raw totals, one line which scripts can take apart */
+void stats_print_totals(const struct stats_counters * total,
+                        FILE *                        out) {
+    fprintf(out, "Totals: tx_packets %llu tx_bytes %llu rx_packets %llu "
+                 "rx_bytes %llu lost %llu reordered %llu duplicates %llu "
+                 "late %llu rtt_samples %llu\n",
+            total -> tx_packets, total -> tx_bytes, total -> rx_packets,
+            total -> rx_bytes, total -> lost, total -> reordered,
+            total -> duplicates, total -> late, total -> latency.total);
+}
+
+/* the optional report every interval_s seconds, off the packet threads */
+struct stats_reporter {
+    pthread_t                    thread;
+    const struct stats_segment * segment;
+    u_int                        interval_s;
+    FILE *                       out;
+};
+
+void * stats_reporter_run(void * arg) {
+    struct stats_reporter * reporter = (struct stats_reporter *) arg;
+    struct stats_counters * snapshots = calloc(3, sizeof(struct stats_counters));
+    if (! snapshots) {
+        fprintf(stderr, "Error allocating interval snapshots.\n");
+        return NULL;
+    }
+    struct stats_counters * before = & snapshots[0];
+    struct stats_counters * now    = & snapshots[1];
+    struct stats_counters * delta  = & snapshots[2];
+    struct timespec start, present;
+    clock_gettime(CLOCK_MONOTONIC, & start);
+    stats_snapshot(reporter -> segment, before);
+    u_ll before_ns = start.tv_sec * (u_ll) 1E9 + start.tv_nsec;
+    const u_ll start_ns = before_ns;
+    while (TRUE) {
+        const struct timespec nap = { reporter -> interval_s, 0 };
+        nanosleep(& nap, NULL);
+        clock_gettime(CLOCK_MONOTONIC, & present);
+        const u_ll now_ns = present.tv_sec * (u_ll) 1E9 + present.tv_nsec;
+        stats_snapshot(reporter -> segment, now);
+        stats_diff(delta, now, before);
+        stats_print_interval(delta, (now_ns - before_ns) / 1E9,
+                             (now_ns - start_ns) / 1E9, reporter -> out);
+        struct stats_counters * swap = before;
+        before    = now;
+        now       = swap;
+        before_ns = now_ns;
+    }
+    return NULL;
+}
+
+void stats_reporter_start(struct stats_reporter *      reporter,
+                          const struct stats_segment * segment,
+                          const u_int                  interval_s,
+                          FILE *                       out) {
+    reporter -> segment    = segment;
+    reporter -> interval_s = interval_s;
+    reporter -> out        = out;
+    start_thread(& reporter -> thread, stats_reporter_run, reporter);
+}
+
+#endif
@@ -0,0 +1,364 @@
+#ifndef __udp_trace__
+#define __udp_trace__
+
+#include <stdio.h>  // FILE, fopen(), fread(), fwrite(), fseek(), setvbuf()
+#include <stdlib.h> // malloc(), realloc(), free(), strtoul(), qsort()
+#include <string.h> // memset(), memcpy(), strrchr(), strspn(), strlen()
+#include <stdint.h> // uint8_t, uint16_t, uint32_t, uint64_t
+#include <endian.h> // htole64(), le64toh(), htole16(), le16toh(), be16toh()
+
+#include "udp_common.h" // u_int, u_ll, struct message, MAX_DATAGRAM_SIZE
+#include "udp_hist.h"   // latency_hist, hist_record(), hist_print_summary()
+
+/* a trace is the departure pattern of a run: a header and one record per
+   packet with its send time relative to the first packet, its payload
+   size and ToS; all fields little endian. Replaying a trace puts every
+   packet on its recorded deadline, a classic pcap file (not pcapng) can
+   stand in for a trace, its IPv4 UDP packets give the timing. */
+#define TRACE_MAGIC         (0x54504455) // "UDPT"
+#define TRACE_VERSION       (1)
+#define TRACE_WRITE_BUFFER  (1 << 20)
+
+struct trace_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint64_t start_ns;    // CLOCK_REALTIME of the first departure
+    uint64_t count;
+} __attribute__((packed));
+
+struct trace_record {
+    uint64_t offset_ns;   // since the first departure
+    uint16_t payload_size;
+    uint8_t  tos;
+    uint8_t  reserved;
+} __attribute__((packed));
+
+struct trace_writer {
+    FILE *              file;
+    char *              buffer;
+    struct trace_header header;
+    u_ll                first_ns;
+};
+
+/* a loaded trace and the timing error of its replay */
+struct trace {
+    struct trace_record * records;  // host byte order once loaded
+    u_ll                  count;
+    u_ll                  next;
+    u_ll                  skipped;  // pcap packets which are not IPv4 UDP
+    u_ll                  reordered; // pcap packets stamped before their predecessor
+    u_int                 max_payload;
+    u_ll                  last_departure;
+    struct latency_hist   departure_error; // departure - deadline
+    struct latency_hist   gap_error;       // |achieved - recorded gap|
+};
+
+bool trace_writer_open(struct trace_writer * w,
+                       const char *          file_name) {
+    memset(w, 0, sizeof(struct trace_writer));
+    w -> file   = fopen(file_name, "w");
+    w -> buffer = malloc(TRACE_WRITE_BUFFER);
+    if (! w -> file || ! w -> buffer) {
+        fprintf(stderr, "Cannot open trace %s.\n", file_name);
+        return FALSE;
+    }
+    setvbuf(w -> file, w -> buffer, _IOFBF, TRACE_WRITE_BUFFER);
+    w -> header.magic       = htole32(TRACE_MAGIC);
+    w -> header.version     = htole16(TRACE_VERSION);
+    w -> header.record_size = htole16(sizeof(struct trace_record));
+    fwrite(& w -> header, sizeof(struct trace_header), 1, w -> file);
+    return TRUE;
+}
+
+/* departure_ns on any clock, the trace only keeps the differences */
+static inline void trace_write(struct trace_writer * w,
+                               const u_ll            departure_ns,
+                               const u_int           payload_size,
+                               const int             tos) {
+    if (w -> header.count == 0) {
+        w -> first_ns        = departure_ns;
+        w -> header.start_ns = htole64(realtime_ns());
+    }
+    const struct trace_record record = {
+        htole64(departure_ns - w -> first_ns), htole16(payload_size), tos, 0
+    };
+    fwrite(& record, sizeof(record), 1, w -> file);
+    ++w -> header.count;
+}
+
+/* the count goes into the header last */
+void trace_writer_close(struct trace_writer * w) {
+    if (! w -> file)
+        return;
+    const u_ll count = w -> header.count;
+    w -> header.count = htole64(count);
+    fseek(w -> file, 0, SEEK_SET);
+    fwrite(& w -> header, sizeof(struct trace_header), 1, w -> file);
+    fclose(w -> file);
+    free(w -> buffer);
+    w -> file = NULL;
+}
+
+static bool trace_append(struct trace * t,
+                         const u_ll     offset_ns,
+                         const u_int    payload_size,
+                         const int      tos,
+                         u_ll *         capacity) {
+    if (t -> count == * capacity) {
+        * capacity = * capacity ? 2 * * capacity : 4096;
+        struct trace_record * records = realloc(t -> records,
+                                        * capacity * sizeof(struct trace_record));
+        if (! records) {
+            fprintf(stderr, "Error allocating %llu trace records.\n", * capacity);
+            return FALSE;
+        }
+        t -> records = records;
+    }
+    struct trace_record * record = & t -> records[t -> count++];
+    record -> offset_ns    = offset_ns;
+    record -> payload_size = payload_size;
+    record -> tos          = tos;
+    record -> reserved     = 0;
+    if (payload_size > t -> max_payload)
+        t -> max_payload = payload_size;
+    return TRUE;
+}
+
+static int trace_compare_offsets(const void * a,
+                                 const void * b) {
+    const u_ll x = ((const struct trace_record *) a) -> offset_ns;
+    const u_ll y = ((const struct trace_record *) b) -> offset_ns;
+    return x < y ? -1 : x > y;
+}
+
+/* classic pcap: 24 byte file header, 16 byte record headers */
+#define PCAP_MAGIC_US      (0xA1B2C3D4)
+#define PCAP_MAGIC_NS      (0xA1B23C4D)
+#define PCAP_LINK_NULL     (0)
+#define PCAP_LINK_ETHERNET (1)
+#define PCAP_LINK_RAW      (101)
+#define PCAP_LINK_SLL      (113)
+#define PCAP_LINK_SLL2     (276)
+
+static inline uint32_t pcap_u32(const uint32_t value,
+                                const bool     swap) {
+    return swap ? __builtin_bswap32(value) : value;
+}
+
+/* offset of the IPv4 header in a frame, -1 if there is none */
+static int pcap_ip_offset(const uint8_t * frame,
+                          const u_int     length,
+                          const u_int     link_type) {
+    u_int offset, protocol;
+    switch (link_type) {
+        case PCAP_LINK_NULL:
+            return length >= 4 ? 4 : -1; // the address family is checked below
+        case PCAP_LINK_RAW:
+            return 0;
+        case PCAP_LINK_ETHERNET:
+            offset = 12;
+            if (length < offset + 2)
+                return -1;
+            protocol = frame[offset] << 8 | frame[offset + 1];
+            while ((protocol == 0x8100 || protocol == 0x88A8) &&
+                   length >= offset + 6) {
+                offset  += 4; // VLAN tags
+                protocol = frame[offset] << 8 | frame[offset + 1];
+            }
+            return protocol == 0x0800 ? (int) offset + 2 : -1;
+        case PCAP_LINK_SLL:
+            if (length < 16)
+                return -1;
+            return (frame[14] << 8 | frame[15]) == 0x0800 ? 16 : -1;
+        case PCAP_LINK_SLL2:
+            if (length < 20)
+                return -1;
+            return (frame[0] << 8 | frame[1]) == 0x0800 ? 20 : -1;
+    }
+    return -1;
+}
+
+/* IPv4 UDP packets of a capture, to or from port if that is not 0; the
+   UDP length from the header counts, not the captured bytes */
+bool trace_load_pcap(struct trace * t,
+                     FILE *         file,
+                     const u_int    port) {
+    uint32_t header[6];
+    if (fread(header, sizeof(header), 1, file) != 1) {
+        fprintf(stderr, "Short pcap file header.\n");
+        return FALSE;
+    }
+    const bool swap = header[0] == __builtin_bswap32(PCAP_MAGIC_US) ||
+                      header[0] == __builtin_bswap32(PCAP_MAGIC_NS);
+    const bool nano = pcap_u32(header[0], swap) == PCAP_MAGIC_NS;
+    const u_int link_type = pcap_u32(header[5], swap) & 0xFFFF;
+
+    uint8_t * frame = malloc(DATAGRAM_BUFFER_SIZE);
+    if (! frame) {
+        fprintf(stderr, "Error allocating pcap frame buffer.\n");
+        return FALSE;
+    }
+    u_ll capacity = 0, last_ns = 0;
+    uint32_t record[4];
+    while (fread(record, sizeof(record), 1, file) == 1) {
+        const u_ll ts_ns = pcap_u32(record[0], swap) * (u_ll) 1E9 +
+                           pcap_u32(record[1], swap) * (nano ? 1 : 1000);
+        const u_int captured = pcap_u32(record[2], swap);
+        const u_int kept     = captured < DATAGRAM_BUFFER_SIZE ?
+                               captured : DATAGRAM_BUFFER_SIZE;
+        if (fread(frame, 1, kept, file) != kept ||
+            fseek(file, captured - kept, SEEK_CUR) != 0)
+            break;
+
+        /* IPv4, UDP, not a later fragment, and the port if asked */
+        const int ip = pcap_ip_offset(frame, kept, link_type);
+        const u_int ihl = ip >= 0 && kept >= (u_int) ip + 20 ?
+                          (frame[ip] & 0x0F) * 4 : 0;
+        if (ip < 0 || ihl < 20 || (frame[ip] >> 4) != 4 || frame[ip + 9] != 17 ||
+            (((frame[ip + 6] << 8) | frame[ip + 7]) & 0x1FFF) != 0 ||
+            kept < ip + ihl + 8) {
+            ++t -> skipped;
+            continue;
+        }
+        const uint8_t * udp = frame + ip + ihl;
+        if (port && (u_int) (udp[0] << 8 | udp[1]) != port &&
+                    (u_int) (udp[2] << 8 | udp[3]) != port) {
+            ++t -> skipped;
+            continue;
+        }
+        const u_int datagram = (udp[4] << 8 | udp[5]) > 8 ?
+                               (udp[4] << 8 | udp[5]) - 8 : 0;
+        u_int payload = datagram > sizeof(struct message) ?
+                        datagram - sizeof(struct message) : 0;
+        if (payload > MAX_DATAGRAM_SIZE - sizeof(struct message))
+            payload = MAX_DATAGRAM_SIZE - sizeof(struct message);
+        if (t -> count && ts_ns < last_ns)
+            ++t -> reordered;
+        last_ns = ts_ns;
+        if (! trace_append(t, ts_ns, payload, frame[ip + 1] >> 2, & capacity))
+            break;
+    }
+    free(frame);
+
+    /* captures of several queues are not in time order, the replay
+       needs them to be; then count from the first departure */
+    if (t -> reordered)
+        qsort(t -> records, t -> count, sizeof(struct trace_record),
+              trace_compare_offsets);
+    u_ll i;
+    for (i = t -> count; i-- > 0;)
+        t -> records[i].offset_ns -= t -> records[0].offset_ns;
+    return t -> count > 0;
+}
+
+/* our own traces or a pcap file, <file>[:<udp port>] filters the latter */
+bool trace_load(struct trace * t,
+                const char *   spec) {
+    memset(t, 0, sizeof(struct trace));
+    hist_init(& t -> departure_error);
+    hist_init(& t -> gap_error);
+
+    char name[256];
+    snprintf(name, sizeof(name), "%s", spec);
+    u_int port = 0;
+    char * colon = strrchr(name, ':');
+    if (colon && colon[1] && strspn(colon + 1, "0123456789") == strlen(colon + 1)) {
+        port   = strtoul(colon + 1, NULL, 10);
+        * colon = '\0';
+    }
+    FILE * file = fopen(name, "r");
+    if (! file) {
+        fprintf(stderr, "Cannot open trace %s.\n", name);
+        return FALSE;
+    }
+
+    uint32_t magic = 0;
+    bool loaded = FALSE;
+    if (fread(& magic, sizeof(magic), 1, file) == 1)
+        rewind(file);
+    if (le32toh(magic) == TRACE_MAGIC) {
+        struct trace_header header;
+        if (fread(& header, sizeof(header), 1, file) == 1 &&
+            le16toh(header.record_size) == sizeof(struct trace_record)) {
+            t -> count   = le64toh(header.count);
+            t -> records = malloc((t -> count ? t -> count : 1) *
+                                  sizeof(struct trace_record));
+            if (t -> records &&
+                fread(t -> records, sizeof(struct trace_record), t -> count,
+                      file) == t -> count) {
+                u_ll i;
+                for (i = 0; i < t -> count; ++i) {
+                    struct trace_record * record = & t -> records[i];
+                    record -> offset_ns    = le64toh(record -> offset_ns);
+                    record -> payload_size = le16toh(record -> payload_size);
+                    if (record -> payload_size > t -> max_payload)
+                        t -> max_payload = record -> payload_size;
+                }
+                loaded = t -> count > 0;
+            }
+        }
+        if (! loaded)
+            fprintf(stderr, "Trace %s is truncated or empty.\n", name);
+    }
+    else if (magic == PCAP_MAGIC_US || magic == PCAP_MAGIC_NS ||
+             magic == __builtin_bswap32(PCAP_MAGIC_US) ||
+             magic == __builtin_bswap32(PCAP_MAGIC_NS)) {
+        loaded = trace_load_pcap(t, file, port);
+        if (! loaded)
+            fprintf(stderr, "No IPv4 UDP packets in %s.\n", name);
+    }
+    else
+        fprintf(stderr, "%s is neither a trace nor a pcap file (pcapng needs "
+                        "converting, e.g. editcap -F pcap).\n", name);
+    fclose(file);
+    return loaded;
+}
+
+/* gap to the next departure and what to send; FALSE at the end */
+static inline bool trace_next(struct trace * t,
+                              u_ll *         gap_ns,
+                              u_int *        payload_size,
+                              int *          tos) {
+    if (t -> next >= t -> count)
+        return FALSE;
+    const struct trace_record * record = & t -> records[t -> next];
+    * gap_ns       = t -> next ? record -> offset_ns -
+                                 t -> records[t -> next - 1].offset_ns : 0;
+    * payload_size = record -> payload_size;
+    * tos          = record -> tos;
+    ++t -> next;
+    return TRUE;
+}
+
+/* how far the departure missed its deadline and the recorded gap */
+static inline void trace_record_departure(struct trace * t,
+                                          const u_ll     departure_ns,
+                                          const u_ll     deadline_ns) {
+    hist_record(& t -> departure_error, departure_ns > deadline_ns ?
+                                        departure_ns - deadline_ns : 0);
+    if (t -> next > 1) {
+        const u_ll gap      = departure_ns - t -> last_departure;
+        const u_ll recorded = t -> records[t -> next - 1].offset_ns -
+                              t -> records[t -> next - 2].offset_ns;
+        hist_record(& t -> gap_error, gap > recorded ? gap - recorded
+                                                     : recorded - gap);
+    }
+    t -> last_departure = departure_ns;
+}
+
+void trace_print_summary(const struct trace * t,
+                         FILE *               out) {
+    fprintf(out, "Replay: %llu of %llu packets over %.3f s", t -> next, t -> count,
+            t -> count ? t -> records[t -> count - 1].offset_ns / 1E9 : 0.0);
+    if (t -> skipped)
+        fprintf(out, " (%llu capture packets skipped)", t -> skipped);
+    if (t -> reordered)
+        fprintf(out, " (%llu capture packets out of time order, sorted)",
+                t -> reordered);
+    fprintf(out, "\n");
+    hist_print_summary(& t -> departure_error, "Departure error", out);
+    hist_print_summary(& t -> gap_error, "Gap error", out);
+}
+
+#endif
@@ -0,0 +1,286 @@
+#ifndef __udp_traffic__
+#define __udp_traffic__
+
+#include <stdio.h>  // FILE, fopen(), fgets(), sscanf(), fprintf()
+#include <stdlib.h> // strtod(), strtoul()
+#include <string.h> // memset(), strncmp(), strchr()
+#include <math.h>   // log(), llround()
+
+#include "udp_common.h" // u_int, u_ll
+
+/* a traffic profile is a list of phases; each phase has its own arrival
+   process, a rate which may change linearly over the phase, a payload
+   size and a ToS code */
+#define MAX_PHASES         (64)
+#define RAMP_SEGMENTS      (10)   // a linear ramp is reported in 10 phases
+
+enum arrival_kind {
+    ARRIVAL_CONSTANT,
+    ARRIVAL_POISSON,
+    ARRIVAL_BURST   // burst_len packets at the phase rate, then burst_off_ns
+};
+
+struct traffic_phase {
+    u_ll              duration_ns;  // 0: until the end of the run
+    double            rate_from;    // packets per second, 0: unlimited,
+                                    // or a pause if the phase has a duration
+    double            rate_to;
+    enum arrival_kind arrival;
+    u_ll              burst_len;
+    u_ll              burst_off_ns;
+    u_int             payload_size;
+    int               tos;
+};
+
+struct traffic_profile {
+    struct traffic_phase phases[MAX_PHASES];
+    u_int                phase_count;
+
+    /* schedule state, on a virtual time line starting at the first packet */
+    bool                 started;
+    u_int                phase;
+    u_ll                 phase_start_ns;
+    u_ll                 schedule_ns;
+    u_ll                 burst_left;
+    u_ll                 rng;
+};
+
+/* xorshift64*, uniform in (0, 1] */
+static inline double profile_uniform(struct traffic_profile * profile) {
+    profile -> rng ^= profile -> rng >> 12;
+    profile -> rng ^= profile -> rng << 25;
+    profile -> rng ^= profile -> rng >> 27;
+    const u_ll r = profile -> rng * 0x2545F4914F6CDD1DULL;
+    return ((r >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+struct traffic_phase * profile_add_phase(struct traffic_profile * profile,
+                                         const u_ll               duration_ns,
+                                         const double             rate_from,
+                                         const double             rate_to,
+                                         const u_int              payload_size,
+                                         const int                tos) {
+    if (profile -> phase_count >= MAX_PHASES) {
+        fprintf(stderr, "Traffic profile has more than %u phases.\n", MAX_PHASES);
+        return NULL;
+    }
+    struct traffic_phase * phase = & profile -> phases[profile -> phase_count++];
+    memset(phase, 0, sizeof(struct traffic_phase));
+    phase -> duration_ns  = duration_ns;
+    phase -> rate_from    = rate_from;
+    phase -> rate_to      = rate_to;
+    phase -> arrival      = ARRIVAL_CONSTANT;
+    phase -> payload_size = payload_size;
+    phase -> tos          = tos;
+    return phase;
+}
+
+/* phases of a schedule file, one per line:
+   <duration s> <rate pps> [<payload size> [<ToS> [const|poisson]]]
+   a rate of 0 pauses for the duration */
+bool profile_load_schedule(struct traffic_profile * profile,
+                           const char *             file_name,
+                           const u_int              payload_size,
+                           const int                tos) {
+    FILE * file = fopen(file_name, "r");
+    if (! file) {
+        fprintf(stderr, "Cannot open schedule file %s.\n", file_name);
+        return FALSE;
+    }
+    char line[256];
+    u_int line_nr = 0;
+    bool  ok      = TRUE;
+    while (ok && fgets(line, sizeof(line), file)) {
+        ++line_nr;
+        char * comment = strchr(line, '#');
+        if (comment)
+            * comment = '\0';
+
+        double duration, rate;
+        u_int  phase_payload = payload_size;
+        int    phase_tos     = tos;
+        char   arrival[16]   = "const";
+        const int fields = sscanf(line, "%lf %lf %u %d %15s", & duration, & rate,
+                                  & phase_payload, & phase_tos, arrival);
+        if (fields <= 0)
+            continue;
+        if (fields < 2 || duration < 0 || rate < 0) {
+            fprintf(stderr, "%s:%u: expected <duration s> <rate pps> "
+                            "[<payload> [<ToS> [const|poisson]]].\n",
+                    file_name, line_nr);
+            ok = FALSE;
+            break;
+        }
+        struct traffic_phase * phase =
+            profile_add_phase(profile, (u_ll) (duration * 1E9), rate, rate,
+                              phase_payload, phase_tos);
+        if (! phase)
+            ok = FALSE;
+        else if (strcmp(arrival, "poisson") == 0)
+            phase -> arrival = ARRIVAL_POISSON;
+        else if (strcmp(arrival, "const") != 0) {
+            fprintf(stderr, "%s:%u: unknown arrival process %s.\n",
+                    file_name, line_nr, arrival);
+            ok = FALSE;
+        }
+    }
+    fclose(file);
+    if (ok && profile -> phase_count == 0) {
+        fprintf(stderr, "Schedule file %s has no phases.\n", file_name);
+        ok = FALSE;
+    }
+    return ok;
+}
+
+/* parse a -R specification:
+     const:<pps>
+     poisson:<pps>
+     burst:<pps>:<packets>:<off ms>
+     ramp:<from pps>:<to pps>:<s>
+     step:<from pps>:<to pps>:<step pps>:<step s>
+     file:<schedule file> */
+bool profile_parse(struct traffic_profile * profile,
+                   const char *             spec,
+                   const u_int              payload_size,
+                   const int                tos) {
+    memset(profile, 0, sizeof(struct traffic_profile));
+    profile -> rng = 0x9E3779B97F4A7C15ULL;
+
+    double a = 0, b = 0, c = 0, d = 0;
+    struct traffic_phase * phase;
+    if (strncmp(spec, "file:", 5) == 0)
+        return profile_load_schedule(profile, spec + 5, payload_size, tos);
+    if (sscanf(spec, "const:%lf", & a) == 1 && a >= 0) {
+        profile_add_phase(profile, 0, a, a, payload_size, tos);
+        return TRUE;
+    }
+    if (sscanf(spec, "poisson:%lf", & a) == 1 && a > 0) {
+        phase = profile_add_phase(profile, 0, a, a, payload_size, tos);
+        phase -> arrival = ARRIVAL_POISSON;
+        return TRUE;
+    }
+    if (sscanf(spec, "burst:%lf:%lf:%lf", & a, & b, & c) == 3 &&
+        a >= 0 && b >= 1 && c >= 0) {
+        phase = profile_add_phase(profile, 0, a, a, payload_size, tos);
+        phase -> arrival      = ARRIVAL_BURST;
+        phase -> burst_len    = (u_ll) b;
+        phase -> burst_off_ns = (u_ll) (c * 1E6);
+        return TRUE;
+    }
+    if (sscanf(spec, "ramp:%lf:%lf:%lf", & a, & b, & c) == 3 &&
+        a > 0 && b > 0 && c > 0) {
+        u_int i;
+        for (i = 0; i < RAMP_SEGMENTS; ++i)
+            profile_add_phase(profile, (u_ll) (c * 1E9 / RAMP_SEGMENTS),
+                              a + (b - a) * i / RAMP_SEGMENTS,
+                              a + (b - a) * (i + 1) / RAMP_SEGMENTS,
+                              payload_size, tos);
+        return TRUE;
+    }
+    if (sscanf(spec, "step:%lf:%lf:%lf:%lf", & a, & b, & c, & d) == 4 &&
+        a > 0 && b > 0 && c > 0 && d > 0) {
+        const double direction = b >= a ? 1 : -1;
+        double rate;
+        for (rate = a; (rate - b) * direction <= 1E-9; rate += c * direction)
+            if (! profile_add_phase(profile, (u_ll) (d * 1E9), rate, rate,
+                                    payload_size, tos))
+                return FALSE;
+        return TRUE;
+    }
+    fprintf(stderr, "Invalid traffic profile: %s\n", spec);
+    return FALSE;
+}
+
+/* the classic fixed interval stream */
+void profile_constant(struct traffic_profile * profile,
+                      const u_ll               interval_ns,
+                      const u_int              payload_size,
+                      const int                tos) {
+    memset(profile, 0, sizeof(struct traffic_profile));
+    profile_add_phase(profile, 0, interval_ns ? 1E9 / interval_ns : 0,
+                      interval_ns ? 1E9 / interval_ns : 0, payload_size, tos);
+}
+
+static inline double profile_rate(const struct traffic_phase * phase,
+                                  const u_ll                   offset_ns) {
+    if (phase -> duration_ns == 0 || phase -> rate_from == phase -> rate_to)
+        return phase -> rate_from;
+    return phase -> rate_from + (phase -> rate_to - phase -> rate_from) *
+                                (double) offset_ns / phase -> duration_ns;
+}
+
+/* a phase with a duration but no rate sends nothing */
+static inline bool profile_silent(const struct traffic_phase * phase) {
+    return phase -> duration_ns && phase -> rate_from <= 0 &&
+           phase -> rate_to <= 0;
+}
+
+/* move the schedule over the pauses from the current phase on; FALSE
+   if no phase which sends is left */
+static bool profile_skip_silent(struct traffic_profile * profile) {
+    while (profile -> phase < profile -> phase_count &&
+           profile_silent(& profile -> phases[profile -> phase])) {
+        profile -> phase_start_ns += profile -> phases[profile -> phase].duration_ns;
+        ++profile -> phase;
+    }
+    return profile -> phase < profile -> phase_count;
+}
+
+/* gap between the previous and the next packet and the phase the next
+   packet belongs to; FALSE once the last phase is over */
+bool profile_next(struct traffic_profile * profile,
+                  u_ll *                   gap_ns,
+                  u_int *                  phase_index) {
+    if (! profile -> started) {
+        profile -> started = TRUE;
+        if (! profile_skip_silent(profile))
+            return FALSE;
+        profile -> burst_left  = profile -> phases[profile -> phase].burst_len;
+        profile -> schedule_ns = profile -> phase_start_ns;
+        * gap_ns      = profile -> schedule_ns;
+        * phase_index = profile -> phase;
+        return TRUE;
+    }
+    struct traffic_phase * phase = & profile -> phases[profile -> phase];
+
+    /* gap according to the arrival process at the current rate */
+    const double rate = profile_rate(phase, profile -> schedule_ns -
+                                            profile -> phase_start_ns);
+    u_ll gap = 0;
+    if (rate > 0) {
+        switch (phase -> arrival) {
+            case ARRIVAL_CONSTANT:
+                gap = llround(1E9 / rate);
+                break;
+            case ARRIVAL_POISSON:
+                gap = llround(- log(profile_uniform(profile)) * 1E9 / rate);
+                break;
+            case ARRIVAL_BURST:
+                gap = llround(1E9 / rate);
+                break;
+        }
+    }
+    if (phase -> arrival == ARRIVAL_BURST && --profile -> burst_left == 0) {
+        gap += phase -> burst_off_ns;
+        profile -> burst_left = phase -> burst_len;
+    }
+
+    /* a packet beyond the end of the phase opens the next one */
+    u_ll next_ns = profile -> schedule_ns + gap;
+    while (phase -> duration_ns &&
+           next_ns >= profile -> phase_start_ns + phase -> duration_ns) {
+        profile -> phase_start_ns += phase -> duration_ns;
+        ++profile -> phase;
+        if (! profile_skip_silent(profile))
+            return FALSE;
+        phase = & profile -> phases[profile -> phase];
+        profile -> burst_left = phase -> burst_len;
+        next_ns = profile -> phase_start_ns;
+    }
+    * gap_ns      = next_ns - profile -> schedule_ns;
+    * phase_index = profile -> phase;
+    profile -> schedule_ns = next_ns;
+    return TRUE;
+}
+
+#endif
@@ -0,0 +1,540 @@
+#ifndef __udp_transport__
+#define __udp_transport__
+
+#include <stdlib.h>   // EXIT_FAILURE, exit(), calloc(), free()
+#include <stdio.h>    // fprintf(), stderr
+#include <string.h>   // memset(), memcpy(), strcmp()
+#include <errno.h>    // errno, ENOBUFS, ETIME, EINTR, EAGAIN
+#include <unistd.h>   // syscall(), close()
+
+#include <sys/mman.h>       // mmap(), munmap()
+#include <sys/socket.h>     // msghdr, sendto(), recvfrom()
+#include <sys/syscall.h>    // __NR_io_uring_setup, __NR_io_uring_enter, ...
+#include <sys/uio.h>        // iovec
+#include <linux/io_uring.h> // io_uring_params, io_uring_sqe, io_uring_cqe, ...
+
+#include "udp_common.h" // u_int, u_ll, BUFFER_SIZE
+
+/* a transport moves datagrams between one socket and the packet loops;
+   the syscall backend is the classic blocking recvfrom()/sendto(), the
+   io_uring backend keeps a multishot recvmsg armed on a provided buffer
+   ring and batches sends until transport_flush() */
+#define URING_BUFFER_COUNT  (1024) // provided receive buffers, power of two
+#define URING_SEND_SLOTS    (256)  // sends in flight
+#define URING_BUFFER_SIZE   (BUFFER_SIZE + sizeof(struct io_uring_recvmsg_out) \
+                             + sizeof(struct sockaddr_in))
+#define URING_TAG_RECV      (0ULL)
+#define URING_TAG_SEND      (1ULL << 32)
+#define URING_BUFFER_GROUP  (0)
+
+enum transport_kind {
+    TRANSPORT_SYSCALL,
+    TRANSPORT_URING
+};
+
+struct transport_packet {
+    char *             data;
+    u_int              length;
+    struct sockaddr_in addr;
+    int                buffer_id; // io_uring: provided buffer behind data
+};
+
+/* a send stays here until its completion arrives */
+struct uring_send_slot {
+    struct msghdr      msg;
+    struct iovec       iov;
+    struct sockaddr_in addr;
+    int                buffer_id; // echoed receive buffer, -1 for copies
+    char *             copy;
+};
+
+struct uring {
+    int                       fd;
+    bool                      sqpoll;
+
+    /* submission queue */
+    u_int *                   sq_head;
+    u_int *                   sq_tail;
+    u_int *                   sq_flags;
+    u_int *                   sq_array;
+    u_int                     sq_mask;
+    u_int                     sq_entries;
+    u_int                     sqe_tail;  // filled in, published by uring_submit()
+    u_int                     to_submit;
+    struct io_uring_sqe *     sqes;
+
+    /* completion queue */
+    u_int *                   cq_head;
+    u_int *                   cq_tail;
+    u_int                     cq_mask;
+    struct io_uring_cqe *     cqes;
+
+    /* mappings */
+    void *                    sq_ring;
+    size_t                    sq_ring_size;
+    void *                    cq_ring;
+    size_t                    cq_ring_size;
+    size_t                    sqes_size;
+
+    /* provided receive buffers */
+    struct io_uring_buf_ring * buf_ring;
+    size_t                    buf_ring_size;
+    char *                    buffers;
+    u_int                     buf_tail;
+    struct msghdr             recv_msg; // template of the multishot recvmsg
+    bool                      recv_armed;
+
+    /* received packets waiting for transport_recv() */
+    struct transport_packet * ready;
+    u_int                     ready_head;
+    u_int                     ready_tail;
+    u_ll                      truncated; // larger than a buffer, dropped
+
+    /* sends */
+    struct uring_send_slot *  slots;
+    u_int *                   free_slots;
+    u_int                     free_count;
+};
+
+struct transport {
+    enum transport_kind kind;
+    int                 socket;
+    char *              buffer;  // syscall backend receive buffer
+    struct uring        ring;
+};
+
+bool transport_parse_kind(const char *          name,
+                          enum transport_kind * kind) {
+    if (strcmp(name, "syscall") == 0)
+        * kind = TRANSPORT_SYSCALL;
+    else if (strcmp(name, "uring") == 0)
+        * kind = TRANSPORT_URING;
+    else
+        return FALSE;
+    return TRUE;
+}
+
+const char * transport_kind_name(const enum transport_kind kind) {
+    return kind == TRANSPORT_URING ? "io_uring" : "syscall";
+}
+
+/* raw system calls, liburing is not needed */
+static inline int uring_enter(const int    fd,
+                              const u_int  to_submit,
+                              const u_int  min_complete,
+                              const u_int  flags,
+                              const void * arg,
+                              const size_t arg_size) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                   flags, arg, arg_size);
+}
+
+/* a zeroed SQE for the caller to fill in; the kernel (or its SQPOLL
+   thread) only sees it once uring_submit() moves the shared tail */
+static inline struct io_uring_sqe * uring_get_sqe(struct uring * ring) {
+    const u_int head = __atomic_load_n(ring -> sq_head, __ATOMIC_ACQUIRE);
+    const u_int tail = ring -> sqe_tail;
+    if (tail - head >= ring -> sq_entries)
+        return NULL;
+    const u_int index = tail & ring -> sq_mask;
+    struct io_uring_sqe * sqe = & ring -> sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring -> sq_array[index] = index;
+    ring -> sqe_tail = tail + 1;
+    ++ring -> to_submit;
+    return sqe;
+}
+
+/* hand the queued SQEs to the kernel and optionally wait for completions;
+   returns -errno of io_uring_enter() or 0 */
+int uring_submit(struct uring *   ring,
+                 const u_int      wait_nr,
+                 const u_ll       timeout_ns) {
+    /* publish the SQEs filled in since the last call */
+    __atomic_store_n(ring -> sq_tail, ring -> sqe_tail, __ATOMIC_RELEASE);
+    u_int flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    u_int to_submit = ring -> to_submit;
+    if (ring -> sqpoll) {
+        /* the kernel thread picks up the SQEs by itself unless asleep */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(ring -> sq_flags, __ATOMIC_RELAXED) &
+            IORING_SQ_NEED_WAKEUP)
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        to_submit = 0;
+        ring -> to_submit = 0;
+        if (! flags)
+            return 0;
+    }
+    else if (! to_submit && ! wait_nr)
+        return 0;
+
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    const void * arg_ptr  = NULL;
+    size_t       arg_size = 0;
+    if (wait_nr && timeout_ns) {
+        ts.tv_sec  = timeout_ns / (u_ll) 1E9;
+        ts.tv_nsec = timeout_ns % (u_ll) 1E9;
+        memset(& arg, 0, sizeof(arg));
+        arg.ts   = (u_ll) (unsigned long) & ts;
+        flags   |= IORING_ENTER_EXT_ARG;
+        arg_ptr  = & arg;
+        arg_size = sizeof(arg);
+    }
+    const int rc = uring_enter(ring -> fd, to_submit, wait_nr, flags,
+                               arg_ptr, arg_size);
+    if (rc < 0)
+        return -errno;
+    if (! ring -> sqpoll)
+        ring -> to_submit -= rc < (int) to_submit ? (u_int) rc : to_submit;
+    return 0;
+}
+
+/* give a receive buffer back to the kernel */
+static inline void uring_recycle_buffer(struct uring * ring,
+                                        const int      buffer_id) {
+    struct io_uring_buf * buf =
+        & ring -> buf_ring -> bufs[ring -> buf_tail & (URING_BUFFER_COUNT - 1)];
+    buf -> addr = (u_ll) (unsigned long)
+                  (ring -> buffers + (size_t) buffer_id * URING_BUFFER_SIZE);
+    buf -> len  = URING_BUFFER_SIZE;
+    buf -> bid  = buffer_id;
+    __atomic_store_n(& ring -> buf_ring -> tail, ++ring -> buf_tail,
+                     __ATOMIC_RELEASE);
+}
+
+/* (re)arm the multishot recvmsg, it stops when the buffers run out */
+static inline void uring_arm_recv(struct uring * ring,
+                                  const int      socket) {
+    struct io_uring_sqe * sqe = uring_get_sqe(ring);
+    if (! sqe)
+        return;
+    sqe -> opcode    = IORING_OP_RECVMSG;
+    sqe -> fd        = socket;
+    sqe -> addr      = (u_ll) (unsigned long) & ring -> recv_msg;
+    sqe -> ioprio    = IORING_RECV_MULTISHOT;
+    sqe -> flags     = IOSQE_BUFFER_SELECT;
+    sqe -> buf_group = URING_BUFFER_GROUP;
+    sqe -> user_data = URING_TAG_RECV;
+    ring -> recv_armed = TRUE;
+}
+
+/* process all completions which are there */
+void uring_reap(struct uring * ring) {
+    u_int head = * ring -> cq_head;
+    const u_int tail = __atomic_load_n(ring -> cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        const struct io_uring_cqe * cqe = & ring -> cqes[head & ring -> cq_mask];
+
+        if (cqe -> user_data & URING_TAG_SEND) {
+            /* send done, free its slot and the echoed buffer */
+            const u_int slot_id = cqe -> user_data & 0xFFFFFFFF;
+            struct uring_send_slot * slot = & ring -> slots[slot_id];
+            if (cqe -> res < 0)
+                fprintf(stderr, "Error sending packet to %s\n",
+                        inet_ntoa(slot -> addr.sin_addr));
+            if (slot -> buffer_id >= 0)
+                uring_recycle_buffer(ring, slot -> buffer_id);
+            ring -> free_slots[ring -> free_count++] = slot_id;
+            continue;
+        }
+
+        if (! (cqe -> flags & IORING_CQE_F_MORE))
+            ring -> recv_armed = FALSE;
+        if (cqe -> res < 0) {
+            if (cqe -> res != -ENOBUFS)
+                fprintf(stderr, "Error on io_uring receive: %s\n",
+                        strerror(- cqe -> res));
+            continue;
+        }
+        if (! (cqe -> flags & IORING_CQE_F_BUFFER))
+            continue;
+
+        /* unpack header, peer address and payload of the buffer */
+        const int buffer_id = cqe -> flags >> IORING_CQE_BUFFER_SHIFT;
+        char * buffer = ring -> buffers + (size_t) buffer_id * URING_BUFFER_SIZE;
+        const struct io_uring_recvmsg_out * out =
+            (const struct io_uring_recvmsg_out *) buffer;
+        /* payloadlen is the datagram's full length, only BUFFER_SIZE bytes
+           of it made it into the buffer */
+        if (out -> flags & MSG_TRUNC) {
+            ++ring -> truncated;
+            uring_recycle_buffer(ring, buffer_id);
+            continue;
+        }
+        struct transport_packet * packet =
+            & ring -> ready[ring -> ready_tail++ & (URING_BUFFER_COUNT - 1)];
+        packet -> buffer_id = buffer_id;
+        packet -> data      = buffer + sizeof(struct io_uring_recvmsg_out) +
+                              ring -> recv_msg.msg_namelen +
+                              ring -> recv_msg.msg_controllen;
+        packet -> length    = out -> payloadlen;
+        memcpy(& packet -> addr, buffer + sizeof(struct io_uring_recvmsg_out),
+               sizeof(struct sockaddr_in));
+    }
+    __atomic_store_n(ring -> cq_head, head, __ATOMIC_RELEASE);
+}
+
+void uring_open(struct uring * ring,
+                const int      socket,
+                const bool     receive,
+                const bool     sqpoll) {
+    memset(ring, 0, sizeof(struct uring));
+    struct io_uring_params params;
+    memset(& params, 0, sizeof(params));
+    if (sqpoll) {
+        params.flags          = IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = 1000; // ms
+    }
+    ring -> sqpoll = sqpoll;
+    ring -> fd = syscall(__NR_io_uring_setup, 2 * URING_SEND_SLOTS, & params);
+    if (ring -> fd < 0) {
+        fprintf(stderr, "Error setting up io_uring: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    /* map the rings */
+    ring -> sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(u_int);
+    ring -> cq_ring_size = params.cq_off.cqes +
+                           params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring -> cq_ring_size > ring -> sq_ring_size)
+            ring -> sq_ring_size = ring -> cq_ring_size;
+        ring -> cq_ring_size = ring -> sq_ring_size;
+    }
+    ring -> sq_ring = mmap(NULL, ring -> sq_ring_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring -> fd, IORING_OFF_SQ_RING);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring -> cq_ring = ring -> sq_ring;
+    else
+        ring -> cq_ring = mmap(NULL, ring -> cq_ring_size, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, ring -> fd,
+                               IORING_OFF_CQ_RING);
+    ring -> sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring -> sqes = mmap(NULL, ring -> sqes_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring -> fd, IORING_OFF_SQES);
+    if (ring -> sq_ring == MAP_FAILED || ring -> cq_ring == MAP_FAILED ||
+        ring -> sqes == MAP_FAILED) {
+        fprintf(stderr, "Error mapping io_uring.\n");
+        exit(EXIT_FAILURE);
+    }
+    char * sq = ring -> sq_ring;
+    char * cq = ring -> cq_ring;
+    ring -> sq_head    = (u_int *) (sq + params.sq_off.head);
+    ring -> sq_tail    = (u_int *) (sq + params.sq_off.tail);
+    ring -> sq_flags   = (u_int *) (sq + params.sq_off.flags);
+    ring -> sq_array   = (u_int *) (sq + params.sq_off.array);
+    ring -> sq_mask    = * (u_int *) (sq + params.sq_off.ring_mask);
+    ring -> sq_entries = params.sq_entries;
+    ring -> sqe_tail   = * ring -> sq_tail;
+    ring -> cq_head    = (u_int *) (cq + params.cq_off.head);
+    ring -> cq_tail    = (u_int *) (cq + params.cq_off.tail);
+    ring -> cq_mask    = * (u_int *) (cq + params.cq_off.ring_mask);
+    ring -> cqes       = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    /* provided buffer ring */
+    ring -> buf_ring_size = URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+    ring -> buf_ring = mmap(NULL, ring -> buf_ring_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    ring -> buffers  = malloc((size_t) URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+    ring -> ready    = calloc(URING_BUFFER_COUNT, sizeof(struct transport_packet));
+    ring -> slots    = calloc(URING_SEND_SLOTS, sizeof(struct uring_send_slot));
+    ring -> free_slots = calloc(URING_SEND_SLOTS, sizeof(u_int));
+    if (ring -> buf_ring == MAP_FAILED || ! ring -> buffers || ! ring -> ready ||
+        ! ring -> slots || ! ring -> free_slots) {
+        fprintf(stderr, "Error allocating io_uring buffers.\n");
+        exit(EXIT_FAILURE);
+    }
+    struct io_uring_buf_reg reg;
+    memset(& reg, 0, sizeof(reg));
+    reg.ring_addr    = (u_ll) (unsigned long) ring -> buf_ring;
+    reg.ring_entries = URING_BUFFER_COUNT;
+    reg.bgid         = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, ring -> fd, IORING_REGISTER_PBUF_RING,
+                & reg, 1) < 0) {
+        fprintf(stderr, "Error registering io_uring buffer ring "
+                        "(needs Linux 6.0): %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    int i;
+    for (i = 0; i < URING_BUFFER_COUNT; ++i)
+        uring_recycle_buffer(ring, i);
+
+    /* send slots */
+    for (i = 0; i < URING_SEND_SLOTS; ++i) {
+        struct uring_send_slot * slot = & ring -> slots[i];
+        slot -> copy            = malloc(BUFFER_SIZE);
+        if (! slot -> copy) {
+            fprintf(stderr, "Error allocating io_uring send buffers.\n");
+            exit(EXIT_FAILURE);
+        }
+        slot -> msg.msg_name    = & slot -> addr;
+        slot -> msg.msg_namelen = sizeof(struct sockaddr_in);
+        slot -> msg.msg_iov     = & slot -> iov;
+        slot -> msg.msg_iovlen  = 1;
+        ring -> free_slots[ring -> free_count++] = URING_SEND_SLOTS - 1 - i;
+    }
+
+    /* the peer address is all we want next to the payload */
+    ring -> recv_msg.msg_namelen = sizeof(struct sockaddr_in);
+    if (receive)
+        uring_arm_recv(ring, socket);
+}
+
+void uring_close(struct uring * ring) {
+    int i;
+    for (i = 0; ring -> slots && i < URING_SEND_SLOTS; ++i)
+        free(ring -> slots[i].copy);
+    free(ring -> slots);
+    free(ring -> free_slots);
+    free(ring -> ready);
+    free(ring -> buffers);
+    munmap(ring -> buf_ring, ring -> buf_ring_size);
+    munmap(ring -> sqes, ring -> sqes_size);
+    if (ring -> cq_ring != ring -> sq_ring)
+        munmap(ring -> cq_ring, ring -> cq_ring_size);
+    munmap(ring -> sq_ring, ring -> sq_ring_size);
+    close(ring -> fd);
+}
+
+/* queue a sendmsg; waits for a free slot if all are in flight */
+static inline struct uring_send_slot * uring_queue_send(struct transport * t,
+                                        const struct sockaddr_in * addr) {
+    struct uring * ring = & t -> ring;
+    while (ring -> free_count == 0) {
+        uring_submit(ring, 1, 0);
+        uring_reap(ring);
+    }
+    struct io_uring_sqe * sqe;
+    while (! (sqe = uring_get_sqe(ring))) {
+        uring_submit(ring, 0, 0);
+        uring_reap(ring);
+    }
+    const u_int slot_id = ring -> free_slots[--ring -> free_count];
+    struct uring_send_slot * slot = & ring -> slots[slot_id];
+    slot -> addr      = * addr;
+    sqe -> opcode     = IORING_OP_SENDMSG;
+    sqe -> fd         = t -> socket;
+    sqe -> addr       = (u_ll) (unsigned long) & slot -> msg;
+    sqe -> user_data  = URING_TAG_SEND | slot_id;
+    return slot;
+}
+
+/* a send-only transport never receives, so that another one (on another
+   thread) can own the receive side of the same socket */
+void transport_open(struct transport *        t,
+                    const enum transport_kind kind,
+                    const int                 socket,
+                    const bool                receive,
+                    const bool                sqpoll) {
+    memset(t, 0, sizeof(struct transport));
+    t -> kind   = kind;
+    t -> socket = socket;
+    if (kind == TRANSPORT_URING)
+        uring_open(& t -> ring, socket, receive, sqpoll);
+    else if (! (t -> buffer = malloc(DATAGRAM_BUFFER_SIZE))) {
+        fprintf(stderr, "Error allocating transport buffer.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void transport_close(struct transport * t) {
+    if (t -> kind == TRANSPORT_URING)
+        uring_close(& t -> ring);
+    else
+        free(t -> buffer);
+}
+
+/* wait for at least one packet (timeout_ns 0: no limit, the syscall
+   backend uses the socket timeout instead); returns the number of
+   packets or -1 on error or timeout */
+int transport_recv(struct transport *        t,
+                   struct transport_packet * packets,
+                   const int                 max_packets,
+                   const u_ll                timeout_ns) {
+    if (t -> kind == TRANSPORT_SYSCALL) {
+        socklen_t addr_size = sizeof(struct sockaddr_in);
+        const int read_size = recvfrom(t -> socket, t -> buffer,
+                                       DATAGRAM_BUFFER_SIZE, 0,
+                                       (struct sockaddr *) & packets[0].addr,
+                                       & addr_size);
+        if (read_size < 0)
+            return -1;
+        packets[0].data      = t -> buffer;
+        packets[0].length    = read_size;
+        packets[0].buffer_id = -1;
+        return 1;
+    }
+
+    struct uring * ring = & t -> ring;
+    while (ring -> ready_head == ring -> ready_tail) {
+        if (! ring -> recv_armed)
+            uring_arm_recv(ring, t -> socket);
+        const int rc = uring_submit(ring, 1, timeout_ns);
+        if (rc == -ETIME)
+            return -1;
+        if (rc < 0 && rc != -EINTR && rc != -EAGAIN && rc != -EBUSY) {
+            fprintf(stderr, "Error on io_uring_enter(): %s\n", strerror(- rc));
+            return -1;
+        }
+        uring_reap(ring);
+    }
+    int count = 0;
+    while (count < max_packets && ring -> ready_head != ring -> ready_tail)
+        packets[count++] =
+            ring -> ready[ring -> ready_head++ & (URING_BUFFER_COUNT - 1)];
+    return count;
+}
+
+/* done with a received packet which is not echoed */
+static inline void transport_release(struct transport *              t,
+                                     const struct transport_packet * packet) {
+    if (t -> kind == TRANSPORT_URING && packet -> buffer_id >= 0)
+        uring_recycle_buffer(& t -> ring, packet -> buffer_id);
+}
+
+/* send a copy of data; io_uring sends go out on transport_flush() */
+static inline void transport_send(struct transport *         t,
+                                  const void *               data,
+                                  const u_int                length,
+                                  const struct sockaddr_in * addr) {
+    if (t -> kind == TRANSPORT_SYSCALL) {
+        if (sendto(t -> socket, data, length, 0, (struct sockaddr *) addr,
+                   sizeof(struct sockaddr_in)) == -1)
+            fprintf(stderr, "Error on sending UDP packet.\n");
+        return;
+    }
+    if (length > BUFFER_SIZE) {
+        fprintf(stderr, "Packet of %u bytes exceeds the send buffer.\n", length);
+        return;
+    }
+    struct uring_send_slot * slot = uring_queue_send(t, addr);
+    memcpy(slot -> copy, data, length);
+    slot -> iov.iov_base = slot -> copy;
+    slot -> iov.iov_len  = length;
+    slot -> buffer_id    = -1;
+}
+
+/* send a received packet back to where it came from, without copying;
+   its buffer is released once the send completes */
+static inline void transport_echo(struct transport *              t,
+                                  const struct transport_packet * packet) {
+    if (t -> kind == TRANSPORT_SYSCALL) {
+        transport_send(t, packet -> data, packet -> length, & packet -> addr);
+        return;
+    }
+    struct uring_send_slot * slot = uring_queue_send(t, & packet -> addr);
+    slot -> iov.iov_base = packet -> data;
+    slot -> iov.iov_len  = packet -> length;
+    slot -> buffer_id    = packet -> buffer_id;
+}
+
+/* push the queued sends out in one go */
+static inline void transport_flush(struct transport * t) {
+    if (t -> kind == TRANSPORT_URING) {
+        uring_submit(& t -> ring, 0, 0);
+        uring_reap(& t -> ring);
+    }
+}
+
+#endif
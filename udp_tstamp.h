@@ -0,0 +1,156 @@
+#ifndef __udp_tstamp__
+#define __udp_tstamp__
+
+#include <stdio.h>  // fprintf(), stderr
+#include <string.h> // memset(), memcpy(), strncpy()
+#include <errno.h>  // errno, ENOMSG
+
+#include <net/if.h>           // ifreq, IFNAMSIZ
+#include <sys/ioctl.h>        // ioctl()
+#include <sys/socket.h>       // msghdr, cmsghdr, recvmsg(), SCM_TIMESTAMPING
+#include <sys/uio.h>          // iovec
+#include <linux/errqueue.h>   // sock_extended_err, scm_timestamping,
+                              // SO_EE_ORIGIN_TIMESTAMPING
+#include <linux/net_tstamp.h> // SOF_TIMESTAMPING_*, hwtstamp_config
+#include <linux/sockios.h>    // SIOCSHWTSTAMP
+
+#include "udp_common.h" // u_int, u_ll
+
+/* room for SCM_TIMESTAMPING plus the extended error of a TX stamp */
+#define TSTAMP_CONTROL_SIZE (256)
+
+/* kernel timestamps of one packet, CLOCK_REALTIME based, 0 if missing */
+struct pkt_tstamp {
+    u_ll sw_ns;
+    u_ll hw_ns;
+};
+
+static inline u_ll tstamp_timespec_ns(const struct timespec * ts) {
+    return (u_ll) ts -> tv_sec * (u_ll) 1E9 + ts -> tv_nsec;
+}
+
+/* software RX stamps always, TX stamps through the error queue if asked;
+   hardware stamps are reported whenever the NIC delivers them.
+   Falls back to SO_TIMESTAMPNS (RX only) on kernels without
+   SO_TIMESTAMPING. */
+void tstamp_enable_on_socket(const int socket,
+                             const int enable_tx) {
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE |
+                SOF_TIMESTAMPING_RX_HARDWARE |
+                SOF_TIMESTAMPING_SOFTWARE    |
+                SOF_TIMESTAMPING_RAW_HARDWARE;
+    if (enable_tx)
+        flags |= SOF_TIMESTAMPING_TX_SOFTWARE |
+                 SOF_TIMESTAMPING_TX_HARDWARE |
+                 SOF_TIMESTAMPING_OPT_ID      |
+                 SOF_TIMESTAMPING_OPT_TSONLY;
+    if (setsockopt(socket, SOL_SOCKET, SO_TIMESTAMPING,
+                   & flags, sizeof(flags)) == 0)
+        return;
+
+    const int enable = 1;
+    if (setsockopt(socket, SOL_SOCKET, SO_TIMESTAMPNS,
+                   & enable, sizeof(enable)) < 0) {
+        fprintf(stderr, "Error on enabling timestamping on socket.\n");
+        exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "SO_TIMESTAMPING unavailable, using SO_TIMESTAMPNS.\n");
+}
+
+/* ask the driver of an interface to stamp all packets in hardware;
+   needs CAP_NET_ADMIN, failure only means software stamps */
+void tstamp_enable_hw_on_interface(const int    socket,
+                                   const char * interface) {
+    struct hwtstamp_config config;
+    memset(& config, 0, sizeof(config));
+    config.tx_type   = HWTSTAMP_TX_ON;
+    config.rx_filter = HWTSTAMP_FILTER_ALL;
+
+    struct ifreq ifr;
+    memset(& ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, interface, IFNAMSIZ - 1);
+    ifr.ifr_data = (void *) & config;
+    if (ioctl(socket, SIOCSHWTSTAMP, & ifr) < 0)
+        fprintf(stderr, "No hardware timestamping on %s, using software.\n",
+                interface);
+}
+
+/* pick the stamps out of the control messages of a received packet */
+void tstamp_parse_cmsg(struct msghdr *     msg,
+                       struct pkt_tstamp * tstamp) {
+    tstamp -> sw_ns = tstamp -> hw_ns = 0;
+    struct cmsghdr * cmsg;
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg -> cmsg_level != SOL_SOCKET)
+            continue;
+        if (cmsg -> cmsg_type == SCM_TIMESTAMPING) {
+            struct scm_timestamping ts;
+            memcpy(& ts, CMSG_DATA(cmsg), sizeof(ts));
+            tstamp -> sw_ns = tstamp_timespec_ns(& ts.ts[0]);
+            tstamp -> hw_ns = tstamp_timespec_ns(& ts.ts[2]);
+        }
+        else if (cmsg -> cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(& ts, CMSG_DATA(cmsg), sizeof(ts));
+            tstamp -> sw_ns = tstamp_timespec_ns(& ts);
+        }
+    }
+}
+
+/* recvfrom() look-alike which also returns the kernel RX stamps */
+int tstamp_recvfrom(const int           socket,
+                    void *              buffer,
+                    const size_t        length,
+                    struct sockaddr_in * addr,
+                    socklen_t *         addr_size,
+                    struct pkt_tstamp * tstamp) {
+    char control[TSTAMP_CONTROL_SIZE];
+    struct iovec iov = { buffer, length };
+    struct msghdr msg;
+    memset(& msg, 0, sizeof(msg));
+    msg.msg_name       = addr;
+    msg.msg_namelen    = * addr_size;
+    msg.msg_iov        = & iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+
+    const int read_size = recvmsg(socket, & msg, 0);
+    if (read_size >= 0) {
+        * addr_size = msg.msg_namelen;
+        tstamp_parse_cmsg(& msg, tstamp);
+    }
+    return read_size;
+}
+
+/* fetch one TX stamp from the error queue without blocking;
+   id is the per-socket send counter (SOF_TIMESTAMPING_OPT_ID).
+   Returns 0 when the queue is empty. */
+int tstamp_read_tx(const int           socket,
+                   u_int *             id,
+                   struct pkt_tstamp * tstamp) {
+    char control[TSTAMP_CONTROL_SIZE];
+    struct msghdr msg;
+    memset(& msg, 0, sizeof(msg));
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(socket, & msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        return 0;
+
+    tstamp_parse_cmsg(& msg, tstamp);
+    * id = 0;
+    struct cmsghdr * cmsg;
+    for (cmsg = CMSG_FIRSTHDR(& msg); cmsg; cmsg = CMSG_NXTHDR(& msg, cmsg)) {
+        if ((cmsg -> cmsg_level == SOL_IP   && cmsg -> cmsg_type == IP_RECVERR) ||
+            (cmsg -> cmsg_level == SOL_IPV6 && cmsg -> cmsg_type == IPV6_RECVERR)) {
+            struct sock_extended_err err;
+            memcpy(& err, CMSG_DATA(cmsg), sizeof(err));
+            if (err.ee_errno == ENOMSG &&
+                err.ee_origin == SO_EE_ORIGIN_TIMESTAMPING)
+                * id = err.ee_data;
+        }
+    }
+    return 1;
+}
+
+#endif
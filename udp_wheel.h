@@ -0,0 +1,202 @@
+#ifndef __udp_wheel__
+#define __udp_wheel__
+
+#include <stdio.h>  // FILE, fprintf()
+#include <stdlib.h> // calloc(), free(), exit()
+#include <string.h> // memset()
+#include <time.h>   // timespec, clock_gettime()
+
+#include "udp_common.h" // u_int, u_ll, AVAILABLE_MONOTONIC_CLOCK
+#include "udp_hist.h"   // latency_hist, hist_record(), hist_print_summary()
+
+/* hierarchical timer wheel (Varghese and Lauck): four levels of 256
+   slots, level n holds the timers due within 256^(n + 1) ticks, so that
+   arming and removing a timer are O(1) and every tick touches one slot,
+   plus a cascade of one slot of the next level every 256 ticks. Timers
+   live in a caller sized array and are addressed by index; the wheel is
+   owned by a single thread. */
+#define WHEEL_LEVELS     (4)
+#define WHEEL_SLOT_BITS  (8)
+#define WHEEL_SLOTS      (1 << WHEEL_SLOT_BITS)
+#define WHEEL_SLOT_MASK  (WHEEL_SLOTS - 1)
+#define WHEEL_NIL        (~0U)
+#define WHEEL_TICK_NS    ((u_ll) 1E5)   // 100 us
+
+struct wheel_timer {
+    u_ll  expires; // tick
+    u_ll  id;
+    u_int next;
+    u_int prev;
+    u_int slot;    // level * WHEEL_SLOTS + slot, WHEEL_NIL if not armed
+};
+
+/* called for every timer which is due, with the id it was armed with */
+typedef void (* wheel_expire_fn)(u_ll id, void * arg);
+
+struct timer_wheel {
+    u_ll                 tick_ns;
+    u_ll                 now;       // every tick before it has been run
+    u_int                heads[WHEEL_LEVELS * WHEEL_SLOTS];
+    struct wheel_timer * timers;
+    u_int                capacity;
+
+    /* accounting */
+    u_ll                 armed;
+    u_ll                 removed;
+    u_ll                 expired;
+    u_ll                 cascaded;
+    struct latency_hist  cost;      // ns per wheel_advance() with work
+};
+
+void wheel_init(struct timer_wheel * wheel,
+                const u_int          capacity,
+                const u_ll           tick_ns,
+                const u_ll           now_ns) {
+    memset(wheel, 0, sizeof(struct timer_wheel));
+    wheel -> tick_ns  = tick_ns;
+    wheel -> now      = now_ns / tick_ns;
+    wheel -> capacity = capacity;
+    wheel -> timers   = calloc(capacity, sizeof(struct wheel_timer));
+    if (! wheel -> timers) {
+        fprintf(stderr, "Error allocating %u timers.\n", capacity);
+        exit(EXIT_FAILURE);
+    }
+    u_int i;
+    for (i = 0; i < WHEEL_LEVELS * WHEEL_SLOTS; ++i)
+        wheel -> heads[i] = WHEEL_NIL;
+    for (i = 0; i < capacity; ++i)
+        wheel -> timers[i].slot = WHEEL_NIL;
+    hist_init(& wheel -> cost);
+}
+
+void wheel_free(struct timer_wheel * wheel) {
+    free(wheel -> timers);
+    wheel -> timers = NULL;
+}
+
+static inline void wheel_link(struct timer_wheel * wheel,
+                              const u_int          index) {
+    struct wheel_timer * timer = & wheel -> timers[index];
+    const u_ll delta = timer -> expires > wheel -> now ?
+                       timer -> expires - wheel -> now : 0;
+    u_int level = 0;
+    while (level < WHEEL_LEVELS - 1 &&
+           delta >> (WHEEL_SLOT_BITS * (level + 1)))
+        ++level;
+    /* overdue timers run with the next tick, far ones wait in the top level */
+    const u_ll due = delta ? timer -> expires : wheel -> now;
+    timer -> slot  = level * WHEEL_SLOTS +
+                     ((due >> (WHEEL_SLOT_BITS * level)) & WHEEL_SLOT_MASK);
+    timer -> prev  = WHEEL_NIL;
+    timer -> next  = wheel -> heads[timer -> slot];
+    if (timer -> next != WHEEL_NIL)
+        wheel -> timers[timer -> next].prev = index;
+    wheel -> heads[timer -> slot] = index;
+}
+
+static inline void wheel_unlink(struct timer_wheel * wheel,
+                                const u_int          index) {
+    struct wheel_timer * timer = & wheel -> timers[index];
+    if (timer -> prev != WHEEL_NIL)
+        wheel -> timers[timer -> prev].next = timer -> next;
+    else
+        wheel -> heads[timer -> slot] = timer -> next;
+    if (timer -> next != WHEEL_NIL)
+        wheel -> timers[timer -> next].prev = timer -> prev;
+    timer -> slot = WHEEL_NIL;
+}
+
+static inline bool wheel_armed(const struct timer_wheel * wheel,
+                               const u_int                index) {
+    return wheel -> timers[index].slot != WHEEL_NIL;
+}
+
+/* disarm the timer at index, if it is armed */
+static inline void wheel_remove(struct timer_wheel * wheel,
+                                const u_int          index) {
+    if (! wheel_armed(wheel, index))
+        return;
+    wheel_unlink(wheel, index);
+    ++wheel -> removed;
+}
+
+/* (re)arm the timer at index to fire at deadline_ns */
+static inline void wheel_insert(struct timer_wheel * wheel,
+                                const u_int          index,
+                                const u_ll           id,
+                                const u_ll           deadline_ns) {
+    wheel_remove(wheel, index);
+    struct wheel_timer * timer = & wheel -> timers[index];
+    timer -> expires = (deadline_ns + wheel -> tick_ns - 1) / wheel -> tick_ns;
+    timer -> id      = id;
+    wheel_link(wheel, index);
+    ++wheel -> armed;
+}
+
+/* move the timers of one slot of an upper level down to where they
+   belong now */
+static void wheel_cascade(struct timer_wheel * wheel,
+                          const u_int          level) {
+    const u_int slot = level * WHEEL_SLOTS +
+                       ((wheel -> now >> (WHEEL_SLOT_BITS * level)) &
+                        WHEEL_SLOT_MASK);
+    u_int index = wheel -> heads[slot];
+    wheel -> heads[slot] = WHEEL_NIL;
+    while (index != WHEEL_NIL) {
+        const u_int next = wheel -> timers[index].next;
+        wheel_link(wheel, index);
+        ++wheel -> cascaded;
+        index = next;
+    }
+}
+
+/* run every tick up to now_ns; returns the number of expired timers */
+u_int wheel_advance(struct timer_wheel * wheel,
+                    const u_ll           now_ns,
+                    wheel_expire_fn      expire,
+                    void *               arg) {
+    const u_ll target = now_ns / wheel -> tick_ns;
+    if (target <= wheel -> now)
+        return 0;
+    struct timespec start, end;
+    clock_gettime(AVAILABLE_MONOTONIC_CLOCK, & start);
+    u_int fired = 0;
+    while (wheel -> now < target) {
+        /* the lower levels wrap: pull the next slots down */
+        u_int level;
+        for (level = 1; level < WHEEL_LEVELS; ++level) {
+            if ((wheel -> now >> (WHEEL_SLOT_BITS * (level - 1))) &
+                WHEEL_SLOT_MASK)
+                break;
+            wheel_cascade(wheel, level);
+        }
+        const u_int slot = wheel -> now & WHEEL_SLOT_MASK;
+        u_int index;
+        while ((index = wheel -> heads[slot]) != WHEEL_NIL) {
+            wheel_unlink(wheel, index);
+            ++wheel -> expired;
+            ++fired;
+            expire(wheel -> timers[index].id, arg);
+        }
+        ++wheel -> now;
+    }
+    if (fired) {
+        clock_gettime(AVAILABLE_MONOTONIC_CLOCK, & end);
+        hist_record(& wheel -> cost,
+                    (end.tv_sec - start.tv_sec) * (u_ll) 1E9 +
+                    end.tv_nsec - start.tv_nsec);
+    }
+    return fired;
+}
+
+/* arm/expire counts and what the expiry passes cost */
+void wheel_print_summary(const struct timer_wheel * wheel,
+                         FILE *                     out) {
+    fprintf(out, "Timer wheel: %.0f us ticks, armed %llu expired %llu "
+                 "removed %llu cascaded %llu\n", wheel -> tick_ns / 1E3,
+            wheel -> armed, wheel -> expired, wheel -> removed,
+            wheel -> cascaded);
+    hist_print_summary(& wheel -> cost, "Expiry pass cost", out);
+}
+
+#endif
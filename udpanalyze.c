@@ -0,0 +1,510 @@
+#include <stdlib.h>  // EXIT_SUCCESS, EXIT_FAILURE, strtod(), calloc()
+#include <stdio.h>   // fprintf(), stdout, stderr
+#include <string.h>  // memset()
+#include <unistd.h>  // getopt(), optarg, optind, sysconf()
+#include <pthread.h> // pthread_t, pthread_join()
+
+#include "dbg.h" // bool, TRUE, FALSE, DEBUG_PRINT()
+#include "udp_log.h"     // LOG_FLAG_SEND_ONLY, LOG_FLAG_KERNEL_TS
+#include "udp_results.h" // results_map_open(), results_value(), results_find_time()
+#include "udp_hist.h"    // latency_hist, hist_record(), hist_print_summary()
+#include "udp_seq.h"     // seq_stats, seq_print_summary()
+
+#define USAGE(exec_name) \
+  "Usage: " exec_name " [options] <results file> [<results file> ...]\n" \
+  "Analyses the columnar results files (-O) of clients and servers. The\n" \
+  "files of one side are merged, a client and a server are joined by\n" \
+  "sequence number to tell the forward from the return loss.\n" \
+  "Options:\n" \
+  "  [-j <threads>] (=CPUs)   -- parallel scan threads\n" \
+  "  [-t <from>-<to>]         -- only packets received from <from> up to <to>\n" \
+  "                              s after the start, either may be left out\n" \
+  "  [-d <interval>]          -- time series, a CSV line per <interval> s\n"
+
+#define MAX_FILES        (256)
+#define MIN_PART_ROWS    (RESULTS_GROUP_ROWS)
+#define PARTS_PER_THREAD (4)
+
+/* the files of the client or of the server side */
+struct side {
+    const char *       name;
+    struct results_map maps[MAX_FILES];
+    u_ll               first[MAX_FILES]; // rows in the time window
+    u_ll               end[MAX_FILES];
+    u_int              count;
+    u_ll               sent;
+    u_ll               min_seq;
+    u_ll               max_seq;
+    u_ll *             seen;             // bitmap over the sequence numbers
+    u_ll               span_ns;          // of the longest file
+    struct seq_stats   seq;
+    struct latency_hist rtt;
+    struct latency_hist kernel_rtt;
+};
+
+/* a range of rows of one file, scanned by one thread */
+struct part {
+    struct side *       side;
+    u_int               file;
+    u_ll                first;
+    u_ll                end;
+    u_ll                min_seq;
+    u_ll                max_seq;
+    u_ll                prior_max;  // highest sequence number before the part,
+                                    // plus one, 0: none
+    u_ll                received;
+    u_ll                duplicates;
+    u_ll                reordered;
+    u_ll                distance_sum;
+    u_ll                distance_max;
+    u_ll                density[SEQ_DENSITY_MAX + 1];
+    struct latency_hist rtt;
+    struct latency_hist kernel_rtt;
+};
+
+/* one interval of the time series over all files of a side */
+struct interval {
+    struct side * side;
+    u_ll          from_ns;   // after the start of each file
+    u_ll          to_ns;
+    u_ll          received;
+    u_ll          lost;
+    u_ll          reordered;
+    u_ll          p50_ns;
+    u_ll          p99_ns;
+    u_ll          max_ns;
+};
+
+/* initialize variables */
+u_int  thread_count = 0;
+double window_from  = 0;
+double window_to    = 0;    // 0: until the end
+double interval_s   = 0;
+
+struct side client = { .name = "Client" };
+struct side server = { .name = "Server" };
+
+/* work list shared by the scan threads */
+void *       jobs;
+size_t       job_size;
+u_ll         job_count;
+u_ll         next_job;
+void      (* job_fn)(void *);
+
+void * scan_thread(void * arg) {
+    (void) arg;
+    u_ll job;
+    while ((job = __atomic_fetch_add(& next_job, 1, __ATOMIC_RELAXED)) < job_count)
+        job_fn((char *) jobs + job * job_size);
+    return NULL;
+}
+
+/* run fn over count jobs on all threads */
+void run_parallel(void *       list,
+                  const size_t size,
+                  const u_ll   count,
+                  void      (* fn)(void *)) {
+    jobs      = list;
+    job_size  = size;
+    job_count = count;
+    job_fn    = fn;
+    next_job  = 0;
+    pthread_t threads[thread_count];
+    u_int i;
+    for (i = 0; i < thread_count; ++i)
+        start_thread(& threads[i], scan_thread, NULL);
+    for (i = 0; i < thread_count; ++i)
+        pthread_join(threads[i], NULL);
+}
+
+/* pass 1: the range of sequence numbers */
+void scan_range(void * arg) {
+    struct part * part = arg;
+    const struct results_map * map = & part -> side -> maps[part -> file];
+    part -> min_seq = ~0ULL;
+    part -> max_seq = 0;
+    u_ll row;
+    for (row = part -> first; row < part -> end; ++row) {
+        const u_ll seq = results_value(map, RESULTS_SEQ_NUM, row);
+        if (seq < part -> min_seq)
+            part -> min_seq = seq;
+        if (seq > part -> max_seq)
+            part -> max_seq = seq;
+    }
+}
+
+/* pass 2: duplicates against the shared bitmap, reordering against the
+   highest sequence number received so far, the latency columns */
+void scan_rows(void * arg) {
+    struct part * part = arg;
+    struct side * side = part -> side;
+    const struct results_map * map = & side -> maps[part -> file];
+    hist_init(& part -> rtt);
+    hist_init(& part -> kernel_rtt);
+    u_ll highest = part -> prior_max;
+    u_ll row;
+    for (row = part -> first; row < part -> end; ++row) {
+        const u_ll * column = results_column(map, RESULTS_SEQ_NUM, row);
+        const u_ll   index  = row & (RESULTS_GROUP_ROWS - 1);
+        const u_ll   seq    = column[index];
+        const u_int  flags  = results_flags(map, row);
+        ++part -> received;
+        const u_ll bit  = seq - side -> min_seq;
+        const u_ll mask = 1ULL << (bit & 63);
+        if (__atomic_fetch_or(& side -> seen[bit / 64], mask,
+                              __ATOMIC_RELAXED) & mask) {
+            ++part -> duplicates;
+            continue;
+        }
+        if (seq + 1 < highest) {
+            const u_ll distance = highest - 1 - seq;
+            ++part -> reordered;
+            part -> distance_sum += distance;
+            if (distance > part -> distance_max)
+                part -> distance_max = distance;
+            ++part -> density[distance < SEQ_DENSITY_MAX ? distance : SEQ_DENSITY_MAX];
+        }
+        else
+            highest = seq + 1;
+        if (flags & (LOG_FLAG_SERVER | LOG_FLAG_SEND_ONLY))
+            continue;
+        hist_record(& part -> rtt, column[RESULTS_RTT_NS * RESULTS_GROUP_ROWS + index]);
+        if (flags & LOG_FLAG_KERNEL_TS)
+            hist_record(& part -> kernel_rtt,
+                        column[RESULTS_KERN_NS * RESULTS_GROUP_ROWS + index]);
+    }
+}
+
+/* one line of the time series; reordering counts within the interval */
+void scan_interval(void * arg) {
+    struct interval * interval = arg;
+    struct side * side = interval -> side;
+    struct latency_hist rtt;
+    hist_init(& rtt);
+    u_ll min_seq = ~0ULL, max_seq = 0;
+    u_int file;
+    for (file = 0; file < side -> count; ++file) {
+        const struct results_map * map = & side -> maps[file];
+        const u_ll start = map -> header -> start_ns;
+        u_ll row       = results_find_time(map, start + interval -> from_ns);
+        const u_ll end = results_find_time(map, start + interval -> to_ns);
+        u_ll highest = 0;
+        for (; row < end; ++row) {
+            const u_ll seq   = results_value(map, RESULTS_SEQ_NUM, row);
+            const u_int flags = results_flags(map, row);
+            ++interval -> received;
+            if (seq < min_seq)
+                min_seq = seq;
+            if (seq > max_seq)
+                max_seq = seq;
+            if (seq + 1 < highest)
+                ++interval -> reordered;
+            else
+                highest = seq + 1;
+            if (! (flags & (LOG_FLAG_SERVER | LOG_FLAG_SEND_ONLY)))
+                hist_record(& rtt, results_value(map, RESULTS_RTT_NS, row));
+        }
+    }
+    /* gaps in the sequence numbers of the interval */
+    if (interval -> received && max_seq - min_seq + 1 > interval -> received)
+        interval -> lost = max_seq - min_seq + 1 - interval -> received;
+    if (rtt.total) {
+        interval -> p50_ns = hist_percentile(& rtt, 0.5);
+        interval -> p99_ns = hist_percentile(& rtt, 0.99);
+        interval -> max_ns = rtt.max;
+    }
+}
+
+/* cut the rows of every file of a side into parts of the time window */
+struct part * make_parts(struct side * side,
+                         u_ll *        count) {
+    u_ll rows = 0;
+    u_int file;
+    for (file = 0; file < side -> count; ++file) {
+        const struct results_map * map = & side -> maps[file];
+        const u_ll start = map -> header -> start_ns;
+        side -> first[file] = results_find_time(map, start + window_from * 1E9);
+        side -> end[file]   = window_to > 0 ?
+                              results_find_time(map, start + window_to * 1E9) :
+                              map -> rows;
+        if (side -> end[file] < side -> first[file])
+            side -> end[file] = side -> first[file];
+        rows += side -> end[file] - side -> first[file];
+        if (map -> rows &&
+            results_value(map, RESULTS_RECV_NS, map -> rows - 1) - start > side -> span_ns)
+            side -> span_ns = results_value(map, RESULTS_RECV_NS, map -> rows - 1) - start;
+    }
+    u_ll part_rows = rows / (thread_count * PARTS_PER_THREAD) + 1;
+    if (part_rows < MIN_PART_ROWS)
+        part_rows = MIN_PART_ROWS;
+
+    struct part * parts = calloc(rows / part_rows + side -> count + 1,
+                                 sizeof(struct part));
+    if (! parts) {
+        fprintf(stderr, "Error allocating scan parts.\n");
+        exit(EXIT_FAILURE);
+    }
+    * count = 0;
+    for (file = 0; file < side -> count; ++file) {
+        u_ll first;
+        for (first = side -> first[file]; first < side -> end[file]; first += part_rows) {
+            struct part * part = & parts[(* count)++];
+            part -> side  = side;
+            part -> file  = file;
+            part -> first = first;
+            part -> end   = first + part_rows < side -> end[file] ?
+                            first + part_rows : side -> end[file];
+        }
+    }
+    return parts;
+}
+
+/* both passes over a side, then the merge of the parts */
+void analyze_side(struct side * side) {
+    u_ll count, i;
+    struct part * parts = make_parts(side, & count);
+    hist_init(& side -> rtt);
+    hist_init(& side -> kernel_rtt);
+    memset(& side -> seq, 0, sizeof(side -> seq));
+    if (count == 0) {
+        free(parts);
+        return;
+    }
+
+    run_parallel(parts, sizeof(struct part), count, scan_range);
+    side -> min_seq = ~0ULL;
+    side -> max_seq = 0;
+    u_ll highest = 0;
+    for (i = 0; i < count; ++i) {
+        if (i && parts[i].file != parts[i - 1].file)
+            highest = 0;
+        parts[i].prior_max = highest;
+        if (parts[i].max_seq + 1 > highest)
+            highest = parts[i].max_seq + 1;
+        if (parts[i].min_seq < side -> min_seq)
+            side -> min_seq = parts[i].min_seq;
+        if (parts[i].max_seq > side -> max_seq)
+            side -> max_seq = parts[i].max_seq;
+    }
+
+    side -> seen = calloc((side -> max_seq - side -> min_seq) / 64 + 1, sizeof(u_ll));
+    if (! side -> seen) {
+        fprintf(stderr, "Error allocating the bitmap of %llu sequence numbers.\n",
+                side -> max_seq - side -> min_seq + 1);
+        exit(EXIT_FAILURE);
+    }
+    run_parallel(parts, sizeof(struct part), count, scan_rows);
+
+    u_ll received = 0, duplicates = 0;
+    for (i = 0; i < count; ++i) {
+        received              += parts[i].received;
+        duplicates            += parts[i].duplicates;
+        side -> seq.reordered += parts[i].reordered;
+        side -> seq.distance_sum += parts[i].distance_sum;
+        if (parts[i].distance_max > side -> seq.distance_max)
+            side -> seq.distance_max = parts[i].distance_max;
+        u_int d;
+        for (d = 0; d <= SEQ_DENSITY_MAX; ++d)
+            side -> seq.density[d] += parts[i].density[d];
+        hist_merge(& side -> rtt, & parts[i].rtt);
+        hist_merge(& side -> kernel_rtt, & parts[i].kernel_rtt);
+    }
+    free(parts);
+
+    /* without a window a client knows how many it sent */
+    const u_ll expected = side -> sent && window_from == 0 && window_to == 0 ?
+                          side -> sent - side -> min_seq :
+                          side -> max_seq - side -> min_seq + 1;
+    side -> seq.received   = received - duplicates;
+    side -> seq.duplicates = duplicates;
+    side -> seq.in_order   = side -> seq.received - side -> seq.reordered;
+    side -> seq.lost       = expected > side -> seq.received ?
+                             expected - side -> seq.received : 0;
+}
+
+/* set bits of the bitmap of a side between two sequence numbers */
+u_ll count_seen(const struct side * side,
+                const u_ll          from,
+                const u_ll          to,
+                const struct side * other) {
+    u_ll seq, count = 0;
+    for (seq = from; seq <= to && seq <= side -> max_seq; ++seq) {
+        if (seq < side -> min_seq)
+            continue;
+        const u_ll bit = seq - side -> min_seq;
+        /* whole words when both bitmaps are word aligned there */
+        if (! other && bit % 64 == 0 && seq + 63 <= to && seq + 63 <= side -> max_seq) {
+            count += __builtin_popcountll(side -> seen[bit / 64]);
+            seq += 63;
+            continue;
+        }
+        if (! (side -> seen[bit / 64] & (1ULL << (bit & 63))))
+            continue;
+        if (other) {
+            if (seq < other -> min_seq || seq > other -> max_seq)
+                continue;
+            const u_ll other_bit = seq - other -> min_seq;
+            if (! (other -> seen[other_bit / 64] & (1ULL << (other_bit & 63))))
+                continue;
+        }
+        ++count;
+    }
+    return count;
+}
+
+void print_side(const struct side * side) {
+    if (! side -> count)
+        return;
+    u_ll rows = 0;
+    u_int file;
+    for (file = 0; file < side -> count; ++file)
+        rows += side -> end[file] - side -> first[file];
+    fprintf(stdout, "%s: %u file%s, %llu records, %.3f s\n", side -> name,
+            side -> count, side -> count == 1 ? "" : "s", rows,
+            side -> span_ns / 1E9);
+    if (! rows)
+        return;
+    seq_print_summary(& side -> seq, "Sequence", stdout);
+    if (side -> rtt.total)
+        hist_print_summary(& side -> rtt, "Latency", stdout);
+    if (side -> kernel_rtt.total)
+        hist_print_summary(& side -> kernel_rtt, "Kernel latency", stdout);
+}
+
+/* a request which never got to the server is lost on the way there, one
+   the server saw without a reply coming back on the way back */
+void print_join(void) {
+    if (! client.seq.received || ! server.seq.received)
+        return;
+    const u_ll from     = client.min_seq;
+    const u_ll to       = client.sent && window_from == 0 && window_to == 0 ?
+                          client.sent - 1 : client.max_seq;
+    const u_ll expected = to - from + 1;
+    const u_ll arrived  = count_seen(& server, from, to, NULL);
+    const u_ll both     = count_seen(& client, from, to, & server);
+    fprintf(stdout, "Join: requests %llu at the server %llu lost forward %llu "
+                    "(%.3f%%) lost on return %llu (%.3f%%) replies without "
+                    "a server record %llu\n",
+            expected, arrived, expected - arrived,
+            100.0 * (expected - arrived) / expected, arrived - both,
+            arrived ? 100.0 * (arrived - both) / arrived : 0.0,
+            client.seq.received - both);
+}
+
+void print_series(struct side * side) {
+    if (! side -> count || interval_s <= 0)
+        return;
+    const u_ll from_ns     = window_from * 1E9;
+    const u_ll to_ns       = window_to > 0 ? window_to * 1E9 : side -> span_ns + 1;
+    const u_ll interval_ns = interval_s * 1E9;
+    if (to_ns <= from_ns)
+        return;
+    const u_ll count = (to_ns - from_ns + interval_ns - 1) / interval_ns;
+    struct interval * intervals = calloc(count, sizeof(struct interval));
+    if (! intervals) {
+        fprintf(stderr, "Error allocating %llu intervals.\n", count);
+        exit(EXIT_FAILURE);
+    }
+    u_ll i;
+    for (i = 0; i < count; ++i) {
+        intervals[i].side    = side;
+        intervals[i].from_ns = from_ns + i * interval_ns;
+        intervals[i].to_ns   = intervals[i].from_ns + interval_ns < to_ns ?
+                               intervals[i].from_ns + interval_ns : to_ns;
+    }
+    run_parallel(intervals, sizeof(struct interval), count, scan_interval);
+    for (i = 0; i < count; ++i)
+        fprintf(stdout, "%.3f,%s,%llu,%llu,%llu,%.3f,%.3f,%.3f\n",
+                intervals[i].from_ns / 1E9, side -> name, intervals[i].received,
+                intervals[i].lost, intervals[i].reordered,
+                intervals[i].p50_ns / 1E3, intervals[i].p99_ns / 1E3,
+                intervals[i].max_ns / 1E3);
+    free(intervals);
+}
+
+int main(int argc, char ** argv) {
+
+    int cmd_flag;
+    opterr = 0;
+    while ((cmd_flag = getopt(argc, argv, ":j:t:d:")) != -1) {
+        switch (cmd_flag) {
+            case 'j':
+                thread_count = strtoul(optarg, NULL, 10);
+                break;
+            case 't': {
+                char * end;
+                window_from = strtod(optarg, & end);
+                if (* end == '-')
+                    window_to = strtod(end + 1, NULL);
+                break;
+            }
+            case 'd':
+                interval_s = strtod(optarg, NULL);
+                break;
+            case ':':
+                fprintf(stderr, "Option -%c requires an argument.\n", optopt);
+                exit(EXIT_FAILURE);
+            default:
+                fprintf(stderr, USAGE("%s"), argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, USAGE("%s"), argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (window_to > 0 && window_to <= window_from) {
+        fprintf(stderr, "Time window %.3f-%.3f s is empty.\n", window_from, window_to);
+        exit(EXIT_FAILURE);
+    }
+    if (! thread_count) {
+        const long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = cpu_count > 0 ? cpu_count : 1;
+    }
+
+    /* sort the files by side */
+    int i;
+    for (i = optind; i < argc; ++i) {
+        struct results_map map;
+        if (! results_map_open(& map, argv[i]))
+            exit(EXIT_FAILURE);
+        struct side * side = map.header -> flags & RESULTS_FLAG_SERVER ?
+                             & server : & client;
+        if (side -> count == MAX_FILES) {
+            fprintf(stderr, "More than %u %s files.\n", MAX_FILES, side -> name);
+            exit(EXIT_FAILURE);
+        }
+        if (! (map.header -> flags & RESULTS_FLAG_CLOSED))
+            fprintf(stderr, "%s is still being written (or the run was killed), "
+                            "%llu records so far.\n", argv[i], map.rows);
+        side -> sent += map.header -> sent;
+        side -> maps[side -> count++] = map;
+    }
+    if (client.count > 1 && client.sent) {
+        /* several clients count their sequence numbers each from 0 */
+        fprintf(stderr, "Sequence numbers of %u client files overlap, the loss "
+                        "is not meaningful.\n", client.count);
+    }
+
+    analyze_side(& client);
+    analyze_side(& server);
+    print_side(& client);
+    print_side(& server);
+    print_join();
+
+    if (interval_s > 0) {
+        fprintf(stdout, "time_s,side,received,lost,reordered,p50_us,p99_us,max_us\n");
+        print_series(& client);
+        print_series(& server);
+    }
+
+    for (i = 0; i < (int) client.count; ++i)
+        results_map_close(& client.maps[i]);
+    for (i = 0; i < (int) server.count; ++i)
+        results_map_close(& server.maps[i]);
+    free(client.seen);
+    free(server.seen);
+    DEBUG_PRINT("Analyzed %u client and %u server files.\n", client.count, server.count);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,68 @@
+#include <stdlib.h> // EXIT_SUCCESS, EXIT_FAILURE, strtoul()
+#include <stdio.h>  // fprintf(), stdout, stderr
+#include <errno.h>  // errno, ESRCH
+#include <signal.h> // kill()
+#include <time.h>   // timespec, nanosleep(), clock_gettime()
+
+#include "dbg.h" // bool, TRUE, FALSE
+#include "udp_stats.h"
+
+#define USAGE(exec_name) \
+  "Usage: " exec_name " <name> [<interval s> [<reports>]]\n" \
+  "Polls the live counters a client or server publishes with -M <name>.\n" \
+  "Interval 0 prints the averages and totals since the start once.\n"
+
+static u_ll monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, & ts);
+    return ts.tv_sec * (u_ll) 1E9 + ts.tv_nsec;
+}
+
+int main(int argc, char ** argv) {
+
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, USAGE("%s"), argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    const u_int interval_s = argc > 2 ? strtoul(argv[2], NULL, 10) : 1;
+    const u_ll  reports    = argc > 3 ? strtoull(argv[3], NULL, 10) : 0;
+
+    const struct stats_segment * segment = stats_attach(argv[1]);
+    if (! segment)
+        exit(EXIT_FAILURE);
+    const double up = (realtime_ns() - segment -> start_ns) / 1E9;
+    fprintf(stdout, "%s pid %i, %u slots, up %.1f s\n", segment -> role,
+            segment -> pid, segment -> slot_count, up);
+
+    /* snapshots are large, keep them off the stack */
+    static struct stats_counters before, now, delta;
+    stats_snapshot(segment, & now);
+    if (interval_s == 0) {
+        memset(& before, 0, sizeof(before));
+        hist_init(& before.latency);
+        stats_diff(& delta, & now, & before);
+        stats_print_interval(& delta, up > 0 ? up : 1, up, stdout);
+        stats_print_totals(& now, stdout);
+        return EXIT_SUCCESS;
+    }
+
+    /* the counters of a killed process stay behind, its pid tells */
+    u_ll count, before_ns = monotonic_ns();
+    for (count = 0; reports == 0 || count < reports; ++count) {
+        before = now;
+        const struct timespec nap = { interval_s, 0 };
+        nanosleep(& nap, NULL);
+        if (kill(segment -> pid, 0) == -1 && errno == ESRCH) {
+            fprintf(stderr, "Process %i has exited.\n", segment -> pid);
+            break;
+        }
+        const u_ll now_ns = monotonic_ns();
+        stats_snapshot(segment, & now);
+        stats_diff(& delta, & now, & before);
+        stats_print_interval(& delta, (now_ns - before_ns) / 1E9,
+                             (realtime_ns() - segment -> start_ns) / 1E9, stdout);
+        before_ns = now_ns;
+    }
+
+    return EXIT_SUCCESS;
+}